@@ -0,0 +1,255 @@
+/**************************************************************
+Filename: background_model.c
+Description:
+  Streaming background subtraction. Each pixel keeps a running
+  average of the scene in 8.8 fixed point that is updated in
+  place as frames arrive, and motion is measured against that
+  average instead of the previous frame. Every frame is decoded
+  once, memory stays constant, and each frame is split into row
+  tiles that run in parallel on the shared thread pool.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "background_model.h"
+#include "handle_motion.h"
+#include "motion_config.h"
+#include "thread_pool.h"
+#include "frame_pool.h"
+#include "motion_kernel.h"
+#include "metrics.h"
+
+typedef struct {
+    BackgroundModel* model;
+    const unsigned char* frame;
+    unsigned char* mask;
+    const RoiGrid* roi;         // NULL = every pixel is watched
+    int first_row;
+    int last_row;               // Exclusive
+    unsigned char threshold;
+    int learning_shift;
+    int motion_pixels;          // Result for this tile
+} BackgroundTile;
+
+typedef struct {
+    const char* input_path;
+    int index;
+    GrayFrame frame;
+} FrameLoad;
+
+typedef struct {
+    const char* output_path;
+    int index;
+    unsigned char* mask;
+    int width;
+    int height;
+    int motion_pixels;
+} MaskSave;
+
+// Function to create a background model for frames of the given size
+BackgroundModel* background_model_create(int width, int height) {
+    BackgroundModel* model = (BackgroundModel*)malloc(sizeof(BackgroundModel));
+    model->width = width;
+    model->height = height;
+    model->mean = (uint16_t*)malloc((size_t)width * height * sizeof(uint16_t));
+    if (!model->mean) {
+        fprintf(stderr, "Error: Could not allocate a %dx%d background model\n", width, height);
+        exit(EXIT_FAILURE);                                                     // Exit if the model cannot be allocated
+    }
+    model->initialized = 0;
+    return model;
+}
+
+void background_model_destroy(BackgroundModel* model) {
+    if (model) {
+        free(model->mean);
+        free(model);
+    }
+}
+
+// Function to threshold a span of pixels against the background and update the background in place
+// region, when given, marks the watched pixels; the others are cleared in the mask and not learned
+static int update_span(BackgroundTile* tile, int begin, int end, const unsigned char* region) {
+    uint16_t* mean = tile->model->mean;
+    int count = 0;
+    for (int i = begin; i < end; ++i) {
+        if (region && !region[i]) {
+            tile->mask[i] = 0;
+            continue;
+        }
+        int pixel = tile->frame[i];
+        int background = (mean[i] + 128) >> 8;                                 // Round the fixed-point average
+        int diff = pixel > background ? pixel - background : background - pixel;
+        int moving = diff > tile->threshold;
+        tile->mask[i] = moving ? 255 : 0;
+        count += moving;
+        int shift = tile->learning_shift + (moving ? BACKGROUND_FOREGROUND_SLOWDOWN : 0);  // Motion blends in more slowly
+        int delta = (pixel << 8) - mean[i];
+        mean[i] += delta >= 0 ? delta >> shift : -((-delta) >> shift);         // Symmetric rounding, no drift toward black
+    }
+    return count;
+}
+
+// Function to threshold one band of rows against the background, skipping the tiles outside the region of interest
+static void apply_tile(void* arg) {
+    BackgroundTile* tile = (BackgroundTile*)arg;
+    uint64_t start = metrics_now();                                             // Timed per tile, on whichever thread runs it
+    int width = tile->model->width;
+    const RoiGrid* roi = tile->roi;
+    int count = 0;
+    if (!roi) {
+        count = update_span(tile, tile->first_row * width, tile->last_row * width, NULL);
+    } else {
+        int tiles_x = (width + MOTION_TILE_WIDTH - 1) / MOTION_TILE_WIDTH;
+        for (int y = tile->first_row; y < tile->last_row; ++y) {
+            const unsigned char* states = roi->tiles + (y / MOTION_TILE_HEIGHT) * tiles_x;
+            int row = y * width;
+            for (int tx = 0; tx < tiles_x; ++tx) {
+                int x0 = tx * MOTION_TILE_WIDTH;
+                int x1 = (x0 + MOTION_TILE_WIDTH < width) ? x0 + MOTION_TILE_WIDTH : width;
+                if (states[tx] == TILE_IGNORED) {                               // Never compared, never learned
+                    memset(tile->mask + row + x0, 0, x1 - x0);
+                } else {
+                    count += update_span(tile, row + x0, row + x1, states[tx] == TILE_PARTIAL ? roi->pixels : NULL);
+                }
+            }
+        }
+    }
+    tile->motion_pixels = count;
+    metrics_stage_end(METRIC_DETECT, start);
+}
+
+// Function to compare a frame with the background and learn from it
+// Returns the motion pixel count, or -1 when the frame only seeded the model
+int background_model_apply(BackgroundModel* model, const unsigned char* frame, unsigned char* mask, const RoiGrid* roi,
+                           unsigned char threshold, int learning_shift) {
+    int count = model->width * model->height;
+    if (!model->initialized) {                                                  // First frame becomes the background
+        for (int i = 0; i < count; ++i) {
+            model->mean[i] = frame[i] << 8;
+        }
+        model->initialized = 1;
+        return -1;
+    }
+    int num_tiles = (model->height + BACKGROUND_TILE_ROWS - 1) / BACKGROUND_TILE_ROWS;
+    BackgroundTile* tiles = (BackgroundTile*)malloc(num_tiles * sizeof(BackgroundTile));
+    for (int t = 0; t < num_tiles; ++t) {
+        tiles[t].model = model;
+        tiles[t].frame = frame;
+        tiles[t].mask = mask;
+        tiles[t].roi = roi;
+        tiles[t].first_row = t * BACKGROUND_TILE_ROWS;
+        tiles[t].last_row = (t == num_tiles - 1) ? model->height : tiles[t].first_row + BACKGROUND_TILE_ROWS;
+        tiles[t].threshold = threshold;
+        tiles[t].learning_shift = learning_shift;
+    }
+    if (num_tiles == 1) {
+        apply_tile(&tiles[0]);                                                  // Too small to be worth splitting
+    } else {
+        ThreadPool* pool = shared_thread_pool();
+        TaskGroup group;
+        task_group_init(&group);
+        thread_pool_submit_range(pool, &group, apply_tile, tiles, sizeof(BackgroundTile), num_tiles);
+        thread_pool_wait(pool, &group);                                         // Tiles are disjoint, so no locking inside
+        task_group_destroy(&group);
+    }
+    int motion_pixels = 0;
+    for (int t = 0; t < num_tiles; ++t) {
+        motion_pixels += tiles[t].motion_pixels;
+    }
+    free(tiles);
+    return motion_pixels;
+}
+
+// Task to decode the next frame while the current one is processed
+static void load_frame_task(void* arg) {
+    FrameLoad* load = (FrameLoad*)arg;
+    if (!load_gray_frame(load->input_path, load->index, &load->frame)) {
+        load->frame.pixels = NULL;
+    }
+}
+
+// Task to write a finished mask
+static void save_mask_task(void* arg) {
+    MaskSave* save = (MaskSave*)arg;
+    save_motion_frame(save->output_path, save->index, save->mask, save->width, save->height, save->motion_pixels);
+    frame_buffer_release(save->mask);
+}
+
+// Function to detect motion against a running background, one decode per frame
+void process_frames_background(const char* input_path, const char* output_path, int total_frames, int start_frame) {
+    ThreadPool* pool = shared_thread_pool();
+    int max_saves = thread_pool_size(pool);                                     // Masks being written while later frames are processed
+    MaskSave* saves = (MaskSave*)malloc(max_saves * sizeof(MaskSave));
+    int pending_saves = 0;
+    TaskGroup save_group, load_group;
+    task_group_init(&save_group);
+    task_group_init(&load_group);
+
+    BackgroundModel* model = NULL;
+    int first = start_frame > 0 ? start_frame - 1 : start_frame;                // A continued range seeds from the frame before it
+    FrameLoad current = { input_path, first, { NULL, 0, 0 } };
+    FrameLoad next = { input_path, 0, { NULL, 0, 0 } };
+    load_frame_task(&current);
+
+    for (int i = first; i < total_frames; ++i) {
+        if (i + 1 < total_frames) {                                             // Decode ahead on the pool
+            next.index = i + 1;
+            thread_pool_submit(pool, &load_group, load_frame_task, &next);
+        }
+        GrayFrame* frame = &current.frame;
+        if (!frame->pixels) {
+            if (i >= start_frame) {
+                printf("Error: Cannot load frame %d in %s. Skipping...\n", i, input_path);
+            }
+            if (i >= first_mask_frame(start_frame)) {                          // The video must not wait for it
+                skip_motion_frame(output_path, i);
+            }
+        } else {
+            if (model && (model->width != frame->width || model->height != frame->height)) {
+                printf("Frame %d size differs from the background. Restarting the model.\n", i);
+                background_model_destroy(model);
+                model = NULL;
+            }
+            if (!model) {
+                model = background_model_create(frame->width, frame->height);
+            }
+            unsigned char* mask = frame_buffer_acquire((size_t)frame->width * frame->height);
+            int motion_pixels = background_model_apply(model, frame->pixels, mask, motion_roi(output_path, frame->width, frame->height),
+                                                       motion_config.threshold, motion_config.learning_shift);
+            if (motion_pixels < 0 || i < start_frame) {                         // Seed frames produce no output
+                frame_buffer_release(mask);
+                if (i >= first_mask_frame(start_frame)) {                      // A reseed after a size change
+                    skip_motion_frame(output_path, i);
+                }
+            } else {
+                if (pending_saves == max_saves) {                               // Bound the masks in flight
+                    thread_pool_wait(pool, &save_group);
+                    pending_saves = 0;
+                }
+                MaskSave* save = &saves[pending_saves++];
+                save->output_path = output_path;
+                save->index = i;
+                save->mask = mask;
+                save->width = frame->width;
+                save->height = frame->height;
+                save->motion_pixels = motion_pixels;
+                thread_pool_submit(pool, &save_group, save_mask_task, save);
+            }
+            free_gray_frame(frame);
+        }
+        if (i + 1 < total_frames) {
+            thread_pool_wait(pool, &load_group);
+            current.frame = next.frame;
+        }
+    }
+    thread_pool_wait(pool, &save_group);
+
+    task_group_destroy(&save_group);
+    task_group_destroy(&load_group);
+    background_model_destroy(model);
+    free(saves);
+}
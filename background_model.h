@@ -0,0 +1,23 @@
+#ifndef BACKGROUND_MODEL_H
+#define BACKGROUND_MODEL_H
+
+#include <stdint.h>
+#include "roi_mask.h"
+
+#define BACKGROUND_TILE_ROWS 32         // Rows per tile when a frame is split across the pool
+#define BACKGROUND_FOREGROUND_SLOWDOWN 2 // Extra shift for pixels seen as motion, so slow objects are not absorbed
+
+typedef struct {
+    int width;
+    int height;
+    uint16_t* mean;                     // Per-pixel background in 8.8 fixed point
+    int initialized;                    // 0 until the first frame seeds the model
+} BackgroundModel;
+
+BackgroundModel* background_model_create(int width, int height);
+void background_model_destroy(BackgroundModel* model);
+int background_model_apply(BackgroundModel* model, const unsigned char* frame, unsigned char* mask, const RoiGrid* roi,
+                           unsigned char threshold, int learning_shift);
+void process_frames_background(const char* input_path, const char* output_path, int total_frames, int start_frame);
+
+#endif
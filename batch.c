@@ -0,0 +1,296 @@
+/**************************************************************
+Filename: batch.c
+Description:
+  Headless batch mode. Runs many videos or frame directories
+  through motion detection at the same time, each into its own
+  output directory. A fixed number of job threads take jobs from
+  a shared list, and every job's frame work goes to the one
+  shared worker pool, so short clips keep all cores busy instead
+  of running one after another.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "main.h"
+#include "handle_motion.h"
+#include "image_utils.h"
+#include "metrics.h"
+#include "motion_config.h"
+#include "roi_mask.h"
+#include "frame_pack.h"
+
+typedef struct {
+    char input[MAX_PATH];
+    char output[MAX_PATH];
+    char roi[MAX_PATH];         // Mask for this source only, empty = the --roi or --ignore-mask one
+    int roi_ignore;
+    int frames;                 // Frames processed, -1 if the job failed
+    double seconds;
+} BatchJob;
+
+typedef struct {
+    BatchJob* jobs;
+    int num_jobs;
+    int capacity;
+    int next_job;               // Next job to hand out, taken with an atomic increment
+    int finished;
+    int extract;
+} BatchRun;
+
+// Function to add a job, naming its output directory after the input when none is given
+static int add_job(BatchRun* run, const char* input, const char* output, const char* output_root) {
+    if (strlen(input) >= MAX_PATH || (output && strlen(output) >= MAX_PATH)) {
+        fprintf(stderr, "Error: Batch path too long: %s\n", input);
+        return -1;
+    }
+    if (run->num_jobs == run->capacity) {
+        run->capacity = run->capacity ? run->capacity * 2 : 16;
+        run->jobs = (BatchJob*)realloc(run->jobs, run->capacity * sizeof(BatchJob));
+    }
+    BatchJob* job = &run->jobs[run->num_jobs];
+    snprintf(job->input, sizeof(job->input), "%s", input);
+    if (output) {
+        snprintf(job->output, sizeof(job->output), "%s", output);
+    } else {                                                                // clips/a.mp4 goes to <root>/a
+        char name[MAX_PATH];
+        size_t length = strlen(input);
+        while (length > 1 && input[length - 1] == '/') {
+            length--;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)length, input);
+        const char* base = strrchr(name, '/');
+        base = base ? base + 1 : name;
+        char* extension = strrchr(base, '.');
+        if (extension && extension != base) {
+            *extension = '\0';
+        }
+        if (snprintf(job->output, sizeof(job->output), "%s/%s", output_root, base) >= (int)sizeof(job->output)) {
+            fprintf(stderr, "Error: Batch path too long: %s\n", input);
+            return -1;
+        }
+    }
+    job->roi[0] = '\0';
+    job->roi_ignore = 0;
+    job->frames = -1;
+    job->seconds = 0.0;
+    run->num_jobs++;
+    return 0;
+}
+
+// Function to read jobs from a job file, one "INPUT [OUTPUT] [roi=MASK | ignore=MASK]" per line, blank lines and # comments skipped
+static int read_job_file(BatchRun* run, const char* job_file, const char* output_root) {
+    FILE* file = strcmp(job_file, "-") == 0 ? stdin : fopen(job_file, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open job file %s\n", job_file);
+        return -1;
+    }
+    char line[BATCH_MAX_LINE];
+    int line_number = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file)) {
+        line_number++;
+        if (!strchr(line, '\n') && !feof(file)) {
+            fprintf(stderr, "Error: %s line %d is too long.\n", job_file, line_number);
+            result = -1;
+            break;
+        }
+        char* fields[4];
+        int count = 0;
+        for (char* field = strtok(line, " \t\r\n"); field && count < 4; field = strtok(NULL, " \t\r\n")) {
+            fields[count++] = field;
+        }
+        if (count == 0 || fields[0][0] == '#') {
+            continue;
+        }
+        const char* roi = NULL;
+        int roi_ignore = 0;
+        if (count > 1 && strncmp(fields[count - 1], "roi=", 4) == 0) {             // Region of interest of this source
+            roi = fields[--count] + 4;
+        } else if (count > 1 && strncmp(fields[count - 1], "ignore=", 7) == 0) {
+            roi = fields[--count] + 7;
+            roi_ignore = 1;
+        }
+        if (count > 2 || (roi && (roi[0] == '\0' || strlen(roi) >= MAX_PATH))) {
+            fprintf(stderr, "Error: %s line %d: expected INPUT [OUTPUT] [roi=MASK | ignore=MASK].\n", job_file, line_number);
+            result = -1;
+            break;
+        }
+        result = add_job(run, fields[0], count == 2 ? fields[1] : NULL, output_root);
+        if (result == 0 && roi) {
+            BatchJob* job = &run->jobs[run->num_jobs - 1];
+            snprintf(job->roi, sizeof(job->roi), "%s", roi);
+            job->roi_ignore = roi_ignore;
+        }
+    }
+    if (file != stdin) {
+        fclose(file);
+    }
+    return result;
+}
+
+// Function to create a directory and any missing parents
+static int make_directories(const char* path) {
+    char partial[MAX_PATH];
+    snprintf(partial, sizeof(partial), "%s", path);
+    for (char* slash = strchr(partial + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash) {
+            *slash = '\0';
+        }
+        if (mkdir(partial, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Failed to create directory '%s'.\n", partial);
+            return -1;
+        }
+        if (!slash) {
+            break;
+        }
+        *slash = '/';
+    }
+    struct stat s;
+    if (stat(path, &s) != 0 || !S_ISDIR(s.st_mode)) {
+        fprintf(stderr, "Error: '%s' exists but is not a directory.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to run one job, returns the number of frames processed or -1
+static int run_job(const BatchJob* job, int extract) {
+    struct stat s;
+    if (stat(job->input, &s) != 0) {
+        fprintf(stderr, "Error: Batch input '%s' does not exist.\n", job->input);
+        return -1;
+    }
+    if (make_directories(job->output) != 0) {
+        return -1;
+    }
+    if (S_ISDIR(s.st_mode) || is_frame_pack(job->input)) {                 // Directory of frame_N.jpg files, or a frame pack
+        int frames = count_frames_in_directory(job->input);
+        if (frames <= 0) {
+            fprintf(stderr, "Error: No frames found in %s.\n", job->input);
+            return -1;
+        }
+        process_frames_with_threads(job->input, job->output, frames, 0);
+        return frames;
+    }
+    if (!extract) {                                                         // Video decoded straight into detection
+        return vid_to_motion(job->input, job->output);
+    }
+    char frame_dir[MAX_PATH + 16];                                          // Keep the frames next to the masks
+    snprintf(frame_dir, sizeof(frame_dir), "%s/frames%s", job->output, motion_config.pack_frames ? FRAME_PACK_EXTENSION : "");
+    if (!motion_config.pack_frames && make_directories(frame_dir) != 0) {
+        return -1;
+    }
+    int frames = vid_to_jpg(job->input, frame_dir);
+    if (frames <= 0) {
+        return -1;
+    }
+    process_frames_with_threads(frame_dir, job->output, frames, 0);
+    return frames;
+}
+
+// Job thread: takes jobs until none are left
+static void* job_main(void* arg) {
+    BatchRun* run = (BatchRun*)arg;
+    int index;
+    while ((index = __atomic_fetch_add(&run->next_job, 1, __ATOMIC_RELAXED)) < run->num_jobs) {
+        BatchJob* job = &run->jobs[index];
+        uint64_t start = metrics_now();
+        if (job->roi[0] == '\0' || roi_assign(job->output, job->roi, job->roi_ignore) == 0) {
+            job->frames = run_job(job, run->extract);
+        }
+        if (job->roi[0] != '\0') {
+            roi_unassign(job->output);
+        }
+        job->seconds = (metrics_now() - start) / 1e9;
+        int finished = __atomic_add_fetch(&run->finished, 1, __ATOMIC_RELAXED);
+        if (job->frames < 0) {
+            fprintf(stderr, "Batch: [%d/%d] %s failed.\n", finished, run->num_jobs, job->input);
+        } else if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+            printf("Batch: [%d/%d] %s -> %s, %d frames in %.1f s.\n", finished, run->num_jobs, job->input,
+                   job->output, job->frames, job->seconds);
+        }
+    }
+    return NULL;
+}
+
+// Function to run every job from the job file and the input list, returns 0 if all of them succeeded
+int run_batch(const BatchOptions* options, char* const inputs[], int num_inputs) {
+    BatchRun run;
+    memset(&run, 0, sizeof(run));
+    run.extract = options->extract;
+    const char* output_root = options->output_root ? options->output_root : ".";
+    int result = 0;
+    if (options->job_file) {
+        result = read_job_file(&run, options->job_file, output_root);
+    }
+    for (int i = 0; i < num_inputs && result == 0; ++i) {
+        result = add_job(&run, inputs[i], NULL, output_root);
+    }
+    for (int i = 0; i < run.num_jobs && result == 0; ++i) {                 // Jobs sharing a directory would write over each other
+        for (int j = 0; j < i; ++j) {
+            if (strcmp(run.jobs[i].output, run.jobs[j].output) == 0) {
+                fprintf(stderr, "Error: %s and %s both write to %s. Give one of them an output directory.\n",
+                        run.jobs[j].input, run.jobs[i].input, run.jobs[i].output);
+                result = -1;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < run.num_jobs && result == 0; ++i) {                 // A missing mask fails the batch before any job starts
+        if (run.jobs[i].roi[0] != '\0') {
+            RoiMask* roi = roi_mask_load(run.jobs[i].roi, run.jobs[i].roi_ignore);
+            result = roi ? 0 : -1;
+            roi_mask_destroy(roi);
+        }
+    }
+    if (result != 0 || run.num_jobs == 0) {
+        if (result == 0) {
+            fprintf(stderr, "Error: The batch has no jobs.\n");
+        }
+        free(run.jobs);
+        return -1;
+    }
+
+    int num_threads = options->max_jobs > 0 ? options->max_jobs : get_cpu_cores();
+    if (num_threads > run.num_jobs) {
+        num_threads = run.num_jobs;
+    }
+    if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+        printf("Batch: %d jobs, up to %d at a time.\n", run.num_jobs, num_threads);
+    }
+    uint64_t start = metrics_now();
+    metrics_begin_run();                                                    // One report for the whole batch
+    pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    int started = 0;
+    for (; started < num_threads; ++started) {
+        if (pthread_create(&threads[started], NULL, job_main, &run) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {                                                     // No threads at all, run the jobs here
+        job_main(&run);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    metrics_end_run();
+
+    int failed = 0;
+    for (int i = 0; i < run.num_jobs; ++i) {
+        failed += run.jobs[i].frames < 0;
+    }
+    if (motion_config.verbosity >= VERBOSITY_NORMAL || failed > 0) {
+        printf("Batch: %d of %d jobs completed in %.1f s.\n", run.num_jobs - failed, run.num_jobs,
+               (metrics_now() - start) / 1e9);
+    }
+    free(run.jobs);
+    return failed ? -1 : 0;
+}
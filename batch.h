@@ -0,0 +1,15 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#define BATCH_MAX_LINE 2048     // Longest job file line
+
+typedef struct {
+    const char* job_file;       // One job per line: INPUT [OUTPUT], "-" = standard input, NULL = none
+    const char* output_root;    // Parent of the output directories of jobs that do not name one
+    int max_jobs;               // Jobs run at the same time, 0 = one per CPU core
+    int extract;                // Save the frames of video inputs before detecting on them
+} BatchOptions;
+
+int run_batch(const BatchOptions* options, char* const inputs[], int num_inputs);
+
+#endif
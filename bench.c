@@ -0,0 +1,410 @@
+/**************************************************************
+Filename: bench.c
+Description:
+  Benchmark suite for the motion detection hot path. Times each
+  stage on its own (JPEG decode, grayscale conversion,
+  differencing, thresholding, JPEG encode) and the whole
+  process_frames_with_threads run from 1 to N threads, on
+  synthetic 480p, 1080p and 4K frames and on frames extracted
+  from a real video. Results are printed as JSON lines so runs
+  can be compared between releases.
+Author: Cade Andrae
+Date: 10/16/26
+Usage:
+  make bench
+  ./motion_bench [--video FILE] [--max-threads N] [--min-time SEC]
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+#include "main.h"
+#include "image_utils.h"
+#include "motion_kernel.h"
+#include "motion_config.h"
+#include "handle_motion.h"
+#include "thread_pool.h"
+#include "frame_pool.h"
+
+#define BENCH_JPEG_QUALITY 90   // Close to what video extraction produces
+
+typedef struct {
+    const char* name;
+    int width;
+    int height;
+    int frames;                 // Frames written for the end-to-end run
+} BenchInput;
+
+static const BenchInput synthetic_inputs[] = {
+    { "480p",  640,  480,  120 },
+    { "1080p", 1920, 1080, 48 },
+    { "4k",    3840, 2160, 16 },
+};
+
+static double min_time = 0.5;   // Seconds each stage benchmark runs for at least
+static int max_threads = 0;     // Largest thread count in the scaling run, 0 = one per CPU core
+static const char* video_path = "night.mp4";
+
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function to print one result as a JSON line
+static void report(const char* bench, const char* input, int width, int height, int threads,
+                   long frames, double seconds, double speedup) {
+    double pixels = (double)frames * width * height;
+    printf("{\"bench\":\"%s\",\"input\":\"%s\",\"width\":%d,\"height\":%d,\"threads\":%d,"
+           "\"frames\":%ld,\"seconds\":%.6f,\"fps\":%.3f,\"ns_per_pixel\":%.4f",
+           bench, input, width, height, threads, frames, seconds, frames / seconds, seconds * 1e9 / pixels);
+    if (speedup > 0.0) {
+        printf(",\"speedup\":%.3f", speedup);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+// Function to fill an RGB frame with a textured background and a square that moves with the frame number
+static void synthesize_frame(unsigned char* rgb, int width, int height, int frame) {
+    unsigned int seed = 12345u;
+    int size = height / 6;
+    int left = (frame * width / 40) % (width - size);
+    int top = height / 3;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            seed = seed * 1103515245u + 12345u;                             // Same noise every frame, only the square moves
+            int noise = (int)((seed >> 16) & 7) - 4;
+            int base = ((x + y) >> 2) & 0xff;
+            int inside = x >= left && x < left + size && y >= top && y < top + size;
+            unsigned char* pixel = rgb + 3 * ((size_t)y * width + x);
+            pixel[0] = (unsigned char)(inside ? 230 : base / 2 + 40 + noise);
+            pixel[1] = (unsigned char)(inside ? 40 : base / 3 + 60 + noise);
+            pixel[2] = (unsigned char)(inside ? 40 : 255 - base / 2 + noise);
+        }
+    }
+}
+
+// Function to save an RGB frame as a color JPEG, like the frames vid_to_jpg writes
+static int save_rgb_jpeg(const char* filename, unsigned char* rgb, int width, int height) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open file %s for writing\n", filename);
+        return -1;
+    }
+    struct jpeg_compress_struct info;
+    struct jpeg_error_mgr err;
+    info.err = jpeg_std_error(&err);
+    jpeg_create_compress(&info);
+    jpeg_stdio_dest(&info, file);
+    info.image_width = width;
+    info.image_height = height;
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, BENCH_JPEG_QUALITY, TRUE);
+    jpeg_start_compress(&info, TRUE);
+    while (info.next_scanline < info.image_height) {
+        unsigned char* row = rgb + (size_t)info.next_scanline * width * 3;
+        jpeg_write_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_compress(&info);
+    jpeg_destroy_compress(&info);
+    fclose(file);
+    return 0;
+}
+
+// Function to create an empty directory under the system temp directory
+static int make_temp_dir(char* path, size_t size, const char* name) {
+    const char* tmp = getenv("TMPDIR");
+    snprintf(path, size, "%s/motion_bench_%s_XXXXXX", tmp ? tmp : "/tmp", name);
+    if (!mkdtemp(path)) {
+        fprintf(stderr, "Error: Cannot create a temporary directory for %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to delete a flat directory and its files
+static void remove_dir(const char* path) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent* entry;
+    char file[MAX_PATH];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            unlink(file);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+// Functions to send the per-frame progress messages of the processing code to /dev/null while timing
+static int quiet_stdout() {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    return saved;
+}
+
+static void restore_stdout(int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+// Function to time each stage of the hot path on two neighbouring frames of a directory
+static void bench_stages(const char* input, const char* frame_dir) {
+    char first_path[MAX_PATH], second_path[MAX_PATH], output_path[MAX_PATH];
+    snprintf(first_path, sizeof(first_path), "%s/frame_0.jpg", frame_dir);
+    snprintf(second_path, sizeof(second_path), "%s/frame_1.jpg", frame_dir);
+    snprintf(output_path, sizeof(output_path), "%s/bench_mask.jpg", frame_dir);
+
+    int width, height, second_width, second_height;
+    unsigned char* first = load_jpeg(first_path, &width, &height);
+    unsigned char* second = load_jpeg(second_path, &second_width, &second_height);
+    if (!first || !second || width != second_width || height != second_height) {
+        fprintf(stderr, "Error: Cannot load benchmark frames from %s\n", frame_dir);
+        free(first);
+        free(second);
+        return;
+    }
+    size_t count = (size_t)width * height;
+    unsigned char* gray_first = (unsigned char*)malloc(count);
+    unsigned char* gray_second = (unsigned char*)malloc(count);
+    unsigned char* diff = (unsigned char*)malloc(count);
+    unsigned char* mask = (unsigned char*)malloc(count);
+    long iterations;
+    double start, elapsed;
+
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        int w, h;
+        free(load_jpeg(first_path, &w, &h));
+    }
+    report("load_jpeg", input, width, height, 1, iterations, elapsed, 0.0);
+
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        int w, h;
+        frame_buffer_release(load_jpeg_gray(first_path, &w, &h, 1));
+    }
+    report("load_jpeg_gray", input, width, height, 1, iterations, elapsed, 0.0);
+
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        rgb_to_grayscale(first, gray_first, width, height);
+    }
+    report("rgb_to_grayscale", input, width, height, 1, iterations, elapsed, 0.0);
+    rgb_to_grayscale(second, gray_second, width, height);
+
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        compute_difference(gray_first, gray_second, diff, width, height);
+    }
+    report("compute_difference", input, width, height, 1, iterations, elapsed, 0.0);
+
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        apply_threshold(diff, mask, width, height, motion_config.threshold);
+    }
+    report("apply_threshold", input, width, height, 1, iterations, elapsed, 0.0);
+
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        motion_mask_gray(gray_first, gray_second, mask, (int)count, motion_config.threshold);
+    }
+    report("motion_mask_gray", input, width, height, 1, iterations, elapsed, 0.0);     // Fused difference and threshold used by detection
+
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        motion_mask_tiled(gray_first, gray_second, mask, width, height, NULL, NULL, motion_config.threshold);
+    }
+    report("motion_mask_tiled", input, width, height, 1, iterations, elapsed, 0.0);    // Whole frame, quiet tiles skipped where the kernels scan
+
+    int tiles_x = (width + MOTION_TILE_WIDTH - 1) / MOTION_TILE_WIDTH;
+    int tiles_y = (height + MOTION_TILE_HEIGHT - 1) / MOTION_TILE_HEIGHT;
+    unsigned char* tiles = (unsigned char*)malloc((size_t)tiles_x * tiles_y);
+    unsigned char* region = (unsigned char*)malloc(count);
+    for (size_t i = 0; i < count; ++i) {                                                 // Watch the right half, its edge inside a tile
+        region[i] = ((int)(i % width) >= width / 2) ? 255 : 0;
+    }
+    for (int t = 0; t < tiles_x * tiles_y; ++t) {
+        int x0 = (t % tiles_x) * MOTION_TILE_WIDTH;
+        int x1 = (x0 + MOTION_TILE_WIDTH < width) ? x0 + MOTION_TILE_WIDTH : width;
+        tiles[t] = (x1 <= width / 2) ? TILE_IGNORED : (x0 >= width / 2) ? TILE_WATCHED : TILE_PARTIAL;
+    }
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        motion_mask_tiled(gray_first, gray_second, mask, width, height, tiles, region, motion_config.threshold);
+    }
+    report("motion_mask_roi_half", input, width, height, 1, iterations, elapsed, 0.0);
+    free(tiles);
+    free(region);
+
+    size_t coarse_count = (size_t)((width + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR) * ((height + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR);
+    unsigned char* coarse_first = (unsigned char*)malloc(coarse_count);
+    unsigned char* coarse_second = (unsigned char*)malloc(coarse_count);
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        luma_box8(gray_first, width, height, coarse_first);
+    }
+    report("luma_box8", input, width, height, 1, iterations, elapsed, 0.0);             // Built once per frame in pyramid mode
+    luma_box8(gray_second, width, height, coarse_second);
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        motion_mask_pyramid(gray_first, gray_second, coarse_first, coarse_second, mask, width, height, NULL, NULL,
+                            motion_config.threshold, motion_config.threshold / 4);
+    }
+    report("motion_mask_pyramid", input, width, height, 1, iterations, elapsed, 0.0);  // Per pair, both coarse levels already built
+    free(coarse_first);
+    free(coarse_second);
+
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        save_jpeg(output_path, mask, width, height);
+    }
+    report("save_jpeg", input, width, height, 1, iterations, elapsed, 0.0);
+    motion_config.fast_dct = 1;
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        save_jpeg(output_path, mask, width, height);
+    }
+    report("save_jpeg_fast_dct", input, width, height, 1, iterations, elapsed, 0.0);
+    motion_config.fast_dct = 0;
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        save_pgm(output_path, mask, width, height);
+    }
+    report("save_pgm", input, width, height, 1, iterations, elapsed, 0.0);
+    for (iterations = 0, start = now_seconds(); (elapsed = now_seconds() - start) < min_time; ++iterations) {
+        save_pbm(output_path, mask, width, height);
+    }
+    report("save_pbm", input, width, height, 1, iterations, elapsed, 0.0);
+    unlink(output_path);
+
+    free(first);
+    free(second);
+    free(gray_first);
+    free(gray_second);
+    free(diff);
+    free(mask);
+}
+
+// Function to time process_frames_with_threads over a frame directory at 1, 2, 4 ... max threads
+static void bench_end_to_end(const char* input, const char* frame_dir, int frames, int width, int height) {
+    char output_dir[MAX_PATH];
+    if (make_temp_dir(output_dir, sizeof(output_dir), "out") != 0) {
+        return;
+    }
+    int limit = max_threads > 0 ? max_threads : get_cpu_cores();
+    double single = 0.0;
+    for (int threads = 1; ; threads = (threads * 2 > limit && threads < limit) ? limit : threads * 2) {
+        motion_config.num_threads = threads;
+        shared_thread_pool_reset();                                         // Next use creates the pool with this many threads
+        int saved = quiet_stdout();
+        double start = now_seconds();
+        process_frames_with_threads(frame_dir, output_dir, frames, 0);
+        double elapsed = now_seconds() - start;
+        restore_stdout(saved);
+        if (threads == 1) {
+            single = elapsed;
+        }
+        report("process_frames_with_threads", input, width, height, threads, frames, elapsed, single / elapsed);
+        if (threads >= limit) {
+            break;
+        }
+    }
+    remove_dir(output_dir);
+}
+
+// Function to write synthetic frames of one size and run every benchmark on them
+static void bench_synthetic(const BenchInput* input) {
+    char frame_dir[MAX_PATH], frame_path[MAX_PATH + 32];
+    if (make_temp_dir(frame_dir, sizeof(frame_dir), input->name) != 0) {
+        return;
+    }
+    unsigned char* rgb = (unsigned char*)malloc((size_t)input->width * input->height * 3);
+    for (int i = 0; i < input->frames; ++i) {
+        synthesize_frame(rgb, input->width, input->height, i);
+        snprintf(frame_path, sizeof(frame_path), "%s/frame_%d.jpg", frame_dir, i);
+        if (save_rgb_jpeg(frame_path, rgb, input->width, input->height) != 0) {
+            free(rgb);
+            remove_dir(frame_dir);
+            return;
+        }
+    }
+    free(rgb);
+    bench_stages(input->name, frame_dir);
+    bench_end_to_end(input->name, frame_dir, input->frames, input->width, input->height);
+    remove_dir(frame_dir);
+}
+
+// Function to extract a real video to frames and run every benchmark on them
+static void bench_video() {
+    struct stat info;
+    if (stat(video_path, &info) != 0) {
+        fprintf(stderr, "Skipping video benchmark: %s not found\n", video_path);
+        return;
+    }
+    char frame_dir[MAX_PATH];
+    if (make_temp_dir(frame_dir, sizeof(frame_dir), "video") != 0) {
+        return;
+    }
+    int saved = quiet_stdout();
+    vid_to_jpg(video_path, frame_dir);
+    restore_stdout(saved);
+    int frames = count_frames_in_directory(frame_dir);
+    int width, height;
+    char first_path[MAX_PATH + 32];
+    snprintf(first_path, sizeof(first_path), "%s/frame_0.jpg", frame_dir);
+    unsigned char* first = frames >= 2 ? load_jpeg(first_path, &width, &height) : NULL;
+    if (first) {
+        free(first);
+        bench_stages(video_path, frame_dir);
+        bench_end_to_end(video_path, frame_dir, frames, width, height);
+    } else {
+        fprintf(stderr, "Skipping video benchmark: no frames extracted from %s\n", video_path);
+    }
+    remove_dir(frame_dir);
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"video",       required_argument, NULL, 'v'},
+        {"max-threads", required_argument, NULL, 'j'},
+        {"min-time",    required_argument, NULL, 'm'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "v:j:m:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'v':
+                video_path = optarg;
+                break;
+            case 'j':
+                max_threads = atoi(optarg);
+                break;
+            case 'm':
+                min_time = atof(optarg);
+                break;
+            default:
+                printf("Usage: %s [--video FILE] [--max-threads N] [--min-time SEC]\n", argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (max_threads < 0 || !(min_time > 0.0)) {
+        fprintf(stderr, "Error: --max-threads must be positive and --min-time above 0.\n");
+        return EXIT_FAILURE;
+    }
+    motion_config.write_index = 0;                                          // Measure detection and mask output only
+
+    printf("{\"bench\":\"info\",\"isa\":\"%s\",\"cores\":%d,\"threshold\":%d}\n",
+           motion_isa_name(motion_kernel_isa()), get_cpu_cores(), motion_config.threshold);
+    for (size_t i = 0; i < sizeof(synthetic_inputs) / sizeof(synthetic_inputs[0]); ++i) {
+        bench_synthetic(&synthetic_inputs[i]);
+    }
+    bench_video();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+/**************************************************************
+Filename: bounded_queue.c 
+Description:
+  Bounded lock-free multi-producer/multi-consumer queue of
+  pointers (a ring of cells with per-cell sequence numbers).
+  A full queue makes producers wait, which gives the processing
+  pipeline backpressure and keeps its memory use bounded.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include "bounded_queue.h"
+
+#define CACHE_LINE 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+typedef struct {
+    size_t sequence;            // Which lap of the ring this cell is ready for
+    void* item;
+} QueueCell;
+
+struct BoundedQueue {
+    QueueCell* cells;
+    size_t mask;                // Capacity - 1, capacity is a power of two
+    char pad0[CACHE_LINE];
+    size_t enqueue_pos;         // Producers and consumers work on separate cache lines
+    char pad1[CACHE_LINE];
+    size_t dequeue_pos;
+    char pad2[CACHE_LINE];
+};
+
+// Function to create a queue holding at least capacity items
+BoundedQueue* bounded_queue_create(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {                                                   // Round up to a power of two
+        size <<= 1;
+    }
+    BoundedQueue* queue = (BoundedQueue*)calloc(1, sizeof(BoundedQueue));
+    queue->cells = (QueueCell*)malloc(size * sizeof(QueueCell));
+    queue->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        queue->cells[i].sequence = i;
+    }
+    return queue;
+}
+
+void bounded_queue_destroy(BoundedQueue* queue) {
+    if (queue) {
+        free(queue->cells);
+        free(queue);
+    }
+}
+
+// Function to add an item without waiting, returns 0 if the queue is full
+int bounded_queue_try_push(BoundedQueue* queue, void* item) {
+    size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        QueueCell* cell = &queue->cells[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)sequence - (long)pos;
+        if (diff == 0) {                                                        // Cell is free on this lap, try to claim it
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->item = item;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);  // Publish to consumers
+                return 1;
+            }
+        } else if (diff < 0) {                                                  // Consumers have not freed this cell yet
+            return 0;
+        } else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);      // Another producer won, reload
+        }
+    }
+}
+
+// Function to remove an item without waiting, returns 0 if the queue is empty
+int bounded_queue_try_pop(BoundedQueue* queue, void** item) {
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        QueueCell* cell = &queue->cells[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)sequence - (long)(pos + 1);
+        if (diff == 0) {                                                        // Cell holds an item for this lap
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *item = cell->item;
+                __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE); // Free the cell for the next lap
+                return 1;
+            }
+        } else if (diff < 0) {                                                  // Nothing published yet
+            return 0;
+        } else {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Function to back off while a queue is full or empty: spin, then yield, then sleep
+static void backoff(int* attempts) {
+    if (*attempts < 64) {
+        cpu_relax();
+    } else if (*attempts < 128) {
+        sched_yield();
+    } else {
+        struct timespec pause = { 0, 200000 };                                 // 0.2 ms
+        nanosleep(&pause, NULL);
+    }
+    (*attempts)++;
+}
+
+// Function to add an item, waiting while the queue is full
+void bounded_queue_push(BoundedQueue* queue, void* item) {
+    int attempts = 0;
+    while (!bounded_queue_try_push(queue, item)) {
+        backoff(&attempts);
+    }
+}
+
+// Function to remove an item, waiting while the queue is empty
+void* bounded_queue_pop(BoundedQueue* queue) {
+    void* item;
+    int attempts = 0;
+    while (!bounded_queue_try_pop(queue, &item)) {
+        backoff(&attempts);
+    }
+    return item;
+}
@@ -0,0 +1,15 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <stddef.h>
+
+typedef struct BoundedQueue BoundedQueue;
+
+BoundedQueue* bounded_queue_create(size_t capacity);
+void bounded_queue_destroy(BoundedQueue* queue);
+int bounded_queue_try_push(BoundedQueue* queue, void* item);
+int bounded_queue_try_pop(BoundedQueue* queue, void** item);
+void bounded_queue_push(BoundedQueue* queue, void* item);
+void* bounded_queue_pop(BoundedQueue* queue);
+
+#endif
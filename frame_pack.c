@@ -0,0 +1,344 @@
+/**************************************************************
+Filename: frame_pack.c
+Description:
+  Frame packs keep a whole extracted video in one file instead
+  of one JPEG per frame: a header, the frames as raw luma planes
+  or grayscale JPEGs, and a table of frame offsets. Detection
+  maps the pack once and reaches any frame by its index, so
+  there is no directory scan, no open or read per frame, and raw
+  planes are compared in place without being copied. Writers
+  may add frames in any order from several threads, which lets
+  segmented extraction fill one pack.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "frame_pack.h"
+#include "image_utils.h"
+#include "metrics.h"
+
+struct FramePack {
+    char path[512];
+    int fd;
+    unsigned char* base;            // Whole file, mapped read-only
+    size_t length;
+    const FramePackHeader* header;
+    const FramePackEntry* table;
+    int refs;
+    struct FramePack* next;
+};
+
+struct FramePackWriter {
+    char path[512];
+    int fd;
+    FramePackEncoding encoding;
+    double frame_rate;
+    int width;
+    int height;
+    uint64_t end;                   // Where the next frame goes
+    FramePackEntry* table;          // Indexed by frame number, grown as frames arrive
+    int table_size;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+static FramePack* open_packs = NULL;                                            // Packs in use, shared by every run reading the same file
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to tell whether a path names a frame pack rather than a frame directory
+int is_frame_pack(const char* path) {
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    char magic[sizeof(((FramePackHeader*)0)->magic)];
+    int match = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) && memcmp(magic, FRAME_PACK_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return match;
+}
+
+// Function to tell whether an output path asks for a frame pack, by its extension
+int is_frame_pack_path(const char* path) {
+    size_t length = strlen(path), extension = strlen(FRAME_PACK_EXTENSION);
+    return length > extension && strcmp(path + length - extension, FRAME_PACK_EXTENSION) == 0;
+}
+
+// Function to map a pack and check its header and table, returns NULL if it is not a complete pack
+static FramePack* frame_pack_open(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open frame pack %s\n", path);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(FramePackHeader)) {
+        fprintf(stderr, "Error: %s is not a frame pack.\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t length = (size_t)info.st_size;
+    unsigned char* base = (unsigned char*)mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map frame pack %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    const FramePackHeader* header = (const FramePackHeader*)base;
+    const char* problem = NULL;
+    if (memcmp(header->magic, FRAME_PACK_MAGIC, sizeof(header->magic)) != 0) {
+        problem = "is not a frame pack";
+    } else if (header->version != FRAME_PACK_VERSION || header->encoding > FRAME_PACK_JPEG) {
+        problem = "is not a compatible frame pack";
+    } else if (header->frame_count == 0 || header->table_offset < sizeof(FramePackHeader) || header->table_offset > length ||
+               header->frame_count > (length - header->table_offset) / sizeof(FramePackEntry)) {
+        problem = "is incomplete (was its extraction interrupted?)";
+    }
+    const FramePackEntry* table = (const FramePackEntry*)(base + (problem ? 0 : header->table_offset));
+    for (uint32_t i = 0; !problem && i < header->frame_count; ++i) {                      // Every frame must lie inside the file
+        if (table[i].size && (table[i].offset < sizeof(FramePackHeader) || table[i].size > header->table_offset ||
+                              table[i].offset > header->table_offset - table[i].size ||
+                              (header->encoding == FRAME_PACK_RAW && table[i].size != (uint64_t)header->width * header->height))) {
+            problem = "has a damaged frame table";
+        }
+    }
+    if (problem) {
+        fprintf(stderr, "Error: %s %s.\n", path, problem);
+        munmap(base, length);
+        close(fd);
+        return NULL;
+    }
+    madvise(base, length, MADV_SEQUENTIAL);                                             // Chunks read runs of frames, read ahead of them
+    FramePack* pack = (FramePack*)calloc(1, sizeof(FramePack));
+    snprintf(pack->path, sizeof(pack->path), "%s", path);
+    pack->fd = fd;
+    pack->base = base;
+    pack->length = length;
+    pack->header = header;
+    pack->table = table;
+    return pack;
+}
+
+// Function to get the pack at a path, mapped the first time it is used
+// Every acquire is matched by a frame_pack_release
+FramePack* frame_pack_acquire(const char* path) {
+    pthread_mutex_lock(&packs_lock);
+    FramePack* pack = open_packs;
+    while (pack && strcmp(pack->path, path) != 0) {
+        pack = pack->next;
+    }
+    if (!pack && (pack = frame_pack_open(path))) {
+        pack->next = open_packs;
+        open_packs = pack;
+    }
+    if (pack) {
+        pack->refs++;
+    }
+    pthread_mutex_unlock(&packs_lock);
+    return pack;
+}
+
+void frame_pack_release(FramePack* pack) {
+    if (!pack) {
+        return;
+    }
+    pthread_mutex_lock(&packs_lock);
+    if (--pack->refs > 0) {
+        pthread_mutex_unlock(&packs_lock);
+        return;
+    }
+    for (FramePack** link = &open_packs; *link; link = &(*link)->next) {
+        if (*link == pack) {
+            *link = pack->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&packs_lock);
+    munmap(pack->base, pack->length);
+    close(pack->fd);
+    free(pack);
+}
+
+// Function to find a pack some run has acquired, NULL if the path is not an open pack (e.g. a frame directory)
+FramePack* frame_pack_find(const char* path) {
+    pthread_mutex_lock(&packs_lock);
+    FramePack* pack = open_packs;
+    while (pack && strcmp(pack->path, path) != 0) {
+        pack = pack->next;
+    }
+    pthread_mutex_unlock(&packs_lock);
+    return pack;
+}
+
+int frame_pack_count(const FramePack* pack) {
+    return (int)pack->header->frame_count;
+}
+
+FramePackEncoding frame_pack_encoding(const FramePack* pack) {
+    return (FramePackEncoding)pack->header->encoding;
+}
+
+int frame_pack_width(const FramePack* pack) {
+    return (int)pack->header->width;
+}
+
+int frame_pack_height(const FramePack* pack) {
+    return (int)pack->header->height;
+}
+
+double frame_pack_frame_rate(const FramePack* pack) {
+    return pack->header->frame_rate;
+}
+
+int frame_pack_fd(const FramePack* pack) {
+    return pack->fd;
+}
+
+// Function to get a frame's data inside the mapping, returns NULL if the index is out of range or the frame is missing
+// offset (may be NULL) receives its position in the file, for sending it without touching the mapping
+const unsigned char* frame_pack_frame(const FramePack* pack, int index, uint32_t* size, uint64_t* offset) {
+    if (index < 0 || (uint32_t)index >= pack->header->frame_count || pack->table[index].size == 0) {
+        return NULL;
+    }
+    *size = pack->table[index].size;
+    if (offset) {
+        *offset = pack->table[index].offset;
+    }
+    return pack->base + pack->table[index].offset;
+}
+
+// Function to start writing a pack, replacing any file at the path
+FramePackWriter* frame_pack_create(const char* path, FramePackEncoding encoding, double frame_rate) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create frame pack %s\n", path);
+        return NULL;
+    }
+    FramePackHeader header;                     // Placeholder with no frames, so an unfinished pack reads as incomplete
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FRAME_PACK_MAGIC, sizeof(header.magic));
+    header.version = FRAME_PACK_VERSION;
+    header.encoding = encoding;
+    header.frame_rate = frame_rate;
+    if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        fprintf(stderr, "Error: Failed to write frame pack %s\n", path);
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    FramePackWriter* writer = (FramePackWriter*)calloc(1, sizeof(FramePackWriter));
+    snprintf(writer->path, sizeof(writer->path), "%s", path);
+    writer->fd = fd;
+    writer->encoding = encoding;
+    writer->frame_rate = frame_rate;
+    writer->end = sizeof(FramePackHeader);      // The real header is written last, so a pack is only valid once finished
+    pthread_mutex_init(&writer->lock, NULL);
+    return writer;
+}
+
+// Function to add a frame to a pack, safe to call from several threads with distinct indices
+// Writing an index again replaces the frame, returns -1 on failure
+int frame_pack_write(FramePackWriter* writer, int index, const unsigned char* luma, int width, int height) {
+    unsigned long size = (unsigned long)width * height;
+    const unsigned char* data = luma;
+    if (writer->encoding == FRAME_PACK_JPEG) {                                  // Compressed outside the lock, into this thread's encoder buffer
+        uint64_t start = metrics_now();
+        data = encode_jpeg_gray(luma, width, height, &size);
+        metrics_stage_end(METRIC_ENCODE, start);
+    }
+    pthread_mutex_lock(&writer->lock);
+    if (writer->width == 0) {
+        writer->width = width;
+        writer->height = height;
+    }
+    if (width != writer->width || height != writer->height) {
+        pthread_mutex_unlock(&writer->lock);
+        fprintf(stderr, "Error: Frame %d size differs from the rest of frame pack %s\n", index, writer->path);
+        return -1;
+    }
+    if (index >= writer->table_size) {
+        int grown = writer->table_size ? writer->table_size : 1024;
+        while (grown <= index) {
+            grown *= 2;
+        }
+        writer->table = (FramePackEntry*)realloc(writer->table, grown * sizeof(FramePackEntry));
+        memset(writer->table + writer->table_size, 0, (grown - writer->table_size) * sizeof(FramePackEntry));
+        writer->table_size = grown;
+    }
+    uint64_t offset = (writer->end + FRAME_PACK_ALIGN - 1) / FRAME_PACK_ALIGN * FRAME_PACK_ALIGN;
+    writer->end = offset + size;                                                // Space is reserved here, filled below without the lock
+    pthread_mutex_unlock(&writer->lock);
+
+    uint64_t start = metrics_now();
+    int result = pwrite(writer->fd, data, size, (off_t)offset) == (ssize_t)size ? 0 : -1;
+    metrics_stage_end(METRIC_WRITE, start);
+    metrics_count(METRIC_BYTES_WRITTEN, size);
+    pthread_mutex_lock(&writer->lock);
+    if (result == 0) {
+        writer->table[index].offset = offset;
+        writer->table[index].size = (uint32_t)size;
+    } else {
+        writer->failed = 1;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    if (result != 0) {
+        fprintf(stderr, "Error: Cannot write frame %d to frame pack %s\n", index, writer->path);
+    }
+    return result;
+}
+
+// Function to write the frame table and header and close the pack, frames from frame_count on are left out
+// Returns 0, or -1 (and removes the file) if any write failed or frame_count is 0, which discards the pack
+int frame_pack_finish(FramePackWriter* writer, int frame_count) {
+    if (frame_count > writer->table_size) {
+        frame_count = writer->table_size;
+    }
+    if (frame_count <= 0) {
+        close(writer->fd);
+        unlink(writer->path);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer->table);
+        free(writer);
+        return -1;
+    }
+    FramePackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FRAME_PACK_MAGIC, sizeof(header.magic));
+    header.version = FRAME_PACK_VERSION;
+    header.encoding = writer->encoding;
+    header.frame_count = (uint32_t)frame_count;
+    header.width = writer->width;
+    header.height = writer->height;
+    header.frame_rate = writer->frame_rate;
+    header.table_offset = (writer->end + FRAME_PACK_ALIGN - 1) / FRAME_PACK_ALIGN * FRAME_PACK_ALIGN;
+    size_t table_bytes = (size_t)header.frame_count * sizeof(FramePackEntry);
+    int result = writer->failed ? -1 : 0;
+    if (result == 0 && pwrite(writer->fd, writer->table, table_bytes, (off_t)header.table_offset) != (ssize_t)table_bytes) {
+        result = -1;
+    }
+    if (result == 0 && pwrite(writer->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        result = -1;
+    }
+    if (close(writer->fd) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error: Failed to write frame pack %s\n", writer->path);
+        unlink(writer->path);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->table);
+    free(writer);
+    return result;
+}
@@ -0,0 +1,55 @@
+#ifndef FRAME_PACK_H
+#define FRAME_PACK_H
+
+#include <stdint.h>
+
+#define FRAME_PACK_EXTENSION ".fpk"
+#define FRAME_PACK_MAGIC "MDFPACK1"
+#define FRAME_PACK_VERSION 1
+#define FRAME_PACK_ALIGN 64         // Frame data starts on a cache line, so raw planes are read in place with aligned loads
+
+typedef enum {
+    FRAME_PACK_RAW,                 // 8-bit luma planes, read straight from the mapping without decoding or copying
+    FRAME_PACK_JPEG                 // Grayscale JPEG per frame, several times smaller, decoded from the mapping
+} FramePackEncoding;
+
+// On-disk header, native (little-endian) byte order, followed by the frame data and then the frame table
+typedef struct {
+    char magic[8];                  // FRAME_PACK_MAGIC
+    uint32_t version;
+    uint32_t encoding;              // FramePackEncoding
+    uint32_t frame_count;           // 0 until the writer finishes, so an interrupted pack is rejected
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+    double frame_rate;              // Source frame rate, 0 if unknown
+    uint64_t table_offset;          // Offset of frame_count FramePackEntry records
+    uint8_t padding[16];
+} FramePackHeader;
+
+typedef struct {
+    uint64_t offset;                // Frame data offset in the file
+    uint32_t size;                  // Frame data size in bytes, 0 if the frame is missing
+    uint32_t reserved;
+} FramePackEntry;
+
+typedef struct FramePack FramePack;
+typedef struct FramePackWriter FramePackWriter;
+
+int is_frame_pack(const char* path);
+int is_frame_pack_path(const char* path);
+FramePack* frame_pack_acquire(const char* path);
+void frame_pack_release(FramePack* pack);
+FramePack* frame_pack_find(const char* path);
+int frame_pack_count(const FramePack* pack);
+FramePackEncoding frame_pack_encoding(const FramePack* pack);
+int frame_pack_width(const FramePack* pack);
+int frame_pack_height(const FramePack* pack);
+double frame_pack_frame_rate(const FramePack* pack);
+int frame_pack_fd(const FramePack* pack);
+const unsigned char* frame_pack_frame(const FramePack* pack, int index, uint32_t* size, uint64_t* offset);
+FramePackWriter* frame_pack_create(const char* path, FramePackEncoding encoding, double frame_rate);
+int frame_pack_write(FramePackWriter* writer, int index, const unsigned char* luma, int width, int height);
+int frame_pack_finish(FramePackWriter* writer, int frame_count);
+
+#endif
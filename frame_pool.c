@@ -0,0 +1,172 @@
+/**************************************************************
+Filename: frame_pool.c 
+Description:
+  Per-thread frame buffer pool. Full-frame buffers are kept in
+  small per-thread free lists keyed by size, so decoding and
+  detection reuse the same memory frame after frame instead of
+  going through malloc/free (and mmap page faults) every time.
+  A shared depot catches overflow from threads that mostly
+  release buffers (pipeline consumers) and refills threads that
+  mostly acquire them (pipeline decoders).
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "frame_pool.h"
+
+#define FRAME_POOL_BINS 4           // Distinct buffer sizes cached per thread
+#define FRAME_POOL_DEPTH 8          // Free buffers kept per size
+#define FRAME_DEPOT_DEPTH 64        // Free buffers kept per size in the shared depot
+#define FRAME_HEADER_SIZE 64        // Keeps pixel data 64-byte aligned for the SIMD kernels
+
+typedef struct FrameBuffer {
+    size_t size;                    // Usable bytes after the header
+    struct FrameBuffer* next;       // Next free buffer of the same size
+} FrameBuffer;
+
+typedef struct {
+    size_t size;                    // Buffer size served by this bin, 0 = unused
+    FrameBuffer* free_list;
+    int count;
+    unsigned long last_used;        // For evicting the least recently used size
+} FrameBin;
+
+typedef struct {
+    FrameBin bins[FRAME_POOL_BINS];
+    unsigned long clock;
+} FrameCache;
+
+static FrameCache depot;                                    // Shared overflow, guarded by depot_lock
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static FrameBuffer* header_of(unsigned char* buffer) {
+    return (FrameBuffer*)(buffer - FRAME_HEADER_SIZE);
+}
+
+// Function to free every buffer held by a bin
+static void empty_bin(FrameBin* bin) {
+    while (bin->free_list) {
+        FrameBuffer* next = bin->free_list->next;
+        free(bin->free_list);
+        bin->free_list = next;
+    }
+    bin->count = 0;
+    bin->size = 0;
+}
+
+// Destructor run when a thread exits, releases its cached buffers
+static void destroy_cache(void* arg) {
+    FrameCache* cache = (FrameCache*)arg;
+    for (int i = 0; i < FRAME_POOL_BINS; i++) {
+        empty_bin(&cache->bins[i]);
+    }
+    free(cache);
+}
+
+static void create_cache_key() {
+    pthread_key_create(&cache_key, destroy_cache);
+}
+
+// Function to get (and lazily create) the calling thread's cache
+static FrameCache* thread_cache() {
+    pthread_once(&cache_key_once, create_cache_key);
+    FrameCache* cache = (FrameCache*)pthread_getspecific(cache_key);
+    if (!cache) {
+        cache = (FrameCache*)calloc(1, sizeof(FrameCache));
+        pthread_setspecific(cache_key, cache);
+    }
+    return cache;
+}
+
+// Function to find the bin for a size, optionally claiming the least recently used one
+static FrameBin* find_bin(FrameCache* cache, size_t size, int claim) {
+    FrameBin* victim = &cache->bins[0];
+    for (int i = 0; i < FRAME_POOL_BINS; i++) {
+        FrameBin* bin = &cache->bins[i];
+        if (bin->size == size) {
+            return bin;
+        }
+        if (bin->size == 0 || (victim->size != 0 && bin->last_used < victim->last_used)) {
+            victim = bin;                                   // Prefer an unused bin, then the stalest one
+        }
+    }
+    if (!claim) {
+        return NULL;
+    }
+    empty_bin(victim);                                      // Resolution changed, drop buffers of an old size
+    victim->size = size;
+    return victim;
+}
+
+// Function to borrow a frame buffer of at least size bytes, returned with frame_buffer_release
+unsigned char* frame_buffer_acquire(size_t size) {
+    FrameCache* cache = thread_cache();
+    FrameBin* bin = find_bin(cache, size, 0);
+    if (bin && bin->free_list) {                            // Reuse a cached buffer
+        FrameBuffer* buffer = bin->free_list;
+        bin->free_list = buffer->next;
+        bin->count--;
+        bin->last_used = ++cache->clock;
+        return (unsigned char*)buffer + FRAME_HEADER_SIZE;
+    }
+    pthread_mutex_lock(&depot_lock);                        // Then try buffers other threads gave up
+    FrameBin* shared = find_bin(&depot, size, 0);
+    if (shared && shared->free_list) {
+        FrameBuffer* buffer = shared->free_list;
+        shared->free_list = buffer->next;
+        shared->count--;
+        shared->last_used = ++depot.clock;
+        pthread_mutex_unlock(&depot_lock);
+        return (unsigned char*)buffer + FRAME_HEADER_SIZE;
+    }
+    pthread_mutex_unlock(&depot_lock);
+    void* memory = NULL;
+    if (posix_memalign(&memory, FRAME_HEADER_SIZE, FRAME_HEADER_SIZE + size) != 0) {
+        return NULL;                                        // Out of memory
+    }
+    FrameBuffer* buffer = (FrameBuffer*)memory;
+    buffer->size = size;
+    buffer->next = NULL;
+    return (unsigned char*)buffer + FRAME_HEADER_SIZE;
+}
+
+// Function to return a buffer to the calling thread's pool
+void frame_buffer_release(unsigned char* data) {
+    if (!data) {
+        return;
+    }
+    FrameBuffer* buffer = header_of(data);
+    FrameCache* cache = thread_cache();
+    FrameBin* bin = find_bin(cache, buffer->size, 1);
+    bin->last_used = ++cache->clock;
+    if (bin->count >= FRAME_POOL_DEPTH) {                   // Bin is full, hand the buffer to the depot
+        pthread_mutex_lock(&depot_lock);
+        FrameBin* shared = find_bin(&depot, buffer->size, 1);
+        shared->last_used = ++depot.clock;
+        if (shared->count < FRAME_DEPOT_DEPTH) {
+            buffer->next = shared->free_list;
+            shared->free_list = buffer;
+            shared->count++;
+            buffer = NULL;
+        }
+        pthread_mutex_unlock(&depot_lock);
+        free(buffer);                                       // Depot is full too, give the memory back
+        return;
+    }
+    buffer->next = bin->free_list;
+    bin->free_list = buffer;
+    bin->count++;
+}
+
+// Function to free every buffer cached by the calling thread
+void frame_pool_trim() {
+    FrameCache* cache = thread_cache();
+    for (int i = 0; i < FRAME_POOL_BINS; i++) {
+        empty_bin(&cache->bins[i]);
+    }
+}
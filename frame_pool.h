@@ -0,0 +1,10 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stddef.h>
+
+unsigned char* frame_buffer_acquire(size_t size);
+void frame_buffer_release(unsigned char* buffer);
+void frame_pool_trim();
+
+#endif
@@ -0,0 +1,158 @@
+/**************************************************************
+Filename: frame_sampling.c
+Description:
+  Adaptive temporal sampling. Before full detection, every Nth
+  frame is decoded at 1/8 resolution and compared with the
+  previous sample, so long quiet stretches of footage are
+  recognized from a fraction of their frames. Only the frames
+  around sample intervals that changed, plus some padding, are
+  then compared one by one at full resolution.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame_sampling.h"
+#include "handle_motion.h"
+#include "motion_config.h"
+#include "image_utils.h"
+#include "frame_pack.h"
+#include "frame_pool.h"
+#include "thread_pool.h"
+#include "roi_mask.h"
+#include "metrics.h"
+
+typedef struct {
+    const char* input_path;
+    const char* output_path;
+    const int* samples;         // Frame numbers of every sample
+    unsigned char* active;      // One flag per interval between consecutive samples
+    int first;                  // First interval checked by this task
+    int last;                   // Exclusive
+} SampleTask;
+
+// Function to load a frame at 1/SAMPLE_SCALE resolution from the input directory or frame pack
+static int load_sample_frame(const char* input_path, int index, GrayFrame* out) {
+    out->pixels = NULL;
+    out->coarse = NULL;
+    out->mapped = 0;
+    FramePack* pack = frame_pack_find(input_path);
+    if (!pack) {
+        char frame_path[256];
+        snprintf(frame_path, sizeof(frame_path), "%s/frame_%d.jpg", input_path, index);
+        out->pixels = load_jpeg_gray_coarse(frame_path, &out->width, &out->height, SAMPLE_SCALE, NULL);
+        return out->pixels != NULL;
+    }
+    uint32_t size;
+    const unsigned char* data = frame_pack_frame(pack, index, &size, NULL);
+    if (!data) {
+        return 0;
+    }
+    metrics_count(METRIC_BYTES_READ, size);
+    if (frame_pack_encoding(pack) == FRAME_PACK_RAW) {
+        out->pixels = downscale_gray(data, frame_pack_width(pack), frame_pack_height(pack), SAMPLE_SCALE, &out->width, &out->height);
+        metrics_count(METRIC_FRAMES_DECODED, 1);
+    } else {
+        out->pixels = decode_jpeg_gray_coarse(data, size, &out->width, &out->height, SAMPLE_SCALE, NULL);
+    }
+    return out->pixels != NULL;
+}
+
+// Function to tell whether two samples differ anywhere in the watched region, cell averages against the coarse threshold
+static int samples_differ(const char* output_path, const GrayFrame* a, const GrayFrame* b) {
+    int width = b->width;
+    int height = b->height;
+    if (a->width != width || a->height != height) {                                    // Full detection reports the size change
+        return 1;
+    }
+    unsigned char* mask = frame_buffer_acquire((size_t)width * height);
+    int motion_pixels = roi_motion_mask(motion_roi(output_path, width, height), a->pixels, b->pixels, mask, width, height,
+                                        coarse_cell_threshold());
+    frame_buffer_release(mask);
+    return motion_pixels > 0;
+}
+
+// Task to check a run of sample intervals, each sample is loaded once
+static void check_samples_task(void* arg) {
+    SampleTask* task = (SampleTask*)arg;
+    GrayFrame prev;
+    int have_prev = load_sample_frame(task->input_path, task->samples[task->first], &prev);
+    for (int k = task->first; k < task->last; ++k) {
+        GrayFrame cur;
+        int have_cur = load_sample_frame(task->input_path, task->samples[k + 1], &cur);
+        task->active[k] = !have_prev || !have_cur || samples_differ(task->output_path, &prev, &cur);  // Missing samples are not assumed quiet
+        free_gray_frame(&prev);
+        prev = cur;
+        have_prev = have_cur;
+    }
+    free_gray_frame(&prev);
+}
+
+// Function to find the frames worth comparing in full, from a low-resolution pass over every sample_every-th frame
+// Returns the number of ranges, sorted and disjoint, in a list the caller frees
+int find_active_ranges(const char* input_path, const char* output_path, int total_frames, int start_frame, FrameRange** ranges) {
+    int every = motion_config.sample_every;
+    int pad = motion_config.sample_pad >= 0 ? motion_config.sample_pad : every;
+    int first_sample = start_frame > 0 ? start_frame - 1 : 0;                           // The reference of the first mask is a sample too
+    int num_samples = (total_frames - 1 - first_sample + every - 1) / every + 1;        // The last frame is always a sample
+    int num_intervals = num_samples - 1;
+    *ranges = NULL;
+    if (num_intervals <= 0) {
+        return 0;
+    }
+    int* samples = (int*)malloc(num_samples * sizeof(int));
+    unsigned char* active = (unsigned char*)calloc(num_intervals, 1);
+    for (int k = 0; k < num_samples - 1; ++k) {
+        samples[k] = first_sample + k * every;
+    }
+    samples[num_samples - 1] = total_frames - 1;
+
+    int num_tasks = (num_intervals + SAMPLE_INTERVALS_PER_TASK - 1) / SAMPLE_INTERVALS_PER_TASK;
+    SampleTask* tasks = (SampleTask*)malloc(num_tasks * sizeof(SampleTask));
+    for (int i = 0; i < num_tasks; ++i) {
+        tasks[i].input_path = input_path;
+        tasks[i].output_path = output_path;
+        tasks[i].samples = samples;
+        tasks[i].active = active;
+        tasks[i].first = i * SAMPLE_INTERVALS_PER_TASK;
+        tasks[i].last = (i == num_tasks - 1) ? num_intervals : tasks[i].first + SAMPLE_INTERVALS_PER_TASK;
+    }
+    ThreadPool* pool = shared_thread_pool();
+    TaskGroup group;
+    task_group_init(&group);
+    thread_pool_submit_range(pool, &group, check_samples_task, tasks, sizeof(SampleTask), num_tasks);
+    thread_pool_wait(pool, &group);
+    task_group_destroy(&group);
+    free(tasks);
+
+    FrameRange* list = (FrameRange*)malloc(num_intervals * sizeof(FrameRange));
+    int count = 0;
+    for (int k = 0; k < num_intervals; ++k) {
+        if (!active[k]) {
+            continue;
+        }
+        int first = samples[k] + 1 - pad;                                               // Masks of frames after sample k show the change
+        int last = samples[k + 1] + pad;
+        first = first < start_frame ? start_frame : first;
+        last = last > total_frames - 1 ? total_frames - 1 : last;
+        if (count > 0 && first <= list[count - 1].last + 1) {                           // Overlaps or touches the previous range
+            if (last > list[count - 1].last) {
+                list[count - 1].last = last;
+            }
+            continue;
+        }
+        list[count].first = first;
+        list[count].last = last;
+        count++;
+    }
+    free(active);
+    free(samples);
+    if (count == 0) {
+        free(list);
+        list = NULL;
+    }
+    *ranges = list;
+    return count;
+}
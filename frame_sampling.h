@@ -0,0 +1,15 @@
+#ifndef FRAME_SAMPLING_H
+#define FRAME_SAMPLING_H
+
+#define SAMPLE_SCALE 8                  // Samples are compared at 1/8 resolution, which JPEG decodes from the DC coefficients alone
+#define SAMPLE_INTERVALS_PER_TASK 16    // Sample intervals checked by one pool task, each task loads one extra sample
+
+// Consecutive frames that get full detection
+typedef struct {
+    int first;
+    int last;                           // Inclusive
+} FrameRange;
+
+int find_active_ranges(const char* input_path, const char* output_path, int total_frames, int start_frame, FrameRange** ranges);
+
+#endif
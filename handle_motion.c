@@ -14,86 +14,601 @@ Date: 12/11/24
 #include <pthread.h>
 #include <math.h>
 #include "image_utils.h"
+#include "motion_kernel.h"
 #include <dirent.h>
 #include <regex.h>
 #include "handle_motion.h"
+#include "motion_config.h"
+#include "thread_pool.h"
+#include "frame_pool.h"
+#include "pipeline.h"
+#include "background_model.h"
+#include "motion_events.h"
+#include "motion_index.h"
+#include "motion_video.h"
+#include "roi_mask.h"
+#include "motion_manifest.h"
+#include "metrics.h"
+#include "frame_pack.h"
+#include "frame_sampling.h"
 #include <unistd.h>
 
-// Function to process a batch of frames in a thread
-void* process_frame_batch(void* arg) {
-    ThreadData* data = (ThreadData*)arg;                                                                // Cast argument to ThreadData struct
-    char frame1_path[256], frame_prev_path[256], output_file[256];
+// Function to wrap an 8-bit luma plane as a frame, downscaled when decode_scale asks for it
+// With in_place set and no scaling, the frame points at the plane itself (e.g. inside a mapped frame pack) and is
+// never returned to the pool, otherwise the pixels are copied into a pooled buffer
+int luma_gray_frame(const unsigned char* luma, int width, int height, int in_place, GrayFrame* out) {
+    out->coarse = NULL;
+    out->mapped = 0;
+    if (motion_config.decode_scale > 1) {
+        out->pixels = downscale_gray(luma, width, height, motion_config.decode_scale, &out->width, &out->height);
+    } else if (in_place) {
+        out->pixels = (unsigned char*)luma;
+        out->mapped = 1;
+        out->width = width;
+        out->height = height;
+    } else {
+        out->pixels = frame_buffer_acquire((size_t)width * height);
+        memcpy(out->pixels, luma, (size_t)width * height);
+        out->width = width;
+        out->height = height;
+    }
+    if (pyramid_active()) {                                                             // No decoder to build it on the way
+        out->coarse = frame_buffer_acquire((size_t)((out->width + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR) *
+                                           ((out->height + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR));
+        luma_box8(out->pixels, out->width, out->height, out->coarse);
+    }
+    metrics_count(METRIC_FRAMES_DECODED, 1);
+    return 1;
+}
+
+// Function to load a frame from a mapped frame pack, raw frames are used in place
+static int load_packed_frame(const FramePack* pack, int index, GrayFrame* out) {
+    uint32_t size;
+    const unsigned char* data = frame_pack_frame(pack, index, &size, NULL);
+    out->pixels = NULL;
+    out->coarse = NULL;
+    out->mapped = 0;
+    if (!data) {
+        return 0;
+    }
+    metrics_count(METRIC_BYTES_READ, size);
+    if (frame_pack_encoding(pack) == FRAME_PACK_RAW) {
+        return luma_gray_frame(data, frame_pack_width(pack), frame_pack_height(pack), 1, out);
+    }
+    out->pixels = decode_jpeg_gray_coarse(data, size, &out->width, &out->height, motion_config.decode_scale,
+                                          pyramid_active() ? &out->coarse : NULL);         // Decoded straight from the mapping
+    return out->pixels != NULL;
+}
+
+// Function to load a frame from the input directory or frame pack as grayscale
+int load_gray_frame(const char* input_path, int index, GrayFrame* out) {
+    FramePack* pack = frame_pack_find(input_path);
+    if (pack) {
+        return load_packed_frame(pack, index, out);
+    }
+    char frame_path[256];
+    snprintf(frame_path, sizeof(frame_path), "%s/frame_%d.jpg", input_path, index);    // Create path for the frame
+
+    out->coarse = NULL;
+    out->mapped = 0;
+    out->pixels = load_jpeg_gray_coarse(frame_path, &out->width, &out->height, motion_config.decode_scale,
+                                        pyramid_active() ? &out->coarse : NULL);       // Decode straight to grayscale
+    return out->pixels != NULL;
+}
+
+// Function to release a cached grayscale frame
+void free_gray_frame(GrayFrame* frame) {
+    if (!frame->mapped) {
+        frame_buffer_release(frame->pixels);                                            // Back to the frame buffer pool
+    }
+    frame_buffer_release(frame->coarse);
+    frame->pixels = NULL;
+    frame->coarse = NULL;
+    frame->mapped = 0;
+}
+
+// Function to tell whether loaded frames carry a coarse level, which only pairwise pyramid detection uses
+// The decoder builds it once per frame, so each frame is also the coarse reference of the next pair
+int pyramid_active(void) {
+    return motion_config.pyramid && motion_config.detect_mode == DETECT_PAIRWISE;
+}
+
+// Function to tell whether quiet stretches are found by sampling first, which only pairwise detection uses
+int sampling_active(void) {
+    return motion_config.sample_every > 1 && motion_config.detect_mode == DETECT_PAIRWISE;
+}
+
+// Function to get the cell threshold of the coarse level
+unsigned char coarse_cell_threshold(void) {
+    if (motion_config.coarse_threshold > 0) {
+        return (unsigned char)motion_config.coarse_threshold;
+    }
+    return (unsigned char)(motion_config.threshold / 4);                               // Motion covering a quarter of a cell still shows
+}
+
+// Function to write the motion mask of two same-size frames for an output directory, returns the number of motion pixels
+// Uses the output's region of interest, and goes coarse to fine when both frames carry a coarse level
+int detect_motion(const char* output_path, const GrayFrame* prev, const GrayFrame* cur, unsigned char* mask) {
+    int width = cur->width;
+    int height = cur->height;
+    const RoiGrid* roi = output_path ? motion_roi(output_path, width, height) : NULL;
+    if (prev->coarse && cur->coarse) {
+        return motion_mask_pyramid(prev->pixels, cur->pixels, prev->coarse, cur->coarse, mask, width, height,
+                                   roi ? roi->tiles : NULL, roi ? roi->pixels : NULL, motion_config.threshold, coarse_cell_threshold());
+    }
+    return roi_motion_mask(roi, prev->pixels, cur->pixels, mask, width, height, motion_config.threshold);
+}
+
+typedef struct OutputSet {
+    char path[512];             // Output directory the set belongs to
+    int refs;                   // Nested open_motion_outputs calls for this directory
+    MotionIndex* index;         // NULL when not written
+    EventStream* events;
+    MotionVideo* video;
+    RoiMask* roi;               // NULL when the whole frame is watched
+    MotionManifest* manifest;   // Resume manifest, NULL when the run is not resumable
+    struct OutputSet* next;
+} OutputSet;
+
+static OutputSet* output_sets = NULL;                                                   // One per output directory being written, so batch jobs run side by side
+static pthread_mutex_t output_sets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to find the first frame of a range that produces a mask
+int first_mask_frame(int start_frame) {
+    return start_frame > 0 ? start_frame : 1;                                               // Frame 0 has nothing before it to compare with
+}
+
+// Function to find the open outputs of a directory, called with output_sets_lock held
+static OutputSet* find_outputs(const char* output_path) {
+    for (OutputSet* set = output_sets; set; set = set->next) {
+        if (strcmp(set->path, output_path) == 0) {
+            return set;
+        }
+    }
+    return NULL;
+}
+
+// Function to work out where the video of an output directory goes
+static void video_path_for(const char* output_path, char* path, size_t size) {
+    if (motion_config.video_per_output) {                                                  // Batch jobs each get their own video
+        const char* name = strrchr(motion_config.video_path, '/');
+        snprintf(path, size, "%s/%s", output_path, name ? name + 1 : motion_config.video_path);
+    } else {
+        snprintf(path, size, "%s", motion_config.video_path);
+    }
+}
+
+// Function to open the per-run outputs of a directory: the motion index, the event stream in event modes and the video if requested
+// A nested call for the same directory shares the outputs that are already open, so a server can hold them for a whole distributed run
+int open_motion_outputs(const char* output_path, double frame_rate, int append, int first_frame) {
+    pthread_mutex_lock(&output_sets_lock);
+    OutputSet* set = find_outputs(output_path);
+    if (set) {
+        set->refs++;
+        pthread_mutex_unlock(&output_sets_lock);
+        return 0;
+    }
+    set = (OutputSet*)calloc(1, sizeof(OutputSet));
+    snprintf(set->path, sizeof(set->path), "%s", output_path);
+    if (roi_mask_for_output(output_path, &set->roi) != 0) {
+        pthread_mutex_unlock(&output_sets_lock);
+        free(set);
+        return -1;
+    }
+    if (motion_config.write_index && !(set->index = motion_index_open(output_path, frame_rate, append))) {
+        pthread_mutex_unlock(&output_sets_lock);
+        roi_mask_destroy(set->roi);
+        free(set);
+        return -1;
+    }
+    if (motion_config.output_mode != OUTPUT_JPEG && !(set->events = motion_events_open(output_path, append))) {
+        pthread_mutex_unlock(&output_sets_lock);
+        motion_index_close(set->index);
+        roi_mask_destroy(set->roi);
+        free(set);
+        return -1;
+    }
+    if (motion_config.video_path) {                                                        // Masks go to the encoder as they finish
+        char video_path[512];
+        video_path_for(output_path, video_path, sizeof(video_path));
+        set->video = motion_video_open(video_path, frame_rate, first_frame);
+    }
+    if (!append) {                                                                         // The results it described are being replaced
+        motion_manifest_remove(output_path);
+    }
+    set->refs = 1;
+    set->next = output_sets;
+    output_sets = set;
+    pthread_mutex_unlock(&output_sets_lock);
+    metrics_begin_run();                                                                   // A run spans the outermost open and close
+    return 0;
+}
+
+// Function to open the outputs of a whole run over frames start_frame to total_frames - 1
+// With resume on, the results of an earlier pairwise run that are still valid are kept and the outputs are added to
+int open_run_outputs(const char* input_path, const char* output_path, double frame_rate, int total_frames, int start_frame) {
+    int append = start_frame > 0;                                                          // Ranges after the first frame add to the outputs
+    pthread_mutex_lock(&output_sets_lock);
+    int nested = find_outputs(output_path) != NULL;                                        // Part of a run that is already open, e.g. a server chunk
+    pthread_mutex_unlock(&output_sets_lock);
+    MotionManifest* manifest = NULL;
+    if (motion_config.resume && motion_config.detect_mode == DETECT_PAIRWISE && !nested) {
+        manifest = motion_manifest_load(input_path, output_path, total_frames);
+        append |= motion_manifest_reused_frames(manifest) > 0;
+    }
+    if (open_motion_outputs(output_path, frame_rate, append, first_mask_frame(start_frame)) != 0) {
+        motion_manifest_close(manifest);
+        return -1;
+    }
+    if (manifest && motion_manifest_start(manifest) != 0) {                                // Still runs, just not resumable
+        motion_manifest_close(manifest);
+        manifest = NULL;
+    }
+    if (manifest) {
+        pthread_mutex_lock(&output_sets_lock);
+        find_outputs(output_path)->manifest = manifest;
+        pthread_mutex_unlock(&output_sets_lock);
+        metrics_count(METRIC_FRAMES_REUSED, motion_manifest_reused_frames(manifest));
+    }
+    return 0;
+}
 
-    for (int i = data->start_frame; i <= data->end_frame; ++i) {                                        // Iterate through the frames assigned to this thread
-        snprintf(frame1_path, sizeof(frame1_path), "%s/frame_%d.jpg", data->input_path, i);             // Create paths for the current frame
-        snprintf(output_file, sizeof(output_file), "%s/motion_frame_%d.jpg", data->output_path, i);     // Create path for output file
+// Function to flush and close the per-run outputs of a directory once its outermost opener is done
+void close_motion_outputs(const char* output_path) {
+    pthread_mutex_lock(&output_sets_lock);
+    OutputSet** link = &output_sets;
+    while (*link && strcmp((*link)->path, output_path) != 0) {
+        link = &(*link)->next;
+    }
+    OutputSet* set = *link;
+    if (!set || --set->refs > 0) {
+        pthread_mutex_unlock(&output_sets_lock);
+        return;
+    }
+    *link = set->next;
+    pthread_mutex_unlock(&output_sets_lock);
+    motion_video_close(set->video);
+    motion_events_close(set->events);
+    motion_index_close(set->index);
+    motion_manifest_close(set->manifest);                                                  // Marked complete once everything else is flushed
+    roi_mask_destroy(set->roi);
+    free(set);
+    metrics_end_run();
+}
 
-        int frame_width, frame_height;
-        unsigned char* frame = load_jpeg(frame1_path, &frame_width, &frame_height);                     // Load the current frame as an RGB image
-        if (!frame) {                                                                                   // Skip if the frame cannot be loaded
-            printf("Error: Cannot load image %s. Skipping...\n", frame1_path);
+// Function to write one motion mask to the output directory, or record it as a motion event
+void save_motion_frame(const char* output_path, int index, unsigned char* mask, int width, int height, int motion_pixels) {
+    pthread_mutex_lock(&output_sets_lock);
+    OutputSet* set = find_outputs(output_path);                                            // Stays open until every frame of its run is saved
+    pthread_mutex_unlock(&output_sets_lock);
+    metrics_count(METRIC_FRAMES_COMPARED, 1);
+    if (motion_pixels > 0) {
+        metrics_count(METRIC_FRAMES_WITH_MOTION, 1);
+        metrics_count(METRIC_MOTION_PIXELS, motion_pixels);
+    }
+    if (set) {
+        motion_index_record(set->index, index, motion_pixels, width * height);              // Every compared frame gets a score
+        motion_video_submit(set->video, index, mask, width, height);                       // No-op unless a video was requested
+    }
+    if (motion_config.output_mode != OUTPUT_JPEG) {                                        // Compact event stream instead of an image per frame
+        motion_events_record(set ? set->events : NULL, index, mask, width, height, motion_pixels);
+        motion_manifest_record(set ? set->manifest : NULL, index, motion_pixels);
+        return;
+    }
+    char output_file[256];
+    snprintf(output_file, sizeof(output_file), "%s/motion_frame_%d.%s", output_path, index,
+             mask_file_extension(motion_config.mask_format));                              // Create path for output file
+    save_mask_image(output_file, mask, width, height, motion_config.mask_format);          // Save the motion-detected frame to the output file
+    motion_manifest_record(set ? set->manifest : NULL, index, motion_pixels);              // Only after the result is on disk
+    if (motion_config.verbosity >= VERBOSITY_FRAMES) {                                     // A line per frame only when asked for
+        printf("Motion-detected image saved: %s\n", output_file);
+    }
+}
+
+// Function to note a frame that was dropped or only used as a reference, so the video does not wait for its mask
+void skip_motion_frame(const char* output_path, int index) {
+    pthread_mutex_lock(&output_sets_lock);
+    OutputSet* set = find_outputs(output_path);
+    pthread_mutex_unlock(&output_sets_lock);
+    if (set) {
+        motion_video_skip(set->video, index);
+    }
+}
+
+// Function to note the frames from first to last that get no detection: quiet frames sampling left out and results kept by resume
+void skip_quiet_frames(const char* output_path, int first, int last) {
+    pthread_mutex_lock(&output_sets_lock);
+    OutputSet* set = find_outputs(output_path);
+    pthread_mutex_unlock(&output_sets_lock);
+    int skipped = 0;
+    for (int i = first; i <= last; ++i) {
+        if (set) {
+            motion_video_skip(set->video, i);
+        }
+        skipped += !motion_manifest_reused(set ? set->manifest : NULL, i);                 // Reused frames are counted when the run opens
+    }
+    if (skipped > 0) {
+        metrics_count(METRIC_FRAMES_SKIPPED, skipped);
+    }
+}
+
+// Function to choose the frames of a run that get full detection: those near motion when sampling, minus results kept by resume
+// Returns the number of ranges, sorted and disjoint, in a list the caller frees
+int plan_frame_ranges(const char* input_path, const char* output_path, int total_frames, int start_frame, int sample, FrameRange** ranges) {
+    FrameRange* list;
+    int count;
+    if (sample && sampling_active()) {                                                     // Quiet stretches found from every Nth frame are left out
+        count = find_active_ranges(input_path, output_path, total_frames, start_frame, &list);
+    } else {
+        list = (FrameRange*)malloc(sizeof(FrameRange));
+        list->first = start_frame;
+        list->last = total_frames - 1;
+        count = 1;
+    }
+    pthread_mutex_lock(&output_sets_lock);
+    OutputSet* set = find_outputs(output_path);
+    MotionManifest* manifest = set ? set->manifest : NULL;
+    pthread_mutex_unlock(&output_sets_lock);
+    if (motion_manifest_reused_frames(manifest) > 0) {
+        FrameRange* pending;
+        count = motion_manifest_pending(manifest, list, count, &pending);
+        free(list);
+        list = pending;
+    }
+    *ranges = list;
+    return count;
+}
+
+// Function to get the region of interest of an output directory at a frame size, NULL = the whole frame
+const RoiGrid* motion_roi(const char* output_path, int width, int height) {
+    pthread_mutex_lock(&output_sets_lock);
+    OutputSet* set = find_outputs(output_path);
+    RoiMask* roi = set ? set->roi : NULL;
+    pthread_mutex_unlock(&output_sets_lock);
+    return roi_mask_grid(roi, width, height);                                              // The set stays open while frames are detected
+}
+
+// Function to detect motion between two grayscale frames and save the result
+static void detect_and_save(const GrayFrame* prev, const GrayFrame* cur, const char* output_path, int index) {
+    int width = cur->width;
+    int height = cur->height;
+    if (prev->width != width || prev->height != height) {                                  // Frames must share a resolution
+        printf("Error: Frame %d size differs from the previous frame. Skipping...\n", index);
+        skip_motion_frame(output_path, index);                                             // The video must not wait for it
+        return;
+    }
+    unsigned char* motion = frame_buffer_acquire((size_t)width * height);                  // Mask buffer borrowed from the pool
+    int motion_pixels = detect_motion(output_path, prev, cur, motion);                     // Difference and threshold in a single pass, region only
+    save_motion_frame(output_path, index, motion, width, height, motion_pixels);
+    frame_buffer_release(motion);
+}
+
+// Function to hand the last frame of a chunk to the next chunk
+static void publish_boundary(BoundaryFrame* boundary, GrayFrame* frame) {
+    pthread_mutex_lock(&boundary->lock);
+    if (boundary->state == BOUNDARY_ABANDONED) {    // Next chunk already loaded the frame from disk
+        free_gray_frame(frame);
+    } else {
+        boundary->frame = *frame;                   // Ownership of the pixels moves to the next chunk
+        boundary->state = BOUNDARY_READY;
+    }
+    pthread_mutex_unlock(&boundary->lock);
+    frame->pixels = NULL;
+    frame->coarse = NULL;
+}
+
+// Function to take the previous chunk's last frame, or load it if that chunk has not finished
+static void take_boundary(BoundaryFrame* boundary, const char* input_path, int index, GrayFrame* out) {
+    pthread_mutex_lock(&boundary->lock);
+    if (boundary->state == BOUNDARY_READY) {
+        *out = boundary->frame;
+        boundary->frame.pixels = NULL;
+        boundary->frame.coarse = NULL;
+        boundary->state = BOUNDARY_TAKEN;
+        pthread_mutex_unlock(&boundary->lock);
+        return;
+    }
+    boundary->state = BOUNDARY_ABANDONED;           // Never block a worker on another chunk
+    pthread_mutex_unlock(&boundary->lock);
+    load_gray_frame(input_path, index, out);
+}
+
+// Function to give up on the previous chunk's last frame
+static void drop_boundary(BoundaryFrame* boundary) {
+    pthread_mutex_lock(&boundary->lock);
+    if (boundary->state == BOUNDARY_READY) {
+        free_gray_frame(&boundary->frame);
+        boundary->state = BOUNDARY_TAKEN;
+    } else {
+        boundary->state = BOUNDARY_ABANDONED;       // The previous chunk frees it when it finishes
+    }
+    pthread_mutex_unlock(&boundary->lock);
+}
+
+// Function to process a chunk of frames, run as a thread pool task
+static void process_frame_batch(void* arg) {
+    ThreadData* data = (ThreadData*)arg;                                                // Cast argument to ThreadData struct
+    GrayFrame prev = { NULL, 0, 0 };                                                    // Grayscale frame i - 1, kept from the previous iteration
+    GrayFrame first = { NULL, 0, 0 };                                                   // First frame, compared last against the shared boundary frame
+
+    if (!data->incoming && data->start_frame > 0) {                                     // No previous chunk, so load the reference frame directly
+        load_gray_frame(data->input_path, data->start_frame - 1, &prev);
+    }
+
+    for (int i = data->start_frame; i <= data->end_frame; ++i) {                        // Iterate through the frames assigned to this chunk
+        GrayFrame cur;
+        if (!load_gray_frame(data->input_path, i, &cur)) {                              // Skip if the frame cannot be loaded
+            printf("Error: Cannot load frame %d in %s. Skipping...\n", i, data->input_path);
+            if (i > 0) {                                                                // Frame 0 never has a mask to wait for
+                skip_motion_frame(data->output_path, i);
+            }
+            if (prev.pixels != first.pixels) {
+                free_gray_frame(&prev);
+            }
+            prev.pixels = NULL;
+            prev.coarse = NULL;
             continue;
         }
-        unsigned char* gray_frame = (unsigned char*)malloc(frame_width * frame_height);
-        rgb_to_grayscale(frame, gray_frame, frame_width, frame_height);                                 // Convert the current frame to grayscale
-        free(frame);                                                                                    
-
-        snprintf(frame_prev_path, sizeof(frame_prev_path), "%s/frame_%d.jpg", data->input_path, i - 1); // Construct path for the previous frame
-        unsigned char* prev_frame = load_jpeg(frame_prev_path, &frame_width, &frame_height);
-
-        if (!prev_frame) {                                                                              // Check if previous frame can be loaded
-            printf("Cannot load previous frame %s. Using current frame as reference.\n", frame_prev_path);
-            
-        } else {                                                                                        // The current frame will be used as the reference.
-            unsigned char* prev_gray_frame = (unsigned char*)malloc(frame_width * frame_height);
-            rgb_to_grayscale(prev_frame, prev_gray_frame, frame_width, frame_height);                   // Convert previous frame to greyscale
-            free(prev_frame);
-
-            unsigned char* diff = (unsigned char*)malloc(frame_width * frame_height);
-            compute_difference(prev_gray_frame, gray_frame, diff, frame_width, frame_height);           // Compute the difference between the current and previous frames
-
-            unsigned char* motion = (unsigned char*)malloc(frame_width * frame_height);
-            apply_threshold(diff, motion, frame_width, frame_height, 20);                               // Apply a threshold to the difference to detect motion
-
-            save_jpeg(output_file, motion, frame_width, frame_height);                                  // Save the motion-detected frame to the output file
-            printf("Motion-detected image saved: %s\n", output_file);
-
-            // Free allocated memory for difference and motion frames
-            free(diff);
-            free(motion);
-            free(prev_gray_frame);
+
+        if (prev.pixels) {
+            detect_and_save(&prev, &cur, data->output_path, i);                         // Compare against the cached previous frame
+        } else if (i != data->start_frame || (!data->incoming && i > 0)) {               // Frame 0 has no previous frame to miss
+            printf("Cannot load previous frame %d. Using current frame as reference.\n", i - 1);
+            skip_motion_frame(data->output_path, i);
         }
-        // Free the grayscale current frame
-        free(gray_frame);
+
+        if (prev.pixels != first.pixels) {                                              // The first frame stays alive until the boundary is resolved
+            free_gray_frame(&prev);
+        }
+        if (i == data->start_frame && data->incoming) {
+            first = cur;
+        }
+        prev = cur;                                                                     // Current frame becomes the reference for the next one
     }
-    return NULL;
+
+    if (data->outgoing) {                                                               // Hand the last frame to the next chunk instead of freeing it
+        if (prev.pixels && prev.pixels == first.pixels) {                               // Single-frame chunk, the first frame is still needed here
+            GrayFrame copy = prev;
+            copy.mapped = 0;
+            copy.pixels = frame_buffer_acquire((size_t)prev.width * prev.height);
+            memcpy(copy.pixels, prev.pixels, prev.width * prev.height);
+            if (prev.coarse) {
+                size_t coarse_size = (size_t)((prev.width + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR) * ((prev.height + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR);
+                copy.coarse = frame_buffer_acquire(coarse_size);
+                memcpy(copy.coarse, prev.coarse, coarse_size);
+            }
+            prev = copy;
+        }
+        publish_boundary(data->outgoing, &prev);
+    } else if (prev.pixels != first.pixels) {
+        free_gray_frame(&prev);
+    }
+
+    if (data->incoming && first.pixels) {                                               // Finish the first frame using the previous chunk's last frame
+        GrayFrame boundary;
+        take_boundary(data->incoming, data->input_path, data->start_frame - 1, &boundary);
+        if (boundary.pixels) {
+            detect_and_save(&boundary, &first, data->output_path, data->start_frame);
+        } else {
+            printf("Cannot load previous frame %d. Using current frame as reference.\n", data->start_frame - 1);
+            skip_motion_frame(data->output_path, data->start_frame);
+        }
+        free_gray_frame(&boundary);
+        free_gray_frame(&first);
+    } else if (data->incoming) {
+        drop_boundary(data->incoming);                                                  // First frame failed, the shared frame is not needed
+    }
+    skip_quiet_frames(data->output_path, data->end_frame + 1, data->skip_last);       // After the masks before them, so the video window stays small
 }
 
-// Function to process frames using multiple threads
-void process_frames_with_threads(const char* input_path, const char* output_path, int total_frames, int start_frame) {
-    int num_threads = get_cpu_cores();                                                      // Determine the number of CPU cores to decide thread count
-    pthread_t threads[num_threads];                                                         // Array to store thread identifiers
-    ThreadData thread_data[num_threads];                                                    // Array to store thread-specific data
-
-    int frames_per_thread = (total_frames - start_frame) / num_threads;                     // Calculate the number of frames each thread should process
-
-    for (int i = 0; i < num_threads; ++i) {                                                 // Loop to create threads
-        thread_data[i].start_frame = start_frame + i * frames_per_thread;                   // Assign the starting frame for the current thread
-        thread_data[i].end_frame = (i == num_threads - 1) ? (total_frames - 1) : (start_frame + (i + 1) * frames_per_thread - 1); // Calculate the ending frame for the current thread
-        thread_data[i].input_path = input_path;                                             // Set the input path for the current thread
-        thread_data[i].output_path = output_path;                                           // Set the output path for the current thread
-        if (pthread_create(&threads[i], NULL, process_frame_batch, &thread_data[i]) != 0) { // Create the thread to process its assigned frames
-            fprintf(stderr, "Error: Could not create thread %d\n", i);
-            exit(EXIT_FAILURE);                                                             // Exit if thread creation fails
+// Function to process frames using the shared work-stealing thread pool, with sample set only those near motion
+static void process_frames(const char* input_path, const char* output_path, int total_frames, int start_frame, int sample) {
+    int frame_count = total_frames - start_frame;                                           // Number of frames to process
+    if (frame_count <= 0) {                                                                 // Nothing to do
+        return;
+    }
+    FramePack* pack = NULL;                                                                 // Mapped once, frames are then found by index
+    if (is_frame_pack(input_path) && !(pack = frame_pack_acquire(input_path))) {
+        return;
+    }
+    double frame_rate = (pack && frame_pack_frame_rate(pack) > 0) ? frame_pack_frame_rate(pack) : motion_config.frame_rate;
+    if (open_run_outputs(input_path, output_path, frame_rate, total_frames, start_frame) != 0) {
+        frame_pack_release(pack);
+        return;
+    }
+    if (motion_config.detect_mode == DETECT_BACKGROUND) {                                   // Frames go through the model in order, tiles run in parallel
+        process_frames_background(input_path, output_path, total_frames, start_frame);
+        close_motion_outputs(output_path);
+        frame_pack_release(pack);
+        return;
+    }
+    FrameRange* ranges;                                                                     // Frames that get full detection
+    int num_ranges = plan_frame_ranges(input_path, output_path, total_frames, start_frame, sample, &ranges);
+    frame_count = 0;
+    for (int r = 0; r < num_ranges; ++r) {
+        frame_count += ranges[r].last - ranges[r].first + 1;
+    }
+    skip_quiet_frames(output_path, first_mask_frame(start_frame), (num_ranges > 0 ? ranges[0].first : total_frames) - 1);
+    if (motion_config.pipeline) {                                                           // Separate decode, detect and encode stages
+        for (int r = 0; r < num_ranges; ++r) {                                              // Ranges in order, so skipped frames never wait
+            process_frames_pipelined(input_path, output_path, ranges[r].last + 1, ranges[r].first);
+            skip_quiet_frames(output_path, ranges[r].last + 1, (r + 1 < num_ranges ? ranges[r + 1].first : total_frames) - 1);
         }
+        free(ranges);
+        close_motion_outputs(output_path);
+        frame_pack_release(pack);
+        return;
     }
-    for (int i = 0; i < num_threads; ++i) {                                                 // Wait for all threads to complete
-        pthread_join(threads[i], NULL);                                                     // Join threads to ensure completion
+    ThreadPool* pool = shared_thread_pool();
+    int chunk_frames = frame_count / (thread_pool_size(pool) * 4);                          // Several chunks per worker so stealing can even out the load
+    if (chunk_frames < 1) {
+        chunk_frames = 1;
+    } else if (chunk_frames > MAX_CHUNK_FRAMES) {
+        chunk_frames = MAX_CHUNK_FRAMES;
     }
+    int num_chunks = 0;
+    for (int r = 0; r < num_ranges; ++r) {
+        num_chunks += (ranges[r].last - ranges[r].first + chunk_frames) / chunk_frames;
+    }
+
+    ThreadData* chunks = (ThreadData*)malloc(num_chunks * sizeof(ThreadData));              // Array to store chunk-specific data
+    BoundaryFrame* boundaries = (BoundaryFrame*)malloc(num_chunks * sizeof(BoundaryFrame)); // Frames shared between neighbouring chunks
+    int i = 0;
+    for (int r = 0; r < num_ranges; ++r) {                                                  // Chunks share frames only within a range
+        int skip_last = (r + 1 < num_ranges ? ranges[r + 1].first : total_frames) - 1;      // Quiet frames up to the next range
+        for (int first = ranges[r].first; first <= ranges[r].last; first += chunk_frames, ++i) {
+            pthread_mutex_init(&boundaries[i].lock, NULL);
+            boundaries[i].state = BOUNDARY_EMPTY;
+            boundaries[i].frame.pixels = NULL;
+            boundaries[i].frame.coarse = NULL;
+            boundaries[i].frame.mapped = 0;
+
+            int last_chunk = first + chunk_frames > ranges[r].last;                         // Last chunk of the range
+            chunks[i].start_frame = first;                                                  // Assign the starting frame for the chunk
+            chunks[i].end_frame = last_chunk ? ranges[r].last : (first + chunk_frames - 1);
+            chunks[i].input_path = input_path;                                              // Set the input path for the chunk
+            chunks[i].output_path = output_path;                                            // Set the output path for the chunk
+            chunks[i].incoming = (first > ranges[r].first) ? &boundaries[i - 1] : NULL;     // Reference frame comes from the previous chunk
+            chunks[i].outgoing = last_chunk ? NULL : &boundaries[i];                        // Last frame goes to the next chunk
+            chunks[i].skip_last = last_chunk ? skip_last : chunks[i].end_frame;
+        }
+    }
+
+    TaskGroup group;
+    task_group_init(&group);
+    thread_pool_submit_range(pool, &group, process_frame_batch, chunks, sizeof(ThreadData), num_chunks);
+    thread_pool_wait(pool, &group);                                                         // Wait for all chunks to complete
+    task_group_destroy(&group);
+
+    for (int i = 0; i < num_chunks; ++i) {
+        free_gray_frame(&boundaries[i].frame);                                              // Published frames nobody took
+        pthread_mutex_destroy(&boundaries[i].lock);
+    }
+    free(boundaries);
+    free(chunks);
+    free(ranges);
+    close_motion_outputs(output_path);                                                      // Flush buffered events and the index
+    frame_pack_release(pack);
+}
+
+// Function to process frames using the shared work-stealing thread pool
+void process_frames_with_threads(const char* input_path, const char* output_path, int total_frames, int start_frame) {
+    process_frames(input_path, output_path, total_frames, start_frame, 1);
 }
 
-// Function to count the number of frames in a directory
+// Function to process frames that were already chosen by sampling, e.g. a chunk of a distributed run, every one in full
+void process_chosen_frames(const char* input_path, const char* output_path, int total_frames, int start_frame) {
+    process_frames(input_path, output_path, total_frames, start_frame, 0);
+}
+
+// Function to count the number of frames in a directory, or in a frame pack
 int count_frames_in_directory(const char* input_path) {
+    if (is_frame_pack(input_path)) {                                                    // The header has the count, no directory scan
+        FramePack* pack = frame_pack_acquire(input_path);
+        int frame_count = pack ? frame_pack_count(pack) : -1;
+        frame_pack_release(pack);
+        return frame_count;
+    }
     DIR* dir = opendir(input_path);                                                     // Open the input directory             
     if (!dir) {                                                                         // Check if the directory could not be opened
         fprintf(stderr, "Error: Could not open input directory '%s'.\n", input_path);
@@ -1,14 +1,63 @@
 #ifndef HANDLE_MOTION_H
 #define HANDLE_MOTION_H
 
+#include <pthread.h>
+#include "roi_mask.h"
+#include "frame_sampling.h"
+
+#define MOTION_THRESHOLD 20     // Minimum pixel difference counted as motion
+
+#define MAX_CHUNK_FRAMES 16     // Upper bound on frames per work item
+
+typedef struct {
+    unsigned char* pixels;      // Grayscale pixel data, NULL if the frame could not be loaded
+    int width;
+    int height;
+    unsigned char* coarse;      // PYRAMID_FACTOR downscaled copy for coarse-to-fine detection, NULL when not built
+    int mapped;                 // Pixels point into a mapped frame pack and are not returned to the pool
+} GrayFrame;
+
+typedef enum {
+    BOUNDARY_EMPTY,             // Previous chunk has not finished yet
+    BOUNDARY_READY,             // Previous chunk published its last frame
+    BOUNDARY_TAKEN,             // Next chunk consumed the published frame
+    BOUNDARY_ABANDONED          // Next chunk loaded the frame itself, so nothing should be published
+} BoundaryState;
+
+typedef struct {
+    pthread_mutex_t lock;
+    BoundaryState state;
+    GrayFrame frame;            // Last frame of one chunk, first reference of the next
+} BoundaryFrame;
+
 typedef struct {
     int start_frame;
     int end_frame;
     const char* input_path;
     const char* output_path;
+    BoundaryFrame* incoming;    // Frame start_frame - 1 shared by the previous chunk (NULL = load it)
+    BoundaryFrame* outgoing;    // Where this chunk hands its last frame to the next chunk (NULL = none)
+    int skip_last;              // Frames after end_frame up to this one get no detection, left out by sampling or kept by resume
 } ThreadData;
 
 void process_frames_with_threads(const char* input_path, const char* output_path, int total_frames, int start_frame);
+void process_chosen_frames(const char* input_path, const char* output_path, int total_frames, int start_frame);
 int count_frames_in_directory(const char* input_path);
+int luma_gray_frame(const unsigned char* luma, int width, int height, int in_place, GrayFrame* out);
+int load_gray_frame(const char* input_path, int index, GrayFrame* out);
+void free_gray_frame(GrayFrame* frame);
+int pyramid_active(void);
+int sampling_active(void);
+unsigned char coarse_cell_threshold(void);
+int detect_motion(const char* output_path, const GrayFrame* prev, const GrayFrame* cur, unsigned char* mask);
+int first_mask_frame(int start_frame);
+int open_motion_outputs(const char* output_path, double frame_rate, int append, int first_frame);
+int open_run_outputs(const char* input_path, const char* output_path, double frame_rate, int total_frames, int start_frame);
+void close_motion_outputs(const char* output_path);
+void save_motion_frame(const char* output_path, int index, unsigned char* mask, int width, int height, int motion_pixels);
+void skip_motion_frame(const char* output_path, int index);
+void skip_quiet_frames(const char* output_path, int first, int last);
+int plan_frame_ranges(const char* input_path, const char* output_path, int total_frames, int start_frame, int sample, FrameRange** ranges);
+const RoiGrid* motion_roi(const char* output_path, int width, int height);
 
 #endif
@@ -3,7 +3,9 @@ Filename: image_utils.c
 Description:
   Provides utility functions for image control, including 
   JPG loading/saving, RGB-to-grayscale conversion, difference 
-  computation, and binary threshold application.
+  computation, and binary threshold application. Each thread
+  keeps one JPEG decoder and one encoder for all of its images,
+  and masks can also be saved losslessly as PGM or PBM.
 Author: Cade Andrae
 Date: 12/11/24
 **************************************************************/
@@ -14,6 +16,15 @@ Date: 12/11/24
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "motion_kernel.h"
+#include "frame_pool.h"
+#include "metrics.h"
+#include "motion_config.h"
+
+#define JPEG_HEADROOM 4096              // Bytes beyond one per pixel reserved for JPEG output (headers, worst-case blocks)
 
 // Function to load a JPEG file into memory
 unsigned char* load_jpeg(const char* filename, int* width, int* height) {
@@ -48,47 +59,417 @@ unsigned char* load_jpeg(const char* filename, int* width, int* height) {
     return data;
 }
 
+typedef struct {
+    struct jpeg_decompress_struct info;         // Always reads from memory, so one object serves files and network frames
+    struct jpeg_error_mgr err;
+    unsigned char* file_data;                   // Reused buffer holding the file being decoded
+    size_t file_capacity;
+} JpegDecoder;
+
+static pthread_key_t decoder_key;
+static pthread_once_t decoder_key_once = PTHREAD_ONCE_INIT;
+
+// Destructor run when a thread exits, releases its decoder
+static void destroy_decoder(void* arg) {
+    JpegDecoder* decoder = (JpegDecoder*)arg;
+    jpeg_destroy_decompress(&decoder->info);
+    free(decoder->file_data);
+    free(decoder);
+}
+
+static void create_decoder_key() {
+    pthread_key_create(&decoder_key, destroy_decoder);
+}
+
+// Function to get the calling thread's decompression object, created once and reused for every frame
+static JpegDecoder* thread_decoder() {
+    pthread_once(&decoder_key_once, create_decoder_key);
+    JpegDecoder* decoder = (JpegDecoder*)pthread_getspecific(decoder_key);
+    if (!decoder) {
+        decoder = (JpegDecoder*)malloc(sizeof(JpegDecoder));
+        decoder->info.err = jpeg_std_error(&decoder->err);     // Set up standard error handling
+        jpeg_create_decompress(&decoder->info);                 // Initialize the decompression object
+        decoder->file_data = NULL;
+        decoder->file_capacity = 0;
+        pthread_setspecific(decoder_key, decoder);
+    }
+    return decoder;
+}
+
+// Function to decode an in-memory JPEG as grayscale into a pooled buffer
+// When coarse is not NULL, also averages each band of PYRAMID_FACTOR rows into a coarse frame while the rows are in cache
+static unsigned char* decode_gray(JpegDecoder* decoder, const unsigned char* jpeg, unsigned long size, int* width, int* height, int scale_denom,
+                                  unsigned char** coarse) {
+    uint64_t start = metrics_now();
+    struct jpeg_decompress_struct* info = &decoder->info;
+    jpeg_mem_src(info, jpeg, size);                                 // Specify the data source (memory)
+    jpeg_read_header(info, TRUE);                                   // Read the JPEG header to get image info
+    info->out_color_space = JCS_GRAYSCALE;                          // Only decode luma, chroma is never converted
+    info->scale_num = 1;                                            // Let the IDCT produce a smaller image directly
+    info->scale_denom = scale_denom;
+    jpeg_start_decompress(info);                                    // Start decompression
+
+    *width = info->output_width;                                    // Dimensions after scaling
+    *height = info->output_height;
+
+    unsigned char* data = frame_buffer_acquire((size_t)(*width) * (*height));           // One byte per pixel, borrowed from the pool
+    int coarse_width = (*width + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR;
+    if (coarse) {
+        *coarse = frame_buffer_acquire((size_t)coarse_width * ((*height + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR));
+    }
+    unsigned char* rowptr[1];
+    while (info->output_scanline < info->output_height) {                               // Read each row of the image
+        rowptr[0] = data + info->output_scanline * (*width);                            // Point to row
+        jpeg_read_scanlines(info, rowptr, 1);                                           // Read row of scanlines
+        int rows = info->output_scanline % PYRAMID_FACTOR;
+        if (coarse && (rows == 0 || info->output_scanline == info->output_height)) {   // A band is complete, or the last short one
+            int band = (info->output_scanline - 1) / PYRAMID_FACTOR;
+            luma_box8_band(data + (size_t)band * PYRAMID_FACTOR * (*width), *width, rows ? rows : PYRAMID_FACTOR,
+                           *coarse + (size_t)band * coarse_width);
+        }
+    }
+    jpeg_finish_decompress(info);       // Finish decompression, the object is kept for the next frame
+    metrics_stage_end(METRIC_DECODE, start);
+    metrics_count(METRIC_FRAMES_DECODED, 1);
+    return data;
+}
+
+// Function to load a JPEG file as grayscale, optionally downscaled by 2, 4 or 8 while decoding, and optionally with
+// its 1/PYRAMID_FACTOR box-filtered coarse level (coarse = NULL skips it)
+// The file is read whole first so disk time and decode time are measured apart
+// The pixels come from the frame buffer pool and must be returned with frame_buffer_release, like the coarse level
+unsigned char* load_jpeg_gray_coarse(const char* filename, int* width, int* height, int scale_denom, unsigned char** coarse) {
+    uint64_t start = metrics_now();
+    FILE* file = fopen(filename, "rb");                             // Open the file in binary read mode
+    if (!file) {                                                    // Check if the file could not be opened
+        fprintf(stderr, "Error: Cannot open file %s\n", filename);
+        return NULL;                                                // Failed
+    }
+    JpegDecoder* decoder = thread_decoder();
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size <= 0) {
+        fprintf(stderr, "Error: Cannot read file %s\n", filename);
+        fclose(file);
+        return NULL;
+    }
+    if ((size_t)size > decoder->file_capacity) {                    // Grow the reused buffer, never shrink it
+        free(decoder->file_data);
+        decoder->file_capacity = (size_t)size;
+        decoder->file_data = (unsigned char*)malloc(decoder->file_capacity);
+    }
+    size_t got = fread(decoder->file_data, 1, (size_t)size, file);
+    fclose(file);                                                   // Close the file
+    metrics_stage_end(METRIC_READ, start);
+    metrics_count(METRIC_BYTES_READ, got);
+    if (got != (size_t)size) {
+        fprintf(stderr, "Error: Cannot read file %s\n", filename);
+        return NULL;
+    }
+    return decode_gray(decoder, decoder->file_data, (unsigned long)size, width, height, scale_denom, coarse);
+}
+
+// Function to load a JPEG file as grayscale, see load_jpeg_gray_coarse
+unsigned char* load_jpeg_gray(const char* filename, int* width, int* height, int scale_denom) {
+    return load_jpeg_gray_coarse(filename, width, height, scale_denom, NULL);
+}
+
+// Function to decode an in-memory JPEG as grayscale, like load_jpeg_gray
+unsigned char* decode_jpeg_gray(const unsigned char* jpeg, unsigned long size, int* width, int* height, int scale_denom) {
+    return decode_gray(thread_decoder(), jpeg, size, width, height, scale_denom, NULL);
+}
+
+// Function to decode an in-memory JPEG as grayscale together with its coarse level, like load_jpeg_gray_coarse
+unsigned char* decode_jpeg_gray_coarse(const unsigned char* jpeg, unsigned long size, int* width, int* height, int scale_denom,
+                                       unsigned char** coarse) {
+    return decode_gray(thread_decoder(), jpeg, size, width, height, scale_denom, coarse);
+}
+
+typedef struct {
+    struct jpeg_compress_struct info;           // Always writes to memory, files are written in one call afterwards
+    struct jpeg_error_mgr err;
+    unsigned char* buffer;                      // Reused output buffer, holds the last encoded image
+    unsigned long capacity;
+    unsigned char* bits;                        // Reused buffer for packed PBM rows
+    size_t bits_capacity;
+} JpegEncoder;
+
+static pthread_key_t encoder_key;
+static pthread_once_t encoder_key_once = PTHREAD_ONCE_INIT;
+
+// Destructor run when a thread exits, releases its encoder
+static void destroy_encoder(void* arg) {
+    JpegEncoder* encoder = (JpegEncoder*)arg;
+    jpeg_destroy_compress(&encoder->info);
+    free(encoder->buffer);
+    free(encoder->bits);
+    free(encoder);
+}
+
+static void create_encoder_key() {
+    pthread_key_create(&encoder_key, destroy_encoder);
+}
+
+// Function to get the calling thread's compression object, created once and reused for every image
+static JpegEncoder* thread_encoder() {
+    pthread_once(&encoder_key_once, create_encoder_key);
+    JpegEncoder* encoder = (JpegEncoder*)pthread_getspecific(encoder_key);
+    if (!encoder) {
+        encoder = (JpegEncoder*)calloc(1, sizeof(JpegEncoder));
+        encoder->info.err = jpeg_std_error(&encoder->err);     // Set up standard error handling
+        jpeg_create_compress(&encoder->info);                   // Initialize the compression object
+        encoder->info.input_components = 1;                     // Grayscale = 1 component
+        encoder->info.in_color_space = JCS_GRAYSCALE;           // Specify grayscale color space
+        jpeg_set_defaults(&encoder->info);                      // Tables and settings are kept between images
+        pthread_setspecific(encoder_key, encoder);
+    }
+    return encoder;
+}
+
+// Function to compress a grayscale image to JPEG in memory with the configured quality and DCT
+// Returns the calling thread's output buffer, valid until its next encode, and the compressed size
+const unsigned char* encode_jpeg_gray(const unsigned char* data, int width, int height, unsigned long* size) {
+    JpegEncoder* encoder = thread_encoder();
+    struct jpeg_compress_struct* info = &encoder->info;
+    unsigned long needed = (unsigned long)width * height + JPEG_HEADROOM;      // Room for any sensible quality, so libjpeg never grows it
+    if (encoder->capacity < needed) {
+        free(encoder->buffer);
+        encoder->buffer = (unsigned char*)malloc(needed);
+        encoder->capacity = needed;
+    }
+    unsigned char* jpeg = encoder->buffer;
+    *size = encoder->capacity;
+    jpeg_mem_dest(info, &jpeg, size);       // Specify the data destination (memory)
+
+    info->image_width = width;              // Image width
+    info->image_height = height;            // Image height
+    jpeg_set_quality(info, motion_config.jpeg_quality, TRUE);
+    info->dct_method = motion_config.fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+    jpeg_start_compress(info, TRUE);        // Start compression
+
+    JSAMPROW rowptr[1];
+    while (info->next_scanline < info->image_height) {              // Pointer to the current row in the image buffer
+        rowptr[0] = (JSAMPROW)(data + info->next_scanline * width); // Point to row
+        jpeg_write_scanlines(info, rowptr, 1);                      // Write row of scanlines
+    }
+    jpeg_finish_compress(info);             // Finish compression, the object is kept for the next image
+    if (jpeg != encoder->buffer) {          // libjpeg outgrew the buffer and allocated a larger one, keep that instead
+        free(encoder->buffer);
+        encoder->buffer = jpeg;
+        encoder->capacity = *size;
+    }
+    return jpeg;
+}
+
+// Function to write a header and pixel data to a new file, without stdio buffering or copying, returns -1 on failure
+static int write_image_file(const char* filename, const void* header, size_t header_size, const void* data, size_t size) {
+    uint64_t start = metrics_now();
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open file %s for writing\n", filename);
+        return -1;
+    }
+    struct iovec parts[2] = { { (void*)header, header_size }, { (void*)data, size } };
+    struct iovec* part = parts;
+    int count = 2;
+    int result = 0;
+    while (count > 0) {                     // Regular files take it all at once, loop in case they do not
+        ssize_t written = writev(fd, part, count);
+        if (written < 0) {
+            result = -1;
+            break;
+        }
+        while (count > 0 && (size_t)written >= part->iov_len) {
+            written -= part->iov_len;
+            part++;
+            count--;
+        }
+        if (count > 0) {
+            part->iov_base = (char*)part->iov_base + written;
+            part->iov_len -= written;
+        }
+    }
+    if (close(fd) != 0 || result != 0) {
+        fprintf(stderr, "Error: Cannot write file %s\n", filename);
+        result = -1;
+    }
+    metrics_stage_end(METRIC_WRITE, start);
+    metrics_count(METRIC_BYTES_WRITTEN, header_size + size);
+    return result;
+}
+
 // Function to save a grayscale JPEG image
+// Compresses into memory and writes the file in one call, so encode time and disk time are measured apart
 void save_jpeg(const char* filename, unsigned char* data, int width, int height) {
-    FILE* file = fopen(filename, "wb");     // Open the file in binary write mode
-    if (!file) {                            // Check if the file could not be opened
-        fprintf(stderr, "Error: Cannot open file %s for writing\n", filename);
-        return;                             // Exit
+    uint64_t start = metrics_now();
+    unsigned long size;
+    const unsigned char* jpeg = encode_jpeg_gray(data, width, height, &size);
+    metrics_stage_end(METRIC_ENCODE, start);
+    write_image_file(filename, NULL, 0, jpeg, size);
+}
+
+// Function to save a grayscale image as a binary PGM (P5), the pixels are written as they are
+void save_pgm(const char* filename, unsigned char* data, int width, int height) {
+    char header[32];
+    int header_size = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", width, height);
+    write_image_file(filename, header, header_size, data, (size_t)width * height);
+}
+
+// Function to save a mask as a binary PBM (P4), one bit per pixel
+// PBM bits mark black pixels, so motion (non-zero) is written as white like in the other formats
+void save_pbm(const char* filename, unsigned char* data, int width, int height) {
+    uint64_t start = metrics_now();
+    JpegEncoder* encoder = thread_encoder();
+    size_t row_bytes = (size_t)(width + 7) / 8;
+    if (encoder->bits_capacity < row_bytes * height) {
+        free(encoder->bits);
+        encoder->bits_capacity = row_bytes * height;
+        encoder->bits = (unsigned char*)malloc(encoder->bits_capacity);
+    }
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = data + (size_t)y * width;
+        unsigned char* bits = encoder->bits + (size_t)y * row_bytes;
+        size_t b = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        for (; b < (size_t)width / 8; ++b) {                                    // Eight pixels at a time
+            uint64_t pixels;
+            memcpy(&pixels, row + b * 8, sizeof(pixels));
+            uint64_t moving = (((pixels & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | pixels) & 0x8080808080808080ULL;
+            bits[b] = (unsigned char)~(((moving >> 7) * 0x8040201008040201ULL) >> 56);    // Top bit of each byte, first pixel highest
+        }
+#endif
+        for (; b < row_bytes; ++b) {
+            int x0 = (int)b * 8;
+            int count = (width - x0 < 8) ? width - x0 : 8;
+            unsigned char byte = 0;
+            for (int i = 0; i < count; ++i) {
+                byte |= (unsigned char)((row[x0 + i] == 0) << (7 - i));
+            }
+            bits[b] = byte;             // Padding bits past the row end stay 0
+        }
     }
+    metrics_stage_end(METRIC_ENCODE, start);
+    char header[32];
+    int header_size = snprintf(header, sizeof(header), "P4\n%d %d\n", width, height);
+    write_image_file(filename, header, header_size, encoder->bits, row_bytes * height);
+}
 
-    struct jpeg_compress_struct info;
-    struct jpeg_error_mgr err;
+// Function to get the file extension of a mask format
+const char* mask_file_extension(MaskFormat format) {
+    return (format == MASK_PGM) ? "pgm" : (format == MASK_PBM) ? "pbm" : "jpg";
+}
 
-    info.err = jpeg_std_error(&err);        // Set up standard error handling
-    jpeg_create_compress(&info);            // Initialize the compression object
-    jpeg_stdio_dest(&info, file);           // Specify the data destination
+// Function to save a mask in the given format
+void save_mask_image(const char* filename, unsigned char* mask, int width, int height, MaskFormat format) {
+    if (format == MASK_PGM) {
+        save_pgm(filename, mask, width, height);
+    } else if (format == MASK_PBM) {
+        save_pbm(filename, mask, width, height);
+    } else {
+        save_jpeg(filename, mask, width, height);
+    }
+}
 
-    info.image_width = width;               // Image width
-    info.image_height = height;             // Image height
-    info.input_components = 1;              // Grayscale = 1 component
-    info.in_color_space = JCS_GRAYSCALE;    // Specify grayscale color space
+// Function to read the header of a binary PGM or PBM file, returns the magic digit (5 or 4) or 0 if it is not one
+static int read_netpbm_header(FILE* file, int* width, int* height, int* max_value) {
+    char magic[3] = { 0 };
+    if (fread(magic, 1, 2, file) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '4')) {
+        return 0;
+    }
+    int values[3] = { 0, 0, 1 };
+    int count = (magic[1] == '5') ? 3 : 2;                                      // PBM has no maximum value
+    for (int i = 0; i < count; ++i) {                                           // Numbers with whitespace and # comments between
+        int c;
+        while ((c = fgetc(file)) == '#' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            if (c == '#') {
+                while ((c = fgetc(file)) != '\n' && c != EOF) {
+                }
+            }
+        }
+        ungetc(c, file);
+        if (fscanf(file, "%d", &values[i]) != 1 || values[i] <= 0) {
+            return 0;
+        }
+    }
+    fgetc(file);                                                                // Single whitespace before the pixels
+    if (values[0] > (1 << 16) || values[1] > (1 << 16) || values[2] > 255) {
+        return 0;
+    }
+    *width = values[0];
+    *height = values[1];
+    *max_value = values[2];
+    return magic[1] - '0';
+}
 
-    jpeg_set_defaults(&info);               // Set default compression parameters
-    jpeg_start_compress(&info, TRUE);       // Start compression
+// Function to load a mask saved by save_mask_image (JPEG, PGM or PBM) as grayscale into a pooled buffer
+unsigned char* load_mask_image(const char* filename, int* width, int* height) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open file %s\n", filename);
+        return NULL;
+    }
+    int max_value;
+    int kind = read_netpbm_header(file, width, height, &max_value);
+    if (kind == 0) {                                                            // Not a PGM or PBM, read it as a JPEG
+        fclose(file);
+        return load_jpeg_gray(filename, width, height, 1);
+    }
+    unsigned char* pixels = frame_buffer_acquire((size_t)(*width) * (*height));
+    size_t row_bytes = (kind == 4) ? (size_t)(*width + 7) / 8 : (size_t)(*width);
+    unsigned char* row = (unsigned char*)malloc(row_bytes);
+    int ok = 1;
+    for (int y = 0; y < *height && ok; ++y) {
+        ok = fread(row, 1, row_bytes, file) == row_bytes;
+        unsigned char* out = pixels + (size_t)y * (*width);
+        for (int x = 0; x < *width && ok; ++x) {
+            out[x] = (kind == 4) ? ((row[x / 8] >> (7 - x % 8)) & 1 ? 0 : 255) : (unsigned char)(row[x] * 255 / max_value);
+        }
+    }
+    free(row);
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Error: Cannot read file %s\n", filename);
+        frame_buffer_release(pixels);
+        return NULL;
+    }
+    return pixels;
+}
 
-    unsigned char* rowptr[1];
-    while (info.next_scanline < info.image_height) {        // Pointer to the current row in the image buffer
-        rowptr[0] = data + info.next_scanline * width;      // Point to row
-        jpeg_write_scanlines(&info, rowptr, 1);             // Write row of scanlines
+// Function to shrink a grayscale image by 2, 4 or 8 into a pooled buffer, averaging each block
+// Sizes round up like the JPEG decoder's scaled output, so raw and JPEG frames come out the same size
+unsigned char* downscale_gray(const unsigned char* gray, int width, int height, int scale_denom, int* out_width, int* out_height) {
+    int scaled_width = (width + scale_denom - 1) / scale_denom;
+    int scaled_height = (height + scale_denom - 1) / scale_denom;
+    unsigned char* scaled = frame_buffer_acquire((size_t)scaled_width * scaled_height);
+    if (scale_denom == PYRAMID_FACTOR) {
+        luma_box8(gray, width, height, scaled);
+    } else {
+        for (int y = 0; y < scaled_height; ++y) {
+            int y0 = y * scale_denom;
+            int y1 = (y0 + scale_denom < height) ? y0 + scale_denom : height;
+            for (int x = 0; x < scaled_width; ++x) {
+                int x0 = x * scale_denom;
+                int x1 = (x0 + scale_denom < width) ? x0 + scale_denom : width;
+                int sum = 0;
+                for (int yy = y0; yy < y1; ++yy) {
+                    for (int xx = x0; xx < x1; ++xx) {
+                        sum += gray[(size_t)yy * width + xx];
+                    }
+                }
+                int count = (x1 - x0) * (y1 - y0);
+                scaled[(size_t)y * scaled_width + x] = (unsigned char)((sum + count / 2) / count);
+            }
+        }
     }
-    jpeg_finish_compress(&info);    // Finish compression
-    jpeg_destroy_compress(&info);   // Destroy the compression object
-    fclose(file);                   // Close the file
+    *out_width = scaled_width;
+    *out_height = scaled_height;
+    return scaled;
 }
 
 // Function to convert an RGB image to grayscale
 void rgb_to_grayscale(unsigned char* rgb, unsigned char* gray, int width, int height) {
-    for (int i = 0; i < width * height; i++) {
-        unsigned char r = rgb[3 * i];       // Red channel
-        unsigned char g = rgb[3 * i + 1];   // Green channel
-        unsigned char b = rgb[3 * i + 2];   // Blue channel
-        gray[i] = (r * 0.2989) + (g * 0.5870) + (b * 0.1140); // Weighted average
-    }
+    luma_convert(rgb, gray, width * height, PIXEL_RGB);    // Fixed-point weighted average, vectorized
 }
 
 // Function to compute absolute difference between two grayscale images
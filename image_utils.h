@@ -1,8 +1,22 @@
 #ifndef IMAGE_UTILS_H
 #define IMAGE_UTILS_H
 
+#include "motion_config.h"
+
 unsigned char* load_jpeg(const char* filename, int* width, int* height);
+unsigned char* load_jpeg_gray(const char* filename, int* width, int* height, int scale_denom);
+unsigned char* decode_jpeg_gray(const unsigned char* jpeg, unsigned long size, int* width, int* height, int scale_denom);
+unsigned char* load_jpeg_gray_coarse(const char* filename, int* width, int* height, int scale_denom, unsigned char** coarse);
+unsigned char* decode_jpeg_gray_coarse(const unsigned char* jpeg, unsigned long size, int* width, int* height, int scale_denom,
+                                       unsigned char** coarse);
+const unsigned char* encode_jpeg_gray(const unsigned char* data, int width, int height, unsigned long* size);
 void save_jpeg(const char* filename, unsigned char* data, int width, int height);
+void save_pgm(const char* filename, unsigned char* data, int width, int height);
+void save_pbm(const char* filename, unsigned char* data, int width, int height);
+const char* mask_file_extension(MaskFormat format);
+void save_mask_image(const char* filename, unsigned char* mask, int width, int height, MaskFormat format);
+unsigned char* load_mask_image(const char* filename, int* width, int* height);
+unsigned char* downscale_gray(const unsigned char* gray, int width, int height, int scale_denom, int* out_width, int* out_height);
 void rgb_to_grayscale(unsigned char* rgb, unsigned char* gray, int width, int height);
 void compute_difference(unsigned char* img1, unsigned char* img2, unsigned char* output, int width, int height);
 void apply_threshold(unsigned char* input, unsigned char* output, int width, int height, unsigned char threshold);
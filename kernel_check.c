@@ -0,0 +1,159 @@
+/**************************************************************
+Filename: kernel_check.c
+Description:
+  Bit-exact check of the SIMD motion kernels against the scalar
+  reference. luma_convert, motion_mask_gray and motion_mask_rgb
+  run on random frames through every instruction set this CPU
+  supports, selected with motion_kernel_set_isa, over odd pixel
+  counts, unaligned buffers and every threshold. Any difference
+  in a mask byte or a motion pixel count fails the check.
+Author: Cade Andrae
+Date: 10/16/26
+Usage:
+  make check
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "motion_kernel.h"
+
+#define CHECK_MAX_PIXELS 4099   // Odd, and past several full vectors of every width
+#define CHECK_ALIGN_OFFSET 1    // Buffers start one byte past malloc's alignment
+
+static const int check_counts[] = { 0, 1, 2, 3, 7, 15, 16, 17, 31, 33, 63, 64, 65, 95, 127, 129, 191, 255, 257, 511, 641,
+                                    1023, 1025, 2047, 4099 };
+static const MotionIsa check_isas[] = { MOTION_ISA_SSE2, MOTION_ISA_AVX2, MOTION_ISA_AVX512 };
+static const PixelOrder check_orders[] = { PIXEL_RGB, PIXEL_BGR };
+
+typedef struct {
+    unsigned char* prev;        // Frames, RGB sized so gray checks can use them too
+    unsigned char* cur;
+    unsigned char* expected;    // Scalar output
+    unsigned char* actual;      // Output of the instruction set under test
+} CheckBuffers;
+
+// Function to fill a buffer with random bytes, with runs of equal and nearly equal values so every threshold is crossed
+static void fill_random(unsigned char* data, const unsigned char* like, int size) {
+    for (int i = 0; i < size; ++i) {
+        int choice = rand() % 4;
+        if (like && choice == 0) {
+            data[i] = like[i];                                              // No difference
+        } else if (like && choice == 1) {
+            data[i] = (unsigned char)(like[i] + (rand() % 5) - 2);          // Small difference, wraps at 0 and 255
+        } else {
+            data[i] = (unsigned char)rand();
+        }
+    }
+}
+
+// Function to report the first byte where two outputs differ
+static int compare_output(const char* kernel, MotionIsa isa, int count, int threshold, const unsigned char* expected,
+                          const unsigned char* actual, int size) {
+    for (int i = 0; i < size; ++i) {
+        if (expected[i] != actual[i]) {
+            fprintf(stderr, "Error: %s %s differs from scalar at byte %d of %d (count %d, threshold %d): %d != %d\n",
+                    kernel, motion_isa_name(isa), i, size, count, threshold, actual[i], expected[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to check luma_convert for one instruction set
+static int check_luma(MotionIsa isa, const CheckBuffers* buffers) {
+    for (size_t c = 0; c < sizeof(check_counts) / sizeof(check_counts[0]); ++c) {
+        int count = check_counts[c];
+        for (size_t o = 0; o < sizeof(check_orders) / sizeof(check_orders[0]); ++o) {
+            motion_kernel_set_isa(MOTION_ISA_SCALAR);
+            luma_convert(buffers->cur, buffers->expected, count, check_orders[o]);
+            motion_kernel_set_isa(isa);
+            memset(buffers->actual, 0xA5, count + 1);                       // The byte after the last must stay untouched
+            buffers->expected[count] = 0xA5;
+            luma_convert(buffers->cur, buffers->actual, count, check_orders[o]);
+            if (!compare_output("luma_convert", isa, count, -1, buffers->expected, buffers->actual, count + 1)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Function to check motion_mask_gray and motion_mask_rgb at one threshold for one instruction set
+static int check_masks(MotionIsa isa, const CheckBuffers* buffers, int threshold) {
+    for (size_t c = 0; c < sizeof(check_counts) / sizeof(check_counts[0]); ++c) {
+        int count = check_counts[c];
+        motion_kernel_set_isa(MOTION_ISA_SCALAR);
+        int expected_pixels = motion_mask_gray(buffers->prev, buffers->cur, buffers->expected, count, threshold);
+        motion_kernel_set_isa(isa);
+        memset(buffers->actual, 0xA5, count + 1);
+        buffers->expected[count] = 0xA5;
+        int actual_pixels = motion_mask_gray(buffers->prev, buffers->cur, buffers->actual, count, threshold);
+        if (actual_pixels != expected_pixels) {
+            fprintf(stderr, "Error: motion_mask_gray %s counts %d motion pixels, scalar %d (count %d, threshold %d)\n",
+                    motion_isa_name(isa), actual_pixels, expected_pixels, count, threshold);
+            return 0;
+        }
+        if (!compare_output("motion_mask_gray", isa, count, threshold, buffers->expected, buffers->actual, count + 1)) {
+            return 0;
+        }
+
+        for (size_t o = 0; o < sizeof(check_orders) / sizeof(check_orders[0]); ++o) {
+            motion_kernel_set_isa(MOTION_ISA_SCALAR);
+            expected_pixels = motion_mask_rgb(buffers->prev, buffers->cur, buffers->expected, count, check_orders[o], threshold);
+            motion_kernel_set_isa(isa);
+            memset(buffers->actual, 0xA5, count + 1);
+            buffers->expected[count] = 0xA5;
+            actual_pixels = motion_mask_rgb(buffers->prev, buffers->cur, buffers->actual, count, check_orders[o], threshold);
+            if (actual_pixels != expected_pixels) {
+                fprintf(stderr, "Error: motion_mask_rgb %s counts %d motion pixels, scalar %d (count %d, threshold %d)\n",
+                        motion_isa_name(isa), actual_pixels, expected_pixels, count, threshold);
+                return 0;
+            }
+            if (!compare_output("motion_mask_rgb", isa, count, threshold, buffers->expected, buffers->actual, count + 1)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    unsigned char* blocks[4];
+    for (int i = 0; i < 4; ++i) {
+        blocks[i] = (unsigned char*)malloc(CHECK_MAX_PIXELS * 3 + CHECK_ALIGN_OFFSET + 1);
+    }
+    CheckBuffers buffers = { blocks[0] + CHECK_ALIGN_OFFSET, blocks[1] + CHECK_ALIGN_OFFSET, blocks[2] + CHECK_ALIGN_OFFSET,
+                             blocks[3] + CHECK_ALIGN_OFFSET };
+    srand(12345);                                                           // Same frames every run, so failures reproduce
+    fill_random(buffers.prev, NULL, CHECK_MAX_PIXELS * 3);
+    fill_random(buffers.cur, buffers.prev, CHECK_MAX_PIXELS * 3);
+
+    MotionIsa detected = motion_kernel_isa();
+    int failed = 0;
+    int checked = 0;
+    for (size_t i = 0; i < sizeof(check_isas) / sizeof(check_isas[0]) && !failed; ++i) {
+        MotionIsa isa = check_isas[i];
+        if (!motion_kernel_set_isa(isa)) {
+            printf("%s: not supported by this CPU, skipped\n", motion_isa_name(isa));
+            continue;
+        }
+        failed = !check_luma(isa, &buffers);
+        for (int threshold = 0; threshold <= 255 && !failed; ++threshold) {
+            failed = !check_masks(isa, &buffers, threshold);
+        }
+        if (!failed) {
+            printf("%s: bit-exact with scalar\n", motion_isa_name(isa));
+            checked++;
+        }
+    }
+    motion_kernel_set_isa(detected);
+    for (int i = 0; i < 4; ++i) {
+        free(blocks[i]);
+    }
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    printf("Kernel check passed: %d instruction set(s) compared with scalar.\n", checked);
+    return EXIT_SUCCESS;
+}
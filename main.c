@@ -11,9 +11,12 @@ Compile Instructions:
   gcc -o main main.c handle_motion.c image_utils.c network_utils.c -lpthread -ljpeg
 Test Instructions:
   - Run the program and follow the menu prompts.
+  - Run with "--scale 4" to test reduced-resolution detection.
   - Select "Convert video to frames" to test video frame extraction.
   - Select "Perform motion detection" to test motion detection.
   - Select "Convert frames to video" to test frame-to-video conversion.
+  - Select "Detect motion directly from video" to test the streaming
+    pipeline that skips the intermediate frame JPEGs.
   - Test server and client modes by running on two terminals.
 **************************************************************/
 
@@ -24,9 +27,20 @@ Test Instructions:
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include <getopt.h>
 #include "main.h"
 #include "handle_motion.h"
+#include "motion_kernel.h"
 #include "network_utils.h"
+#include "motion_config.h"
+#include "motion_index.h"
+#include "motion_video.h"
+#include "image_utils.h"
+#include "frame_pool.h"
+#include "batch.h"
+#include "frame_pack.h"
+#include "frame_sampling.h"
+#include "motion_manifest.h"
 
 // Displays the main menu
 void show_menu() {
@@ -37,17 +51,21 @@ void show_menu() {
     printf("4. Run as server\n");
     printf("5. Run as client\n");
     printf("6. Exit\n");
+    printf("7. Detect motion directly from video\n");
     printf("Choose an option: ");
 }
 
 // Build the full path for a file or directory
 void build_full_path(char* full_path, const char* filename) {
-    if (getcwd(full_path, MAX_PATH) == NULL) {                      // Get the current working directory
+    char cwd[MAX_PATH];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {                         // Get the current working directory
         fprintf(stderr, "Error: Unable to get the directory.\n");
         exit(EXIT_FAILURE);                                         // Exit with failure status
     }
-    strcat(full_path, "/");                                         // Append directory separator
-    strcat(full_path, filename);                                    // Append the filename or directory name
+    if (snprintf(full_path, MAX_PATH, "%s/%s", cwd, filename) >= MAX_PATH) {   // Directory, separator and name, never past the buffer
+        fprintf(stderr, "Error: Path too long: %s/%s\n", cwd, filename);
+        full_path[0] = '\0';                                        // Never matches an existing file
+    }
 }
 
 // Check if a file exists
@@ -58,7 +76,16 @@ int file_exists(const char* path) {
 
 // Clear the input buffer to handle invalid or extra inputs
 void clear_buffer() {
-    while (getchar() != '\n');                                      // Clear input buffer
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF);                    // Clear input buffer
+}
+
+// Read one whitespace-delimited word of at most MAX_PATH - 1 characters, 0 on "home" or end of input
+int read_word(char* word) {
+    if (scanf("%511s", word) != 1) {                                // Width is MAX_PATH - 1
+        return 0;
+    }
+    return strcmp(word, "home") != 0;
 }
 
 // Prompt the user for a file path and validate its existence
@@ -66,7 +93,9 @@ int prompt_file(const char* prompt, char* full_path) {
     char filename[256];
     while (1) {
         printf("%s", prompt);
-        scanf("%s", filename);                                      // Get filename from user
+        if (scanf("%255s", filename) != 1) {                        // Get filename from user, bounded by the buffer
+            return 0;                                               // Input ended
+        }
         if (strcmp(filename, "home") == 0) {                        // Check for "home"
             clear_buffer();                                         // Clear buffer
             return 0;                                               // Return to main menu
@@ -86,7 +115,9 @@ int prompt_directory(const char* prompt, char* full_path) {
     struct stat s;
     while (1) {
         printf("%s", prompt);
-        scanf("%s", dirname);                                       // Get directory name from user
+        if (scanf("%255s", dirname) != 1) {                         // Get directory name from user, bounded by the buffer
+            return 0;                                               // Input ended
+        }
         if (strcmp(dirname, "home") == 0) {                         // Check for "home"
             clear_buffer();                                         // Clear buffer
             return 0;                                               // Return to main menu
@@ -100,13 +131,37 @@ int prompt_directory(const char* prompt, char* full_path) {
     return 1;                                                       // Valid input
 }
 
+// Prompt the user for a frame directory or frame pack and validate its existence
+int prompt_frame_source(const char* prompt, char* full_path) {
+    char name[256];
+    struct stat s;
+    while (1) {
+        printf("%s", prompt);
+        if (scanf("%255s", name) != 1) {                            // Get the name from user, bounded by the buffer
+            return 0;                                               // Input ended
+        }
+        if (strcmp(name, "home") == 0) {                            // Check for "home"
+            clear_buffer();                                         // Clear buffer
+            return 0;                                               // Return to main menu
+        }
+        build_full_path(full_path, name);                           // Build the full path for the directory or pack
+        if (stat(full_path, &s) == 0 && (S_ISDIR(s.st_mode) || is_frame_pack(full_path))) {    // Valid source breaks loop
+            break;
+        }
+        fprintf(stderr, "Error: '%s' is not a frame directory or frame pack. Please try again.\n", full_path);
+    }
+    return 1;                                                       // Valid input
+}
+
 // Prompt the user for a positive integer and validate the input
 int prompt_positive_int(const char* prompt) {
     int value;
     while (1) {
         printf("%s", prompt);
         char input[32];
-        scanf("%s", input);                                         // Get input from user
+        if (scanf("%31s", input) != 1) {                            // Get input from user, bounded by the buffer
+            return 0;                                               // Input ended
+        }
         if (strcmp(input, "home") == 0) {                           // Check if user wants to return to the main menu
             return 0;                                               // Return to main menu
         }
@@ -117,16 +172,26 @@ int prompt_positive_int(const char* prompt) {
     }
 }
 
+// Parse a resolution in WIDTHxHEIGHT format
+int parse_resolution(const char* text, int* width, int* height) {
+    char extra;
+    return sscanf(text, "%dx%d%c", width, height, &extra) == 2 && *width > 0 && *height > 0 &&
+           *width <= 16384 && *height <= 16384;
+}
+
 // Prompt the user for a resolution in WIDTHxHEIGHT format and validate the input
 int prompt_resolution(const char* prompt, char* resolution) {
     while (1) {
         printf("%s", prompt);
-        scanf("%s", resolution);
+        if (scanf("%31s", resolution) != 1) {                       // Bounded by the caller's 32-byte buffer
+            return 0;                                               // Input ended
+        }
         if (strcmp(resolution, "home") == 0) {                      // Check if user wants to return to the main menu
             clear_buffer();                                         // Clears buffer
             return 0;                                               // Return to main menu
         }
-        if (strstr(resolution, "x") != NULL) {                      // Validate resolution format
+        int width, height;
+        if (parse_resolution(resolution, &width, &height)) {        // Validate resolution format
             break;                                                  // Valid resolution breaks loop
         }
         fprintf(stderr, "Error: Resolution must be in the format WIDTHxHEIGHT (e.g., 1280x720). Please try again.\n");
@@ -134,18 +199,19 @@ int prompt_resolution(const char* prompt, char* resolution) {
     return 1;                                                       // Valid input
 }
 
-// Start server mode to process frames in parallel with a client
+// Start server mode to process frames together with any number of clients
 void start_server_mode(const char* input_path, const char* output_path) {
+    if (motion_config.detect_mode == DETECT_BACKGROUND) {                           // Every chunk would restart the model from one frame
+        fprintf(stderr, "Error: Background mode needs every frame in order and cannot be shared with clients. Use option 2 instead.\n");
+        return;
+    }
     int total_frames = count_frames_in_directory(input_path);                       // Count total frames in the directory
     if (total_frames <= 0) {                                                        // Check for no frames
         fprintf(stderr, "Error: No frames found in input directory.\n");
         return;
     }
-    int half_frames = total_frames / 2;                                             // Split the total frames for server and client
-    printf("Server: Processing first half of the frames...\n");
-    process_frames_with_threads(input_path, output_path, half_frames, 0);           // Process first half
-    printf("Waiting for client to process remaining frames...\n");
-    start_server(input_path, output_path, half_frames, total_frames - 1);           // Wait for client to process second half
+    printf("Server: Sharing %d frames between this machine and connected clients...\n", total_frames);
+    start_server(input_path, output_path, 0, total_frames - 1);                     // Local and client workers pull chunks from one queue
     printf("Server processing completed.\n");
 }
 
@@ -176,17 +242,503 @@ int validate_or_create_directory(const char* directory_name) {
     return 1;                                                                       // Directory validated or created
 }
 
-int main() {
+// Long-only command-line options
+enum {
+    OPT_PIPELINE = 1000,
+    OPT_DECODERS,
+    OPT_DETECTORS,
+    OPT_ENCODERS,
+    OPT_QUEUE_DEPTH,
+    OPT_OUTPUT_MODE,
+    OPT_MIN_AREA,
+    OPT_RLE,
+    OPT_FPS,
+    OPT_NO_INDEX,
+    OPT_QUERY_INDEX,
+    OPT_FROM,
+    OPT_TO,
+    OPT_MIN_MOTION,
+    OPT_MODE,
+    OPT_BG_RATE,
+    OPT_HOST,
+    OPT_PORT,
+    OPT_WORKER,
+    OPT_VIDEO,
+    OPT_VIDEO_SIZE,
+    OPT_METRICS,
+    OPT_METRICS_FORMAT,
+    OPT_METRICS_INTERVAL,
+    OPT_BATCH,
+    OPT_BATCH_OUT,
+    OPT_JOBS,
+    OPT_EXTRACT,
+    OPT_REALTIME,
+    OPT_OUTPUT,
+    OPT_LATENCY,
+    OPT_DURATION,
+    OPT_ROI,
+    OPT_IGNORE_MASK,
+    OPT_PYRAMID,
+    OPT_COARSE_THRESHOLD,
+    OPT_SAMPLE_EVERY,
+    OPT_SAMPLE_PAD,
+    OPT_RESUME,
+    OPT_SEGMENTS,
+    OPT_PACK,
+    OPT_MASK_FORMAT,
+    OPT_JPEG_QUALITY,
+    OPT_FAST_DCT
+};
+
+// Motion index query requested on the command line
+typedef struct {
+    const char* path;           // Index file or output directory, NULL = no query
+    double start_time;          // Seconds
+    double end_time;            // Seconds, negative = end of the index
+    double min_motion;          // Percent of the frame
+} IndexQuery;
+
+static IndexQuery index_query = { NULL, 0.0, -1.0, 0.0 };
+static int worker_mode = 0;     // Headless client requested with --worker
+static BatchOptions batch_options = { NULL, NULL, 0, 0 };
+static const char* realtime_source = NULL;      // Camera or file given with --realtime
+static const char* output_dir = NULL;           // Output directory for headless runs
+
+// Print command-line usage
+void print_usage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("       %s [options] --batch-out DIR INPUT...\n", program);
+    printf("       %s [options] --realtime SOURCE --output DIR\n", program);
+    printf("  -t, --threshold N   Pixel difference counted as motion, 0-255 (default %d)\n", MOTION_THRESHOLD);
+    printf("  -s, --scale N       Decode frames at 1/N resolution, N = 1, 2, 4 or 8 (default 1)\n");
+    printf("  -j, --threads N     Worker threads in the shared pool (default: one per CPU core)\n");
+    printf("      --pipeline      Run decode, detect and encode as separate thread groups\n");
+    printf("      --decoders N    Pipeline decoder threads (default: half the cores)\n");
+    printf("      --detectors N   Pipeline detector threads (default: a quarter of the cores)\n");
+    printf("      --encoders N    Pipeline encoder threads (default: a quarter of the cores)\n");
+    printf("      --queue-depth N Frames allowed between pipeline stages (default: 2 per stage thread)\n");
+    printf("      --mode M        Compare frames pairwise or against a background model (default pairwise)\n");
+    printf("      --bg-rate N     Background model learns 1/2^N of each frame, N = 1-8 (default 5)\n");
+    printf("      --roi FILE      Only watch the light area of mask image FILE (binary PGM or JPEG)\n");
+    printf("      --ignore-mask FILE Ignore the light area of mask image FILE, e.g. sky or a timestamp\n");
+    printf("      --pyramid       Pairwise mode: find motion at 1/%d scale, then compare full resolution only there\n", PYRAMID_FACTOR);
+    printf("      --coarse-threshold N Pyramid cell average difference counted as motion, 1-255 (default: threshold / 4)\n");
+    printf("      --sample-every N Pairwise mode: check every Nth frame at 1/%d scale, detect in full only near motion\n", SAMPLE_SCALE);
+    printf("      --sample-pad N  Frames detected in full on each side of a changed sample interval (default N)\n");
+    printf("      --resume        Pairwise mode: keep earlier results whose frames and settings are unchanged (%s)\n", MOTION_MANIFEST_FILE);
+    printf("      --output-mode M Write motion as jpeg masks, jsonl events or binary events (default jpeg)\n");
+    printf("      --mask-format F Save masks as jpeg, pgm (lossless) or pbm (lossless, 1 bit per pixel) (default jpeg)\n");
+    printf("      --jpeg-quality N JPEG quality of masks and jpeg frame packs, 1-100 (default 75)\n");
+    printf("      --fast-dct      Encode JPEGs with the faster integer DCT\n");
+    printf("      --min-area N    Smallest connected motion region, in pixels, reported as an event (default 1)\n");
+    printf("      --rle           Include a run-length encoded mask with each event\n");
+    printf("      --fps F         Frame rate of frame directories, used for index timestamps (default 30)\n");
+    printf("      --no-index      Do not write the motion index (%s)\n", MOTION_INDEX_FILE);
+    printf("      --query-index P List indexed frames from index file or output directory P, then exit\n");
+    printf("      --from SEC      Query start time in seconds (default 0)\n");
+    printf("      --to SEC        Query end time in seconds (default: end of the index)\n");
+    printf("      --min-motion P  Only list frames where more than P percent of the frame moved (default 0)\n");
+    printf("      --host H        Server address for client mode and workers (default 127.0.0.1)\n");
+    printf("      --port N        Server TCP port (default 8080)\n");
+    printf("      --worker        Run as a headless client: process chunks for the server, then exit\n");
+    printf("      --video FILE    Also encode the motion masks into video FILE while detection runs\n");
+    printf("      --video-size WxH Resolution of the --video output (default: detection resolution)\n");
+    printf("      --realtime SRC  Detect motion live from camera SRC (0, /dev/video0) or a file replayed at its frame rate\n");
+    printf("      --output DIR    Output directory for --realtime (default motion_output)\n");
+    printf("      --latency-ms N  Real-time latency budget per frame, in milliseconds (default 100)\n");
+    printf("      --duration SEC  Stop a real-time run after SEC seconds (default: until the source ends or Ctrl+C)\n");
+    printf("      --metrics FILE  Write stage timings and counters to FILE at the end of each run\n");
+    printf("      --metrics-format F Metrics as json or prometheus text (default json)\n");
+    printf("      --metrics-interval SEC Also rewrite the metrics file every SEC seconds during a run\n");
+    printf("      --batch FILE    Run the jobs listed in FILE (one \"INPUT [OUTPUT]\" per line, - = stdin) without the menu\n");
+    printf("      --batch-out DIR Parent of the output directories of batch jobs that do not name one (default .)\n");
+    printf("      --jobs N        Batch jobs run at the same time (default: one per CPU core)\n");
+    printf("      --extract       In batch mode, save the frames of video inputs to OUTPUT/frames before detection\n");
+    printf("      --segments N    Split video to frames extraction into N segments decoded in parallel (default: one per thread)\n");
+    printf("      --pack F        Extract frames into a pack of raw or jpeg frames, OUTPUT/frames%s in batch mode (default raw)\n", FRAME_PACK_EXTENSION);
+    printf("  -v, --verbose       Print a line for every saved frame or event\n");
+    printf("  -q, --quiet         Only print errors and prompts, no run summaries\n");
+    printf("  -h, --help          Show this help and exit\n");
+}
+
+// Parse an integer option value and check its range
+int parse_int_option(const char* name, const char* text, int min, int max, int* value) {
+    char* end;
+    long parsed = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || parsed < min || parsed > max) {         // Reject empty, partial or out-of-range values
+        fprintf(stderr, "Error: --%s must be an integer between %d and %d.\n", name, min, max);
+        return 0;
+    }
+    *value = (int)parsed;
+    return 1;
+}
+
+// Parse a floating-point option value and check its range
+int parse_double_option(const char* name, const char* text, double min, double max, double* value) {
+    char* end;
+    double parsed = strtod(text, &end);
+    if (*text == '\0' || *end != '\0' || !(parsed >= min && parsed <= max)) {     // Also rejects NaN
+        fprintf(stderr, "Error: --%s must be a number between %g and %g.\n", name, min, max);
+        return 0;
+    }
+    *value = parsed;
+    return 1;
+}
+
+// Parse command-line options into the run configuration (1 = continue, 0 = exit, -1 = error)
+int parse_options(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"threshold",   required_argument, NULL, 't'},
+        {"scale",       required_argument, NULL, 's'},
+        {"threads",     required_argument, NULL, 'j'},
+        {"pipeline",    no_argument,       NULL, OPT_PIPELINE},
+        {"decoders",    required_argument, NULL, OPT_DECODERS},
+        {"detectors",   required_argument, NULL, OPT_DETECTORS},
+        {"encoders",    required_argument, NULL, OPT_ENCODERS},
+        {"queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH},
+        {"mode",        required_argument, NULL, OPT_MODE},
+        {"bg-rate",     required_argument, NULL, OPT_BG_RATE},
+        {"roi",         required_argument, NULL, OPT_ROI},
+        {"ignore-mask", required_argument, NULL, OPT_IGNORE_MASK},
+        {"pyramid",     no_argument,       NULL, OPT_PYRAMID},
+        {"coarse-threshold", required_argument, NULL, OPT_COARSE_THRESHOLD},
+        {"sample-every", required_argument, NULL, OPT_SAMPLE_EVERY},
+        {"sample-pad",  required_argument, NULL, OPT_SAMPLE_PAD},
+        {"resume",      no_argument,       NULL, OPT_RESUME},
+        {"output-mode", required_argument, NULL, OPT_OUTPUT_MODE},
+        {"mask-format", required_argument, NULL, OPT_MASK_FORMAT},
+        {"jpeg-quality", required_argument, NULL, OPT_JPEG_QUALITY},
+        {"fast-dct",    no_argument,       NULL, OPT_FAST_DCT},
+        {"min-area",    required_argument, NULL, OPT_MIN_AREA},
+        {"rle",         no_argument,       NULL, OPT_RLE},
+        {"fps",         required_argument, NULL, OPT_FPS},
+        {"no-index",    no_argument,       NULL, OPT_NO_INDEX},
+        {"query-index", required_argument, NULL, OPT_QUERY_INDEX},
+        {"from",        required_argument, NULL, OPT_FROM},
+        {"to",          required_argument, NULL, OPT_TO},
+        {"min-motion",  required_argument, NULL, OPT_MIN_MOTION},
+        {"host",        required_argument, NULL, OPT_HOST},
+        {"port",        required_argument, NULL, OPT_PORT},
+        {"worker",      no_argument,       NULL, OPT_WORKER},
+        {"video",       required_argument, NULL, OPT_VIDEO},
+        {"video-size",  required_argument, NULL, OPT_VIDEO_SIZE},
+        {"metrics",     required_argument, NULL, OPT_METRICS},
+        {"metrics-format", required_argument, NULL, OPT_METRICS_FORMAT},
+        {"metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL},
+        {"batch",       required_argument, NULL, OPT_BATCH},
+        {"batch-out",   required_argument, NULL, OPT_BATCH_OUT},
+        {"jobs",        required_argument, NULL, OPT_JOBS},
+        {"extract",     no_argument,       NULL, OPT_EXTRACT},
+        {"segments",    required_argument, NULL, OPT_SEGMENTS},
+        {"pack",        required_argument, NULL, OPT_PACK},
+        {"realtime",    required_argument, NULL, OPT_REALTIME},
+        {"output",      required_argument, NULL, OPT_OUTPUT},
+        {"latency-ms",  required_argument, NULL, OPT_LATENCY},
+        {"duration",    required_argument, NULL, OPT_DURATION},
+        {"verbose",     no_argument,       NULL, 'v'},
+        {"quiet",       no_argument,       NULL, 'q'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt, value;
+    double real;
+    while ((opt = getopt_long(argc, argv, "t:s:j:vqh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                if (!parse_int_option("threshold", optarg, 0, 255, &value)) return -1;
+                motion_config.threshold = (unsigned char)value;
+                break;
+            case 's':
+                if (!parse_int_option("scale", optarg, 1, 8, &value)) return -1;
+                if (value != 1 && value != 2 && value != 4 && value != 8) {         // libjpeg scales by powers of two here
+                    fprintf(stderr, "Error: --scale must be 1, 2, 4 or 8.\n");
+                    return -1;
+                }
+                motion_config.decode_scale = value;
+                break;
+            case 'j':
+                if (!parse_int_option("threads", optarg, 1, 1024, &value)) return -1;
+                motion_config.num_threads = value;
+                break;
+            case OPT_PIPELINE:
+                motion_config.pipeline = 1;
+                break;
+            case OPT_DECODERS:
+                if (!parse_int_option("decoders", optarg, 1, 1024, &value)) return -1;
+                motion_config.decode_threads = value;
+                break;
+            case OPT_DETECTORS:
+                if (!parse_int_option("detectors", optarg, 1, 1024, &value)) return -1;
+                motion_config.detect_threads = value;
+                break;
+            case OPT_ENCODERS:
+                if (!parse_int_option("encoders", optarg, 1, 1024, &value)) return -1;
+                motion_config.encode_threads = value;
+                break;
+            case OPT_QUEUE_DEPTH:
+                if (!parse_int_option("queue-depth", optarg, 1, 65536, &value)) return -1;
+                motion_config.queue_depth = value;
+                break;
+            case OPT_MODE:
+                if (strcmp(optarg, "pairwise") == 0) {
+                    motion_config.detect_mode = DETECT_PAIRWISE;
+                } else if (strcmp(optarg, "background") == 0) {
+                    motion_config.detect_mode = DETECT_BACKGROUND;
+                } else {
+                    fprintf(stderr, "Error: --mode must be pairwise or background.\n");
+                    return -1;
+                }
+                break;
+            case OPT_BG_RATE:
+                if (!parse_int_option("bg-rate", optarg, 1, 8, &value)) return -1;
+                motion_config.learning_shift = value;
+                break;
+            case OPT_ROI:
+            case OPT_IGNORE_MASK:
+                motion_config.roi_path = optarg;
+                motion_config.roi_ignore = (opt == OPT_IGNORE_MASK);
+                break;
+            case OPT_PYRAMID:
+                motion_config.pyramid = 1;
+                break;
+            case OPT_COARSE_THRESHOLD:
+                if (!parse_int_option("coarse-threshold", optarg, 1, 255, &value)) return -1;
+                motion_config.coarse_threshold = value;
+                break;
+            case OPT_SAMPLE_EVERY:
+                if (!parse_int_option("sample-every", optarg, 1, 1 << 20, &value)) return -1;
+                motion_config.sample_every = value;
+                break;
+            case OPT_SAMPLE_PAD:
+                if (!parse_int_option("sample-pad", optarg, 0, 1 << 20, &value)) return -1;
+                motion_config.sample_pad = value;
+                break;
+            case OPT_RESUME:
+                motion_config.resume = 1;
+                break;
+            case OPT_OUTPUT_MODE:
+                if (strcmp(optarg, "jpeg") == 0) {
+                    motion_config.output_mode = OUTPUT_JPEG;
+                } else if (strcmp(optarg, "jsonl") == 0) {
+                    motion_config.output_mode = OUTPUT_JSONL;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    motion_config.output_mode = OUTPUT_BINARY;
+                } else {
+                    fprintf(stderr, "Error: --output-mode must be jpeg, jsonl or binary.\n");
+                    return -1;
+                }
+                break;
+            case OPT_MASK_FORMAT:
+                if (strcmp(optarg, "jpeg") == 0) {
+                    motion_config.mask_format = MASK_JPEG;
+                } else if (strcmp(optarg, "pgm") == 0) {
+                    motion_config.mask_format = MASK_PGM;
+                } else if (strcmp(optarg, "pbm") == 0) {
+                    motion_config.mask_format = MASK_PBM;
+                } else {
+                    fprintf(stderr, "Error: --mask-format must be jpeg, pgm or pbm.\n");
+                    return -1;
+                }
+                break;
+            case OPT_JPEG_QUALITY:
+                if (!parse_int_option("jpeg-quality", optarg, 1, 100, &value)) return -1;
+                motion_config.jpeg_quality = value;
+                break;
+            case OPT_FAST_DCT:
+                motion_config.fast_dct = 1;
+                break;
+            case OPT_MIN_AREA:
+                if (!parse_int_option("min-area", optarg, 1, 1 << 30, &value)) return -1;
+                motion_config.min_area = value;
+                break;
+            case OPT_RLE:
+                motion_config.rle = 1;
+                break;
+            case OPT_FPS:
+                if (!parse_double_option("fps", optarg, 0.001, 1000.0, &real)) return -1;
+                motion_config.frame_rate = real;
+                break;
+            case OPT_NO_INDEX:
+                motion_config.write_index = 0;
+                break;
+            case OPT_QUERY_INDEX:
+                index_query.path = optarg;
+                break;
+            case OPT_FROM:
+                if (!parse_double_option("from", optarg, 0.0, 1e9, &real)) return -1;
+                index_query.start_time = real;
+                break;
+            case OPT_TO:
+                if (!parse_double_option("to", optarg, 0.0, 1e9, &real)) return -1;
+                index_query.end_time = real;
+                break;
+            case OPT_MIN_MOTION:
+                if (!parse_double_option("min-motion", optarg, 0.0, 100.0, &real)) return -1;
+                index_query.min_motion = real;
+                break;
+            case OPT_HOST:
+                motion_config.server_host = optarg;
+                break;
+            case OPT_PORT:
+                if (!parse_int_option("port", optarg, 1, 65535, &value)) return -1;
+                motion_config.server_port = value;
+                break;
+            case OPT_WORKER:
+                worker_mode = 1;
+                break;
+            case OPT_VIDEO:
+                motion_config.video_path = optarg;
+                break;
+            case OPT_VIDEO_SIZE:
+                if (!parse_resolution(optarg, &motion_config.video_width, &motion_config.video_height)) {
+                    fprintf(stderr, "Error: --video-size must be WIDTHxHEIGHT, e.g. 1280x720.\n");
+                    return -1;
+                }
+                break;
+            case OPT_METRICS:
+                motion_config.metrics_path = optarg;
+                break;
+            case OPT_METRICS_FORMAT:
+                if (strcmp(optarg, "json") == 0) {
+                    motion_config.metrics_format = METRICS_JSON;
+                } else if (strcmp(optarg, "prometheus") == 0) {
+                    motion_config.metrics_format = METRICS_PROMETHEUS;
+                } else {
+                    fprintf(stderr, "Error: --metrics-format must be json or prometheus.\n");
+                    return -1;
+                }
+                break;
+            case OPT_METRICS_INTERVAL:
+                if (!parse_double_option("metrics-interval", optarg, 0.1, 86400.0, &real)) return -1;
+                motion_config.metrics_interval = real;
+                break;
+            case OPT_BATCH:
+                batch_options.job_file = optarg;
+                break;
+            case OPT_BATCH_OUT:
+                batch_options.output_root = optarg;
+                break;
+            case OPT_JOBS:
+                if (!parse_int_option("jobs", optarg, 1, 1024, &value)) return -1;
+                batch_options.max_jobs = value;
+                break;
+            case OPT_EXTRACT:
+                batch_options.extract = 1;
+                break;
+            case OPT_SEGMENTS:
+                if (!parse_int_option("segments", optarg, 1, 256, &value)) return -1;
+                motion_config.extract_segments = value;
+                break;
+            case OPT_PACK:
+                if (strcmp(optarg, "raw") == 0) {
+                    motion_config.pack_encoding = FRAME_PACK_RAW;
+                } else if (strcmp(optarg, "jpeg") == 0) {
+                    motion_config.pack_encoding = FRAME_PACK_JPEG;
+                } else {
+                    fprintf(stderr, "Error: --pack must be raw or jpeg.\n");
+                    return -1;
+                }
+                motion_config.pack_frames = 1;
+                break;
+            case OPT_REALTIME:
+                realtime_source = optarg;
+                break;
+            case OPT_OUTPUT:
+                output_dir = optarg;
+                break;
+            case OPT_LATENCY:
+                if (!parse_double_option("latency-ms", optarg, 1.0, 60000.0, &real)) return -1;
+                motion_config.latency_budget_ms = real;
+                break;
+            case OPT_DURATION:
+                if (!parse_double_option("duration", optarg, 0.1, 1e9, &real)) return -1;
+                motion_config.run_duration = real;
+                break;
+            case 'v':
+                motion_config.verbosity = VERBOSITY_FRAMES;
+                break;
+            case 'q':
+                motion_config.verbosity = VERBOSITY_QUIET;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (motion_config.roi_path) {                                   // Reject a bad mask now, not at the start of every run
+        RoiMask* roi = roi_mask_load(motion_config.roi_path, motion_config.roi_ignore);
+        if (!roi) {
+            return -1;
+        }
+        roi_mask_destroy(roi);
+    }
+    return 1;
+}
+
+// Print one frame matched by an index query
+void print_index_record(const MotionIndexRecord* record, void* arg) {
+    printf("frame %-8u t=%10.3fs  motion %6.2f%% (%u pixels)\n",
+           record->frame, record->timestamp, record->score * 100.0, record->motion_pixels);
+}
+
+// Run the index query given on the command line
+int run_index_query() {
+    char index_path[MAX_PATH];
+    struct stat s;
+    if (stat(index_query.path, &s) == 0 && S_ISDIR(s.st_mode)) {               // An output directory holds the index under its standard name
+        snprintf(index_path, sizeof(index_path), "%s/%s", index_query.path, MOTION_INDEX_FILE);
+    } else {
+        snprintf(index_path, sizeof(index_path), "%s", index_query.path);
+    }
+    int matches = motion_index_query(index_path, index_query.start_time, index_query.end_time,
+                                     index_query.min_motion / 100.0, print_index_record, NULL);
+    if (matches < 0) {
+        return EXIT_FAILURE;
+    }
+    printf("%d matching frames.\n", matches);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
     int choice;
     char input_full_path[MAX_PATH];
     char output_full_path[MAX_PATH];
     char resolution[32];
     int framerate;
 
+    int parsed = parse_options(argc, argv);                         // Apply command-line settings before the menu
+    if (parsed <= 0) {
+        return (parsed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (index_query.path) {                                         // Query mode, no menu
+        return run_index_query();
+    }
+    if (worker_mode) {                                              // Headless worker, no menu
+        return (start_worker() == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (realtime_source) {                                          // Live detection, no menu
+        const char* output = output_dir ? output_dir : "motion_output";
+        if (validate_or_create_directory(output) < 1) {
+            return EXIT_FAILURE;
+        }
+        return (run_realtime(realtime_source, output) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (batch_options.job_file || optind < argc) {                  // Batch mode, no menu
+        motion_config.video_per_output = 1;                         // Each job writes its own video
+        return (run_batch(&batch_options, argv + optind, argc - optind) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     do {
         show_menu(); // Display the main menu
-        if (scanf("%d", &choice) != 1) {
-            fprintf(stderr, "Error: Invalid input. Please enter a number between 1 and 6.\n");
+        int scanned = scanf("%d", &choice);
+        if (scanned == EOF) {                                       // Input ended, leave instead of spinning on the menu
+            break;
+        }
+        if (scanned != 1) {
+            fprintf(stderr, "Error: Invalid input. Please enter a number between 1 and 7.\n");
             clear_buffer(); // Clear buffer
             continue;
         }
@@ -194,18 +746,16 @@ int main() {
         switch (choice) {
             case 1: // Convert video to frames
                 if (!prompt_file("Enter input video filename (e.g., video.mp4): ", input_full_path)) continue;
-                printf("Enter output directory name (e.g., frames): ");
-                scanf("%s", output_full_path);
-                if (strcmp(output_full_path, "home") == 0) continue;
-                if (validate_or_create_directory(output_full_path) < 1) continue;
+                printf("Enter output directory name, or a name ending in %s for a frame pack (e.g., frames): ", FRAME_PACK_EXTENSION);
+                if (!read_word(output_full_path)) continue;
+                if (!is_frame_pack_path(output_full_path) && validate_or_create_directory(output_full_path) < 1) continue;
                 vid_to_jpg(input_full_path, output_full_path);
                 break;
 
             case 2: // Perform motion detection
-                if (!prompt_directory("Enter input directory name of frames (e.g., frames): ", input_full_path)) continue;
+                if (!prompt_frame_source("Enter input directory name of frames or frame pack (e.g., frames): ", input_full_path)) continue;
                 printf("Enter output directory name for motion-detected frames (e.g., motion_output): ");
-                scanf("%s", output_full_path);
-                if (strcmp(output_full_path, "home") == 0) continue;
+                if (!read_word(output_full_path)) continue;
                 if (validate_or_create_directory(output_full_path) < 1) continue;
                 int total_frames = count_frames_in_directory(input_full_path);
                 process_frames_with_threads(input_full_path, output_full_path, total_frames, 0);
@@ -215,18 +765,16 @@ int main() {
             case 3: // Convert frames to video
                 if (!prompt_directory("Enter input directory name of frames (e.g., frames): ", input_full_path)) continue;
                 printf("Enter output video filename (e.g., output.mp4): ");
-                scanf("%s", output_full_path);
-                if (strcmp(output_full_path, "home") == 0) continue;
+                if (!read_word(output_full_path)) continue;
                 if ((framerate = prompt_positive_int("Enter desired framerate (e.g., 30): ")) == 0) continue;
                 if (!prompt_resolution("Enter desired resolution (e.g., 1280x720): ", resolution)) continue;
                 convert_to_video(input_full_path, output_full_path, framerate, resolution);
                 break;
 
             case 4: // Server mode
-                if (!prompt_directory("Server: Enter input directory name of frames: ", input_full_path)) continue;
+                if (!prompt_frame_source("Server: Enter input directory name of frames or frame pack: ", input_full_path)) continue;
                 printf("Server: Enter output directory name for motion-detected frames: ");
-                scanf("%s", output_full_path);
-                if (strcmp(output_full_path, "home") == 0) continue;
+                if (!read_word(output_full_path)) continue;
                 if (validate_or_create_directory(output_full_path) < 1) continue;
                 start_server_mode(input_full_path, output_full_path);
                 break;
@@ -239,28 +787,73 @@ int main() {
                 printf("Exiting program.\n");
                 break;
 
+            case 7: // Stream video straight into motion detection
+                if (!prompt_file("Enter input video filename (e.g., video.mp4): ", input_full_path)) continue;
+                printf("Enter output directory name for motion-detected frames (e.g., motion_output): ");
+                if (!read_word(output_full_path)) continue;
+                if (validate_or_create_directory(output_full_path) < 1) continue;
+                vid_to_motion(input_full_path, output_full_path);
+                printf("Motion detection completed.\n");
+                break;
+
             default: // Invalid input
-                fprintf(stderr, "Error: Invalid option. Please enter a number between 1 and 6.\n");
+                fprintf(stderr, "Error: Invalid option. Please enter a number between 1 and 7.\n");
         }
     } while (choice != 6);
     return 0;
 }
 
-// Convert frames to a video using FFmpeg
-void convert_to_video(const char* input_path, const char* output_filename, int framerate, const char* resolution) {
-    char command[1024];
-
-    // Build the FFmpeg command
-    snprintf(command, sizeof(command),
-             "ffmpeg -framerate %d -i %s/motion_frame_%%d.jpg -vf scale=%s -c:v libx264 -pix_fmt yuv420p %s",
-             framerate, input_path, resolution, output_filename);
-
-    printf("Executing command: %s\n", command);
-    int result = system(command);
+// Find the mask file of a frame in any mask format, returns 1 and its path if it exists
+static int find_mask_frame(char* frame_path, size_t size, const char* input_path, int index) {
+    static const MaskFormat formats[] = { MASK_JPEG, MASK_PGM, MASK_PBM };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        snprintf(frame_path, size, "%s/motion_frame_%d.%s", input_path, index, mask_file_extension(formats[i]));
+        if (file_exists(frame_path)) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    if (result == 0) {
-        printf("Video created successfully: %s\n", output_filename);
+// Convert motion frames to a video with the in-process encoder
+void convert_to_video(const char* input_path, const char* output_filename, int framerate, const char* resolution) {
+    int width, height;
+    if (!parse_resolution(resolution, &width, &height)) {
+        fprintf(stderr, "Error: Invalid resolution '%s'.\n", resolution);
+        return;
+    }
+    char frame_path[MAX_PATH];
+    int index = 0;
+    for (; index < 5; ++index) {                                    // Like ffmpeg, the numbering may start anywhere from 0 to 4
+        if (find_mask_frame(frame_path, sizeof(frame_path), input_path, index)) {
+            break;
+        }
+    }
+    void* encoder = NULL;
+    int frames = 0;
+    for (;; ++index) {                                              // Frames up to the first gap
+        int frame_width, frame_height;
+        unsigned char* frame = find_mask_frame(frame_path, sizeof(frame_path), input_path, index) ?
+                               load_mask_image(frame_path, &frame_width, &frame_height) : NULL;
+        if (!frame) {
+            break;
+        }
+        if (!encoder) {
+            encoder = video_encoder_open(output_filename, framerate, width, height);
+        }
+        if (encoder) {
+            video_encoder_write(encoder, frame, frame_width, frame_height);    // Scaled to the video resolution in memory
+            frames++;
+        }
+        frame_buffer_release(frame);
+        if (!encoder) {
+            break;
+        }
+    }
+    if (encoder) {
+        video_encoder_close(encoder);
+        printf("Video created successfully: %s (%d frames)\n", output_filename, frames);
     } else {
-        fprintf(stderr, "Error: Failed to create video. Make sure FFmpeg is installed and the frames exist.\n");
+        fprintf(stderr, "Error: Failed to create video. Make sure the motion frames exist in %s.\n", input_path);
     }
-}
\ No newline at end of file
+}
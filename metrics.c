@@ -0,0 +1,276 @@
+/**************************************************************
+Filename: metrics.c
+Description:
+  Low-overhead timers and counters for the processing hot path.
+  Each thread adds to its own slot, so recording never takes a
+  lock or shares a cache line; slots are linked into a list
+  without locks and summed when a report is written. Reports go
+  to a JSON or Prometheus text file at the end of a run, and
+  optionally on a timer while it runs.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "motion_config.h"
+#include "image_utils.h"
+
+typedef struct MetricsSlot {
+    uint64_t stage_ns[METRIC_STAGE_COUNT];
+    uint64_t stage_calls[METRIC_STAGE_COUNT];
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    int in_use;                 // Owned by a live thread; a free slot keeps its totals for the next owner
+    struct MetricsSlot* next;
+} __attribute__((aligned(64))) MetricsSlot;
+
+typedef struct {
+    uint64_t stage_ns[METRIC_STAGE_COUNT];
+    uint64_t stage_calls[METRIC_STAGE_COUNT];
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    double elapsed;             // Seconds since the run began
+} MetricsSnapshot;
+
+static const char* stage_names[METRIC_STAGE_COUNT] = { "read", "decode", "convert", "detect", "encode", "write" };
+static const char* counter_names[METRIC_COUNTER_COUNT] = {
+    "frames_decoded", "frames_compared", "frames_with_motion", "motion_pixels", "bytes_read", "bytes_written", "frames_dropped",
+    "frames_skipped", "frames_reused"
+};
+
+static MetricsSlot* slots = NULL;               // Every slot ever created, pushed with compare-and-swap
+static __thread MetricsSlot* thread_slot = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t run_start = 0;
+static int open_runs = 0;                       // Runs in progress; overlapping runs such as batch jobs share one report
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t reporter;
+static int reporter_running = 0;
+static int reporter_stop = 0;
+static pthread_mutex_t reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reporter_cond = PTHREAD_COND_INITIALIZER;
+
+// Function to read the monotonic clock in nanoseconds
+uint64_t metrics_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Destructor run when a thread exits, hands its slot to the next new thread
+static void release_slot(void* arg) {
+    __atomic_store_n(&((MetricsSlot*)arg)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_slot_key() {
+    pthread_key_create(&slot_key, release_slot);
+}
+
+// Function to get the calling thread's slot, reusing one left by an exited thread when possible
+static MetricsSlot* own_slot() {
+    if (thread_slot) {
+        return thread_slot;
+    }
+    pthread_once(&slot_key_once, create_slot_key);
+    MetricsSlot* slot;
+    for (slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        int free_slot = 0;
+        if (__atomic_compare_exchange_n(&slot->in_use, &free_slot, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!slot) {
+        slot = (MetricsSlot*)aligned_alloc(64, sizeof(MetricsSlot));                 // Own cache lines, no false sharing
+        memset(slot, 0, sizeof(MetricsSlot));
+        slot->in_use = 1;
+        slot->next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&slots, &slot->next, slot, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(slot_key, slot);
+    thread_slot = slot;
+    return slot;
+}
+
+// Only the owner writes a slot, so a relaxed load and store is enough and needs no locked instruction
+static inline void slot_add(uint64_t* value, uint64_t amount) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+// Function to charge the time since start to a stage
+void metrics_stage_end(MetricStage stage, uint64_t start) {
+    MetricsSlot* slot = own_slot();
+    slot_add(&slot->stage_ns[stage], metrics_now() - start);
+    slot_add(&slot->stage_calls[stage], 1);
+}
+
+// Function to add to a counter
+void metrics_count(MetricCounter counter, uint64_t amount) {
+    slot_add(&own_slot()->counters[counter], amount);
+}
+
+// Function to sum every slot
+static void take_snapshot(MetricsSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(MetricsSnapshot));
+    for (MetricsSlot* slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+            snapshot->stage_ns[i] += __atomic_load_n(&slot->stage_ns[i], __ATOMIC_RELAXED);
+            snapshot->stage_calls[i] += __atomic_load_n(&slot->stage_calls[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+            snapshot->counters[i] += __atomic_load_n(&slot->counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    snapshot->elapsed = (metrics_now() - run_start) / 1e9;
+}
+
+static void write_json(FILE* file, const MetricsSnapshot* snapshot) {
+    int threads = motion_config.num_threads > 0 ? motion_config.num_threads : get_cpu_cores();
+    fprintf(file, "{\"elapsed_seconds\":%.6f,\"threads\":%d,\"stages\":{", snapshot->elapsed, threads);
+    for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+        fprintf(file, "%s\"%s\":{\"seconds\":%.6f,\"calls\":%llu}", i ? "," : "", stage_names[i],
+                snapshot->stage_ns[i] / 1e9, (unsigned long long)snapshot->stage_calls[i]);
+    }
+    fprintf(file, "},\"counters\":{");
+    for (int i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+        fprintf(file, "%s\"%s\":%llu", i ? "," : "", counter_names[i], (unsigned long long)snapshot->counters[i]);
+    }
+    fprintf(file, "}}\n");
+}
+
+static void write_prometheus(FILE* file, const MetricsSnapshot* snapshot) {
+    fprintf(file, "# HELP motion_stage_seconds_total Time spent in each processing stage, summed over threads.\n");
+    fprintf(file, "# TYPE motion_stage_seconds_total counter\n");
+    for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+        fprintf(file, "motion_stage_seconds_total{stage=\"%s\"} %.6f\n", stage_names[i], snapshot->stage_ns[i] / 1e9);
+    }
+    fprintf(file, "# HELP motion_stage_calls_total Number of timed calls of each processing stage.\n");
+    fprintf(file, "# TYPE motion_stage_calls_total counter\n");
+    for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+        fprintf(file, "motion_stage_calls_total{stage=\"%s\"} %llu\n", stage_names[i], (unsigned long long)snapshot->stage_calls[i]);
+    }
+    for (int i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+        fprintf(file, "# TYPE motion_%s_total counter\n", counter_names[i]);
+        fprintf(file, "motion_%s_total %llu\n", counter_names[i], (unsigned long long)snapshot->counters[i]);
+    }
+    fprintf(file, "# TYPE motion_run_seconds gauge\n");
+    fprintf(file, "motion_run_seconds %.6f\n", snapshot->elapsed);
+}
+
+// Function to write the current totals to the metrics file; a temporary file is renamed over it so readers never see half a report
+static void write_report() {
+    MetricsSnapshot snapshot;
+    take_snapshot(&snapshot);
+    char temp_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", motion_config.metrics_path);
+    FILE* file = fopen(temp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot write metrics to %s\n", temp_path);
+        return;
+    }
+    if (motion_config.metrics_format == METRICS_PROMETHEUS) {
+        write_prometheus(file, &snapshot);
+    } else {
+        write_json(file, &snapshot);
+    }
+    fclose(file);
+    if (rename(temp_path, motion_config.metrics_path) != 0) {
+        fprintf(stderr, "Error: Cannot write metrics to %s\n", motion_config.metrics_path);
+    }
+}
+
+// Thread that rewrites the metrics file every metrics_interval seconds during a run
+static void* reporter_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&reporter_lock);
+    while (!reporter_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)motion_config.metrics_interval;
+        deadline.tv_nsec += (long)((motion_config.metrics_interval - (time_t)motion_config.metrics_interval) * 1e9);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&reporter_cond, &reporter_lock, &deadline) != 0 && !reporter_stop) {
+            write_report();
+        }
+    }
+    pthread_mutex_unlock(&reporter_lock);
+    return NULL;
+}
+
+// Function to zero the totals and start timing a run, unless another run is already being timed
+void metrics_begin_run() {
+    pthread_mutex_lock(&run_lock);
+    if (open_runs++ > 0) {
+        pthread_mutex_unlock(&run_lock);
+        return;
+    }
+    for (MetricsSlot* slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {       // No worker is recording between runs
+            __atomic_store_n(&slot->stage_ns[i], 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->stage_calls[i], 0, __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+            __atomic_store_n(&slot->counters[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    run_start = metrics_now();
+    if (motion_config.metrics_path && motion_config.metrics_interval > 0.0) {
+        reporter_stop = 0;
+        reporter_running = (pthread_create(&reporter, NULL, reporter_main, NULL) == 0);
+    }
+    pthread_mutex_unlock(&run_lock);
+}
+
+// Function to finish a run: stop the timer, write the final report and print a one-line summary
+// Only the last of several overlapping runs reports, covering all of them
+void metrics_end_run() {
+    pthread_mutex_lock(&run_lock);
+    if (open_runs == 0 || --open_runs > 0) {
+        pthread_mutex_unlock(&run_lock);
+        return;
+    }
+    if (reporter_running) {
+        pthread_mutex_lock(&reporter_lock);
+        reporter_stop = 1;
+        pthread_cond_signal(&reporter_cond);
+        pthread_mutex_unlock(&reporter_lock);
+        pthread_join(reporter, NULL);
+        reporter_running = 0;
+    }
+    if (motion_config.metrics_path) {
+        write_report();
+    }
+    if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+        MetricsSnapshot snapshot;
+        take_snapshot(&snapshot);
+        uint64_t busy = 0;
+        for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+            busy += snapshot.stage_ns[i];
+        }
+        uint64_t frames = snapshot.counters[METRIC_FRAMES_COMPARED];
+        printf("Run: %llu frames in %.2f s (%.1f fps).", (unsigned long long)frames, snapshot.elapsed,
+               snapshot.elapsed > 0.0 ? frames / snapshot.elapsed : 0.0);
+        if (snapshot.counters[METRIC_FRAMES_SKIPPED] > 0) {   // Left out by temporal sampling
+            printf(" Skipped %llu quiet frames.", (unsigned long long)snapshot.counters[METRIC_FRAMES_SKIPPED]);
+        }
+        if (snapshot.counters[METRIC_FRAMES_REUSED] > 0) {    // Kept from an earlier run
+            printf(" Reused %llu frames.", (unsigned long long)snapshot.counters[METRIC_FRAMES_REUSED]);
+        }
+        if (busy > 0) {                                         // Where the thread time went: CPU stages versus I/O
+            printf(" Time: read %.0f%%, decode %.0f%%, convert %.0f%%, detect %.0f%%, encode %.0f%%, write %.0f%%.",
+                   100.0 * snapshot.stage_ns[METRIC_READ] / busy, 100.0 * snapshot.stage_ns[METRIC_DECODE] / busy,
+                   100.0 * snapshot.stage_ns[METRIC_CONVERT] / busy, 100.0 * snapshot.stage_ns[METRIC_DETECT] / busy,
+                   100.0 * snapshot.stage_ns[METRIC_ENCODE] / busy, 100.0 * snapshot.stage_ns[METRIC_WRITE] / busy);
+        }
+        printf("\n");
+    }
+    pthread_mutex_unlock(&run_lock);
+}
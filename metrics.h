@@ -0,0 +1,40 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+typedef enum {
+    METRIC_READ,                // Reading frame files, time blocked on input I/O
+    METRIC_DECODE,              // JPEG decompression
+    METRIC_CONVERT,             // Color to grayscale conversion outside the decoder
+    METRIC_DETECT,              // Difference and threshold, fused in one kernel pass
+    METRIC_ENCODE,              // Mask JPEG compression, event labeling and video encoding
+    METRIC_WRITE,               // Writing outputs, time blocked on output I/O
+    METRIC_STAGE_COUNT
+} MetricStage;
+
+typedef enum {
+    METRIC_FRAMES_DECODED,
+    METRIC_FRAMES_COMPARED,     // Masks produced
+    METRIC_FRAMES_WITH_MOTION,
+    METRIC_MOTION_PIXELS,
+    METRIC_BYTES_READ,
+    METRIC_BYTES_WRITTEN,
+    METRIC_FRAMES_DROPPED,      // Real-time frames skipped to stay within the latency budget
+    METRIC_FRAMES_SKIPPED,      // Quiet frames left out by temporal sampling
+    METRIC_FRAMES_REUSED,       // Results of an earlier run kept by resume
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+typedef enum {
+    METRICS_JSON,
+    METRICS_PROMETHEUS          // Prometheus text exposition format
+} MetricsFormat;
+
+uint64_t metrics_now();
+void metrics_stage_end(MetricStage stage, uint64_t start);
+void metrics_count(MetricCounter counter, uint64_t amount);
+void metrics_begin_run();
+void metrics_end_run();
+
+#endif
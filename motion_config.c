@@ -0,0 +1,55 @@
+/**************************************************************
+Filename: motion_config.c 
+Description:
+  Holds the run-wide motion detection settings. Defaults are set
+  here and can be overridden from the command line before any
+  processing starts.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include "motion_config.h"
+#include "handle_motion.h"
+
+MotionConfig motion_config = {
+    .threshold = MOTION_THRESHOLD,      // Default pixel difference threshold
+    .decode_scale = 1,                  // Full-resolution decode
+    .num_threads = 0,                   // One worker per CPU core
+    .pipeline = 0,                      // Chunked work on the shared pool
+    .decode_threads = 0,                // Stage sizes derived from the core count
+    .detect_threads = 0,
+    .encode_threads = 0,
+    .queue_depth = 0,
+    .output_mode = OUTPUT_JPEG,         // JPEG masks, as before event output existed
+    .mask_format = MASK_JPEG,
+    .jpeg_quality = 75,                 // libjpeg's default
+    .fast_dct = 0,
+    .min_area = 1,                      // Any motion pixel counts as an event
+    .rle = 0,
+    .detect_mode = DETECT_PAIRWISE,     // Previous-frame differencing
+    .learning_shift = 5,                // About 1/32 per frame, a second or so of history at 30 fps
+    .write_index = 1,                   // Index is small, always build it
+    .frame_rate = 30.0,
+    .server_host = "127.0.0.1",         // Server on the same machine
+    .server_port = 8080,
+    .video_path = NULL,                 // No video unless requested
+    .video_width = 0,                   // Video at the detection resolution
+    .video_height = 0,
+    .video_per_output = 0,
+    .roi_path = NULL,                   // Watch the whole frame
+    .roi_ignore = 0,
+    .extract_segments = 0,              // Long videos are split across the worker threads
+    .pack_frames = 0,                   // Batch extraction writes a frame directory
+    .pack_encoding = FRAME_PACK_RAW,    // Packed frames are read in place, without decoding
+    .pyramid = 0,                       // Every pixel compared at full resolution
+    .coarse_threshold = 0,
+    .sample_every = 1,                  // Every frame gets full detection
+    .sample_pad = -1,
+    .resume = 0,                        // Every run starts over
+    .latency_budget_ms = 100.0,         // A few frames at 30 fps
+    .run_duration = 0.0,
+    .verbosity = VERBOSITY_NORMAL,      // Summaries, not a line per frame
+    .metrics_path = NULL,               // Metrics only on request
+    .metrics_format = METRICS_JSON,
+    .metrics_interval = 0.0,
+};
@@ -0,0 +1,75 @@
+#ifndef MOTION_CONFIG_H
+#define MOTION_CONFIG_H
+
+#include "metrics.h"
+#include "frame_pack.h"
+
+typedef enum {
+    OUTPUT_JPEG,                // One mask image per frame, in mask_format
+    OUTPUT_JSONL,               // One JSON line per frame with motion
+    OUTPUT_BINARY               // Packed binary event records
+} OutputMode;
+
+typedef enum {
+    MASK_JPEG,                  // Smallest files, but lossy: edges of motion areas pick up gray ringing
+    MASK_PGM,                   // 8-bit binary PGM, lossless and written without encoding
+    MASK_PBM                    // 1-bit binary PBM, lossless and an eighth of the PGM size
+} MaskFormat;
+
+typedef enum {
+    DETECT_PAIRWISE,            // Difference against the previous frame
+    DETECT_BACKGROUND           // Difference against a running background model
+} DetectMode;
+
+typedef enum {
+    VERBOSITY_QUIET,            // Errors only
+    VERBOSITY_NORMAL,           // Run summaries
+    VERBOSITY_FRAMES            // A line for every saved frame or event
+} Verbosity;
+
+typedef struct {
+    unsigned char threshold;    // Minimum pixel difference counted as motion
+    int decode_scale;           // JPEG decode downscale factor: 1, 2, 4 or 8
+    int num_threads;            // Worker threads in the shared pool, 0 = one per CPU core
+    int pipeline;               // Run decode, detect and encode as separate stages
+    int decode_threads;         // Pipeline decoder threads, 0 = automatic
+    int detect_threads;         // Pipeline detector threads, 0 = automatic
+    int encode_threads;         // Pipeline encoder threads, 0 = automatic
+    int queue_depth;            // Items allowed between pipeline stages, 0 = automatic
+    OutputMode output_mode;     // How motion results are written
+    MaskFormat mask_format;     // File format of the masks in OUTPUT_JPEG mode
+    int jpeg_quality;           // JPEG quality of masks and JPEG frame packs, 1-100
+    int fast_dct;               // Encode JPEGs with the faster, slightly less accurate integer DCT
+    int min_area;               // Smallest connected region reported as a motion event, in pixels
+    int rle;                    // Include a run-length encoded mask with each event
+    DetectMode detect_mode;     // What each frame is compared against
+    int learning_shift;         // Background model learns 1/2^shift of each new frame
+    int write_index;            // Build the per-frame motion score index
+    const char* server_host;    // Server address used by clients and workers
+    int server_port;            // TCP port the server listens on
+    double frame_rate;          // Frames per second of frame directories, used for index timestamps
+    const char* video_path;     // Encode the masks into this video as they finish, NULL = no video
+    int video_width;            // Video resolution, 0 = the mask resolution
+    int video_height;
+    int video_per_output;       // Treat video_path as a file name inside each output directory (batch mode)
+    const char* roi_path;       // Mask image of the watched area, NULL = the whole frame
+    int roi_ignore;             // The mask marks the ignored area instead
+    int extract_segments;       // Video to frames: segments decoded in parallel, 0 = one per worker thread
+    int pack_frames;            // Batch extraction writes OUTPUT/frames.fpk instead of OUTPUT/frames
+    FramePackEncoding pack_encoding;    // How frames are stored in frame packs
+    int pyramid;                // Pairwise mode: look for motion at 1/PYRAMID_FACTOR scale first, refine only where it is found
+    int coarse_threshold;       // Pyramid: minimum cell average difference, 0 = derived from threshold
+    int sample_every;           // Pairwise mode: check every Nth frame first, detect in full only near motion, 1 = every frame
+    int sample_pad;             // Frames detected in full on each side of a changed sample interval, -1 = sample_every
+    int resume;                 // Pairwise mode: keep the results of an earlier run whose inputs and settings are unchanged
+    double latency_budget_ms;   // Real-time mode: longest allowed time from frame arrival to saved result
+    double run_duration;        // Real-time mode: stop after this many seconds, 0 = until the source ends
+    int verbosity;              // Verbosity level of console output
+    const char* metrics_path;   // Write stage timings and counters here, NULL = no metrics file
+    MetricsFormat metrics_format;
+    double metrics_interval;    // Seconds between metrics file updates during a run, 0 = only at the end
+} MotionConfig;
+
+extern MotionConfig motion_config;
+
+#endif
@@ -0,0 +1,418 @@
+/**************************************************************
+Filename: motion_events.c
+Description:
+  Compact motion event output. Instead of a JPEG mask per frame,
+  frames with motion are reduced to their motion pixel count,
+  the bounding boxes of connected motion regions and optionally
+  a run-length encoded mask, and appended to a single JSON-lines
+  or binary stream. Frames without a large enough region are
+  skipped entirely.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "motion_events.h"
+#include "motion_config.h"
+#include "metrics.h"
+
+#define EVENTS_FLUSH_SIZE (64 * 1024)   // Shared buffer size that triggers a write
+
+typedef struct {
+    int row;
+    int start;
+    int end;                        // Inclusive
+} MaskRun;
+
+typedef struct {
+    MaskRun* runs;                  // Horizontal motion runs in row-major order
+    int* parent;                    // Union-find forest over the runs
+    int* region_of;                 // Region index of each root run, -1 = none yet
+    int run_capacity;
+    MotionRegion* regions;
+    int region_capacity;
+    uint32_t* rle;
+    int rle_capacity;
+    char* record;                   // Encoded record, appended to the stream in one piece
+    size_t record_used;
+    size_t record_capacity;
+} EventScratch;
+
+struct EventStream {
+    pthread_mutex_t lock;
+    int fd;
+    char path[512];
+    char* buffer;                   // Whole records waiting to be written
+    size_t used;
+    int frames;                     // Frames with motion recorded in this run
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+
+// Destructor run when a thread exits, releases its scratch space
+static void destroy_scratch(void* arg) {
+    EventScratch* scratch = (EventScratch*)arg;
+    free(scratch->runs);
+    free(scratch->parent);
+    free(scratch->region_of);
+    free(scratch->regions);
+    free(scratch->rle);
+    free(scratch->record);
+    free(scratch);
+}
+
+static void create_scratch_key() {
+    pthread_key_create(&scratch_key, destroy_scratch);
+}
+
+// Function to get the calling thread's labeling and encoding scratch space
+static EventScratch* thread_scratch() {
+    pthread_once(&scratch_key_once, create_scratch_key);
+    EventScratch* scratch = (EventScratch*)pthread_getspecific(scratch_key);
+    if (!scratch) {
+        scratch = (EventScratch*)calloc(1, sizeof(EventScratch));
+        pthread_setspecific(scratch_key, scratch);
+    }
+    return scratch;
+}
+
+// Function to grow an array so it holds at least needed elements
+static void* grow_array(void* array, int* capacity, int needed, size_t element_size) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    int grown = *capacity ? *capacity : 256;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    array = realloc(array, (size_t)grown * element_size);
+    if (!array) {
+        fprintf(stderr, "Error: Out of memory while encoding motion events.\n");
+        exit(EXIT_FAILURE);
+    }
+    *capacity = grown;
+    return array;
+}
+
+static int find_root(int* parent, int run) {
+    while (parent[run] != run) {
+        parent[run] = parent[parent[run]];  // Path halving keeps the trees flat
+        run = parent[run];
+    }
+    return run;
+}
+
+static void join_runs(int* parent, int a, int b) {
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b) {
+        parent[b] = a;                      // The earliest run stays the root, so regions keep scan order
+    } else if (b < a) {
+        parent[a] = b;
+    }
+}
+
+// Function to split a mask into horizontal runs and join runs that touch (8-connected)
+static int find_runs(EventScratch* scratch, const unsigned char* mask, int width, int height) {
+    int count = 0;
+    int prev_begin = 0, prev_end = 0;                                   // Runs of the previous row
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = mask + (size_t)y * width;
+        int scan = prev_begin;                                          // First previous-row run that can still touch
+        int row_begin = count;
+        int x = 0;
+        while (x < width) {
+            uint64_t block;
+            if (x + 8 <= width && (memcpy(&block, row + x, 8), block == 0)) {
+                x += 8;                                                 // Most of a mask is background, skip it a word at a time
+                continue;
+            }
+            if (!row[x]) {
+                x++;
+                continue;
+            }
+            int start = x;
+            while (x < width && row[x]) {
+                x++;
+            }
+            if (count == scratch->run_capacity) {
+                scratch->runs = (MaskRun*)grow_array(scratch->runs, &scratch->run_capacity, count + 1, sizeof(MaskRun));
+                scratch->parent = (int*)realloc(scratch->parent, scratch->run_capacity * sizeof(int));
+                scratch->region_of = (int*)realloc(scratch->region_of, scratch->run_capacity * sizeof(int));
+            }
+            scratch->runs[count].row = y;
+            scratch->runs[count].start = start;
+            scratch->runs[count].end = x - 1;
+            scratch->parent[count] = count;
+
+            while (scan < prev_end && scratch->runs[scan].end < start - 1) {
+                scan++;                                                 // Ends left of this run, and of every later one
+            }
+            for (int p = scan; p < prev_end && scratch->runs[p].start <= x; ++p) {
+                join_runs(scratch->parent, p, count);                   // Overlaps, including diagonally
+            }
+            count++;
+        }
+        prev_begin = row_begin;
+        prev_end = count;
+    }
+    return count;
+}
+
+// Function to turn joined runs into region bounding boxes, dropping regions below min_area
+static int collect_regions(EventScratch* scratch, int run_count, int min_area) {
+    int region_count = 0;
+    for (int i = 0; i < run_count; ++i) {
+        scratch->region_of[i] = -1;
+    }
+    for (int i = 0; i < run_count; ++i) {
+        MaskRun* run = &scratch->runs[i];
+        int root = find_root(scratch->parent, i);
+        int region = scratch->region_of[root];
+        if (region < 0) {                                               // First run of a new region
+            region = region_count++;
+            scratch->region_of[root] = region;
+            scratch->regions = (MotionRegion*)grow_array(scratch->regions, &scratch->region_capacity, region_count, sizeof(MotionRegion));
+            scratch->regions[region].x = run->start;
+            scratch->regions[region].y = run->row;
+            scratch->regions[region].width = run->end + 1;              // Holds the right edge until the end
+            scratch->regions[region].height = run->row + 1;             // Holds the bottom edge until the end
+            scratch->regions[region].area = 0;
+        }
+        MotionRegion* box = &scratch->regions[region];
+        if ((uint32_t)run->start < box->x) box->x = run->start;
+        if ((uint32_t)run->end + 1 > box->width) box->width = run->end + 1;
+        box->height = run->row + 1;                                     // Runs arrive top to bottom
+        box->area += run->end - run->start + 1;
+    }
+    int kept = 0;
+    for (int i = 0; i < region_count; ++i) {
+        MotionRegion box = scratch->regions[i];
+        if (box.area < (uint32_t)min_area) {                            // Too small, treated as noise
+            continue;
+        }
+        box.width -= box.x;                                             // Convert edges to sizes
+        box.height -= box.y;
+        scratch->regions[kept++] = box;
+    }
+    return kept;
+}
+
+// Function to run-length encode the mask from its runs, alternating background and motion lengths
+static int encode_rle(EventScratch* scratch, int run_count, int width, int height) {
+    int count = 0;
+    long position = 0;                                                  // End of the last motion run, row-major
+    for (int i = 0; i < run_count; ++i) {
+        long start = (long)scratch->runs[i].row * width + scratch->runs[i].start;
+        long length = scratch->runs[i].end - scratch->runs[i].start + 1;
+        if (count > 0 && start == position) {                           // Continues a run that ended at the previous row's edge
+            scratch->rle[count - 1] += length;
+        } else {
+            scratch->rle = (uint32_t*)grow_array(scratch->rle, &scratch->rle_capacity, count + 2, sizeof(uint32_t));
+            scratch->rle[count++] = start - position;
+            scratch->rle[count++] = length;
+        }
+        position = start + length;
+    }
+    scratch->rle = (uint32_t*)grow_array(scratch->rle, &scratch->rle_capacity, count + 1, sizeof(uint32_t));
+    if (position < (long)width * height || count == 0) {
+        scratch->rle[count++] = (long)width * height - position;        // Trailing background, so the lengths cover the frame
+    }
+    return count;
+}
+
+static void append_bytes(EventScratch* scratch, const void* data, size_t size) {
+    if (scratch->record_used + size > scratch->record_capacity) {
+        size_t grown = scratch->record_capacity ? scratch->record_capacity : 1024;
+        while (grown < scratch->record_used + size) {
+            grown *= 2;
+        }
+        scratch->record = (char*)realloc(scratch->record, grown);
+        if (!scratch->record) {
+            fprintf(stderr, "Error: Out of memory while encoding motion events.\n");
+            exit(EXIT_FAILURE);
+        }
+        scratch->record_capacity = grown;
+    }
+    memcpy(scratch->record + scratch->record_used, data, size);
+    scratch->record_used += size;
+}
+
+static void append_text(EventScratch* scratch, const char* text) {
+    append_bytes(scratch, text, strlen(text));
+}
+
+// Function to append an unsigned decimal number, cheaper than snprintf for long RLE arrays
+static void append_uint(EventScratch* scratch, uint32_t value) {
+    char digits[10];
+    int length = 0;
+    do {
+        digits[sizeof(digits) - 1 - length++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    append_bytes(scratch, digits + sizeof(digits) - length, length);
+}
+
+// Function to encode one frame as a JSON line
+static void encode_json(EventScratch* scratch, const MotionEventRecord* record) {
+    append_text(scratch, "{\"frame\":");
+    append_uint(scratch, record->frame);
+    append_text(scratch, ",\"width\":");
+    append_uint(scratch, record->width);
+    append_text(scratch, ",\"height\":");
+    append_uint(scratch, record->height);
+    append_text(scratch, ",\"motion_pixels\":");
+    append_uint(scratch, record->motion_pixels);
+    append_text(scratch, ",\"regions\":[");
+    for (uint32_t i = 0; i < record->region_count; ++i) {
+        const MotionRegion* box = &scratch->regions[i];
+        append_text(scratch, i ? ",{\"x\":" : "{\"x\":");
+        append_uint(scratch, box->x);
+        append_text(scratch, ",\"y\":");
+        append_uint(scratch, box->y);
+        append_text(scratch, ",\"w\":");
+        append_uint(scratch, box->width);
+        append_text(scratch, ",\"h\":");
+        append_uint(scratch, box->height);
+        append_text(scratch, ",\"area\":");
+        append_uint(scratch, box->area);
+        append_text(scratch, "}");
+    }
+    append_text(scratch, "]");
+    if (record->rle_count > 0) {
+        append_text(scratch, ",\"rle\":[");
+        for (uint32_t i = 0; i < record->rle_count; ++i) {
+            if (i) append_text(scratch, ",");
+            append_uint(scratch, scratch->rle[i]);
+        }
+        append_text(scratch, "]");
+    }
+    append_text(scratch, "}\n");
+}
+
+// Function to encode one frame as a binary record
+static void encode_binary(EventScratch* scratch, const MotionEventRecord* record) {
+    append_bytes(scratch, record, sizeof(MotionEventRecord));
+    append_bytes(scratch, scratch->regions, record->region_count * sizeof(MotionRegion));
+    append_bytes(scratch, scratch->rle, record->rle_count * sizeof(uint32_t));
+}
+
+// Function to write buffered records, called with the stream lock held
+static void flush_stream(EventStream* stream) {
+    uint64_t start = metrics_now();
+    size_t written = 0;
+    while (written < stream->used) {
+        ssize_t result = write(stream->fd, stream->buffer + written, stream->used - written);
+        if (result < 0) {
+            fprintf(stderr, "Error: Failed to write motion events to %s\n", stream->path);
+            break;
+        }
+        written += result;
+    }
+    stream->used = 0;
+    metrics_stage_end(METRIC_WRITE, start);
+    metrics_count(METRIC_BYTES_WRITTEN, written);
+}
+
+// Function to open the event stream in the output directory, appending when a run continues another one
+EventStream* motion_events_open(const char* output_path, int append) {
+    int binary = (motion_config.output_mode == OUTPUT_BINARY);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", output_path, binary ? MOTION_EVENTS_BINARY : MOTION_EVENTS_JSONL);
+    int flags = O_WRONLY | O_CREAT | O_APPEND | (append ? 0 : O_TRUNC);     // O_APPEND keeps whole records intact when a client shares the file
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open motion event file %s\n", path);
+        return NULL;
+    }
+    struct stat info;
+    if (binary && fstat(fd, &info) == 0 && info.st_size == 0) {             // New binary stream, write the header first
+        MotionEventsHeader header;
+        memcpy(header.magic, MOTION_EVENTS_MAGIC, sizeof(header.magic));
+        header.version = MOTION_EVENTS_VERSION;
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            fprintf(stderr, "Error: Failed to write motion events to %s\n", path);
+            close(fd);
+            return NULL;
+        }
+    }
+    EventStream* stream = (EventStream*)malloc(sizeof(EventStream));
+    pthread_mutex_init(&stream->lock, NULL);
+    snprintf(stream->path, sizeof(stream->path), "%s", path);
+    stream->buffer = (char*)malloc(EVENTS_FLUSH_SIZE);
+    stream->used = 0;
+    stream->frames = 0;
+    stream->fd = fd;
+    return stream;
+}
+
+// Function to reduce a motion mask to an event and append it, frames without a large enough region are skipped
+void motion_events_record(EventStream* stream, int index, const unsigned char* mask, int width, int height, int motion_pixels) {
+    if (!stream || motion_pixels < motion_config.min_area) {                // No region can reach the minimum area
+        return;
+    }
+    uint64_t start = metrics_now();
+    EventScratch* scratch = thread_scratch();
+    int run_count = find_runs(scratch, mask, width, height);
+    MotionEventRecord record;
+    record.frame = index;
+    record.width = width;
+    record.height = height;
+    record.motion_pixels = motion_pixels;
+    record.region_count = collect_regions(scratch, run_count, motion_config.min_area);
+    if (record.region_count == 0) {                                         // Only noise below the minimum area
+        metrics_stage_end(METRIC_ENCODE, start);
+        return;
+    }
+    record.rle_count = motion_config.rle ? encode_rle(scratch, run_count, width, height) : 0;
+
+    scratch->record_used = 0;
+    if (motion_config.output_mode == OUTPUT_BINARY) {
+        encode_binary(scratch, &record);
+    } else {
+        encode_json(scratch, &record);
+    }
+    metrics_stage_end(METRIC_ENCODE, start);
+
+    pthread_mutex_lock(&stream->lock);
+    if (stream->used + scratch->record_used > EVENTS_FLUSH_SIZE) {
+        flush_stream(stream);
+    }
+    if (scratch->record_used > EVENTS_FLUSH_SIZE) {                         // Oversized record, write it directly
+        char* buffered = stream->buffer;
+        stream->buffer = scratch->record;
+        stream->used = scratch->record_used;
+        flush_stream(stream);
+        stream->buffer = buffered;
+    } else {
+        memcpy(stream->buffer + stream->used, scratch->record, scratch->record_used);
+        stream->used += scratch->record_used;
+    }
+    stream->frames++;
+    pthread_mutex_unlock(&stream->lock);
+    if (motion_config.verbosity >= VERBOSITY_FRAMES) {
+        printf("Motion event recorded: frame %d (%d pixels, %u regions)\n", index, motion_pixels, record.region_count);
+    }
+}
+
+// Function to flush and close the event stream
+void motion_events_close(EventStream* stream) {
+    if (!stream) {
+        return;
+    }
+    flush_stream(stream);
+    close(stream->fd);
+    if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+        printf("Motion events for %d frames written to %s\n", stream->frames, stream->path);
+    }
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->buffer);
+    free(stream);
+}
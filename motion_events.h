@@ -0,0 +1,44 @@
+#ifndef MOTION_EVENTS_H
+#define MOTION_EVENTS_H
+
+#include <stdint.h>
+
+#define MOTION_EVENTS_JSONL "motion_events.jsonl"  // Event stream file names inside the output directory
+#define MOTION_EVENTS_BINARY "motion_events.bin"
+
+#define MOTION_EVENTS_MAGIC "MEVT"                  // Binary stream starts with the magic and a version
+#define MOTION_EVENTS_VERSION 1
+
+// Binary stream layout (native byte order):
+//   MotionEventsHeader, then per frame with motion a MotionEventRecord
+//   followed by region_count MotionRegion entries and rle_count uint32_t
+//   run lengths (alternating background/motion, starting with background)
+typedef struct {
+    char magic[4];
+    uint32_t version;
+} MotionEventsHeader;
+
+typedef struct {
+    uint32_t frame;
+    uint32_t width;
+    uint32_t height;
+    uint32_t motion_pixels;     // Pixels above the threshold in the whole frame
+    uint32_t region_count;
+    uint32_t rle_count;         // 0 unless run-length masks were requested
+} MotionEventRecord;
+
+typedef struct {
+    uint32_t x;                 // Bounding box of one connected motion region
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t area;              // Motion pixels in the region
+} MotionRegion;
+
+typedef struct EventStream EventStream;
+
+EventStream* motion_events_open(const char* output_path, int append);
+void motion_events_record(EventStream* stream, int index, const unsigned char* mask, int width, int height, int motion_pixels);
+void motion_events_close(EventStream* stream);
+
+#endif
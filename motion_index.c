@@ -0,0 +1,128 @@
+/**************************************************************
+Filename: motion_index.c
+Description:
+  Builds a sidecar index of per-frame motion scores while frames
+  are processed, and answers time-range queries against it. The
+  index is a header followed by fixed-size records, one per frame
+  at a fixed offset, so workers write their records in place and
+  a query maps the file and jumps straight to the requested time
+  range instead of rescanning the motion output.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "motion_index.h"
+
+struct MotionIndex {
+    int fd;
+    double frame_rate;
+    char path[512];
+};
+
+// Function to create (or reopen, when a run continues another one) the index in the output directory
+MotionIndex* motion_index_open(const char* output_path, double frame_rate, int append) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", output_path, MOTION_INDEX_FILE);
+    int fd = open(path, O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open motion index %s\n", path);
+        return NULL;
+    }
+    MotionIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MOTION_INDEX_MAGIC, sizeof(header.magic));
+    header.version = MOTION_INDEX_VERSION;
+    header.record_size = sizeof(MotionIndexRecord);
+    header.frame_rate = frame_rate;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {    // Rewritten on append, the frame rate is the same
+        fprintf(stderr, "Error: Failed to write motion index %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    MotionIndex* index_file = (MotionIndex*)malloc(sizeof(MotionIndex));
+    snprintf(index_file->path, sizeof(index_file->path), "%s", path);
+    index_file->frame_rate = frame_rate;
+    index_file->fd = fd;
+    return index_file;
+}
+
+// Function to store one frame's motion score, safe to call from any thread
+void motion_index_record(MotionIndex* index_file, int index, int motion_pixels, int frame_pixels) {
+    if (!index_file || index < 0) {
+        return;
+    }
+    MotionIndexRecord record;
+    record.timestamp = index / index_file->frame_rate;
+    record.frame = index;
+    record.motion_pixels = motion_pixels;
+    record.score = frame_pixels > 0 ? (float)motion_pixels / frame_pixels : 0.0f;
+    record.flags = MOTION_INDEX_VALID;
+    off_t offset = sizeof(MotionIndexHeader) + (off_t)index * sizeof(MotionIndexRecord);
+    if (pwrite(index_file->fd, &record, sizeof(record), offset) != sizeof(record)) {    // Each record has its own slot, no locking needed
+        fprintf(stderr, "Error: Failed to write frame %d to motion index %s\n", index, index_file->path);
+    }
+}
+
+// Function to close the index
+void motion_index_close(MotionIndex* index_file) {
+    if (index_file) {
+        close(index_file->fd);
+        free(index_file);
+    }
+}
+
+// Function to report frames between start_time and end_time (seconds, end < 0 = to the end) with a score above min_score
+// Returns the number of matching frames, or -1 if the index cannot be read
+int motion_index_query(const char* index_path, double start_time, double end_time, double min_score,
+                       MotionIndexCallback callback, void* arg) {
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open motion index %s\n", index_path);
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(MotionIndexHeader)) {
+        fprintf(stderr, "Error: %s is not a motion index.\n", index_path);
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);                  // Records are read in place
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map motion index %s\n", index_path);
+        return -1;
+    }
+    const MotionIndexHeader* header = (const MotionIndexHeader*)map;
+    if (memcmp(header->magic, MOTION_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MOTION_INDEX_VERSION || header->record_size != sizeof(MotionIndexRecord) ||
+        header->frame_rate <= 0.0) {
+        fprintf(stderr, "Error: %s is not a compatible motion index.\n", index_path);
+        munmap(map, info.st_size);
+        return -1;
+    }
+    const MotionIndexRecord* records = (const MotionIndexRecord*)((const char*)map + sizeof(MotionIndexHeader));
+    long count = (info.st_size - sizeof(MotionIndexHeader)) / sizeof(MotionIndexRecord);
+
+    long first = start_time > 0.0 ? (long)ceil(start_time * header->frame_rate) : 0;      // Fixed slots turn a time into a record position
+    long last = count - 1;
+    if (end_time >= 0.0 && (long)floor(end_time * header->frame_rate) < last) {
+        last = (long)floor(end_time * header->frame_rate);
+    }
+    int matches = 0;
+    for (long i = first; i <= last; ++i) {                                                  // Only the requested range is touched
+        if ((records[i].flags & MOTION_INDEX_VALID) && records[i].score > min_score) {
+            callback(&records[i], arg);
+            matches++;
+        }
+    }
+    munmap(map, info.st_size);
+    return matches;
+}
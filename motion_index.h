@@ -0,0 +1,42 @@
+#ifndef MOTION_INDEX_H
+#define MOTION_INDEX_H
+
+#include <stdint.h>
+
+#define MOTION_INDEX_FILE "motion_index.idx"    // Sidecar index file name inside the output directory
+
+#define MOTION_INDEX_MAGIC "MIDX"
+#define MOTION_INDEX_VERSION 1
+
+#define MOTION_INDEX_VALID 1                    // Record flag: the frame was compared with its predecessor
+
+// File layout (native byte order): MotionIndexHeader followed by one
+// MotionIndexRecord per frame, record i at a fixed offset for frame i.
+// Frames that were never compared are zero-filled holes.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;       // sizeof(MotionIndexRecord), checked when the file is mapped
+    uint32_t reserved;
+    double frame_rate;          // Frames per second used for the timestamps
+} MotionIndexHeader;
+
+typedef struct {
+    double timestamp;           // Seconds from the first frame
+    uint32_t frame;
+    uint32_t motion_pixels;
+    float score;                // Fraction of the frame that moved, 0 to 1
+    uint32_t flags;
+} MotionIndexRecord;
+
+typedef void (*MotionIndexCallback)(const MotionIndexRecord* record, void* arg);
+
+typedef struct MotionIndex MotionIndex;
+
+MotionIndex* motion_index_open(const char* output_path, double frame_rate, int append);
+void motion_index_record(MotionIndex* index_file, int index, int motion_pixels, int frame_pixels);
+void motion_index_close(MotionIndex* index_file);
+int motion_index_query(const char* index_path, double start_time, double end_time, double min_score,
+                       MotionIndexCallback callback, void* arg);
+
+#endif
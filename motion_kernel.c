@@ -0,0 +1,653 @@
+/**************************************************************
+Filename: motion_kernel.c
+Description:
+  Fused motion detection kernels. One pass reads two frames and
+  writes the binary motion mask, doing fixed-point luma, absolute
+  difference and threshold per pixel with no intermediate
+  buffers. SSE2, AVX2 and AVX-512 versions are picked at runtime
+  from the CPU features; the scalar version is the reference and
+  every vector version produces the same bytes.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "motion_kernel.h"
+#include "metrics.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MOTION_KERNEL_X86 1
+#endif
+
+#define BOX_STRIP_WIDTH 256     // Columns the SIMD box filter sums per pass over a band
+
+// Fixed-point luma weights with 8 fractional bits (0.299, 0.587, 0.114)
+#define LUMA_R 77
+#define LUMA_G 150
+#define LUMA_B 29
+
+typedef struct {
+    void (*luma)(const unsigned char*, unsigned char*, int, int, int);
+    int (*mask_gray)(const unsigned char*, const unsigned char*, unsigned char*, int, unsigned char);
+    int (*mask_rgb)(const unsigned char*, const unsigned char*, unsigned char*, int, int, int, unsigned char);
+    void (*scan_row)(const unsigned char*, const unsigned char*, int, unsigned char, unsigned char*);  // NULL = masking is as cheap as scanning
+    void (*box8)(const unsigned char*, int, int, unsigned char*);
+} KernelTable;
+
+enum {
+    SCAN_QUIET,                 // No pixel of the tile passed the threshold so far
+    SCAN_CHANGED,               // Some pixel did, the tile gets a full mask
+    SCAN_SKIPPED                // Outside the region of interest
+};
+
+// Weighted luma of one interleaved pixel, w0 and w2 are the weights of the outer channels
+static inline int luma_pixel(const unsigned char* p, int w0, int w2) {
+    return (w0 * p[0] + LUMA_G * p[1] + w2 * p[2] + 128) >> 8;
+}
+
+static void luma_scalar(const unsigned char* pixels, unsigned char* gray, int count, int w0, int w2) {
+    for (int i = 0; i < count; i++) {
+        gray[i] = (unsigned char)luma_pixel(pixels + 3 * i, w0, w2);
+    }
+}
+
+static int mask_gray_scalar(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, unsigned char threshold) {
+    int motion = 0;
+    for (int i = 0; i < count; i++) {
+        int moved = abs(prev[i] - cur[i]) > threshold;     // Difference and threshold in one step
+        mask[i] = moved ? 255 : 0;
+        motion += moved;
+    }
+    return motion;
+}
+
+static int mask_rgb_scalar(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, int w0, int w2, unsigned char threshold) {
+    int motion = 0;
+    for (int i = 0; i < count; i++) {
+        int moved = abs(luma_pixel(prev + 3 * i, w0, w2) - luma_pixel(cur + 3 * i, w0, w2)) > threshold;
+        mask[i] = moved ? 255 : 0;
+        motion += moved;
+    }
+    return motion;
+}
+
+// Mark the quiet tiles that have a pixel over the threshold in this row; tiles already decided are not read
+static void scan_row_scalar(const unsigned char* prev, const unsigned char* cur, int width, unsigned char threshold, unsigned char* status) {
+    for (int t = 0, x0 = 0; x0 < width; t++, x0 += MOTION_TILE_WIDTH) {
+        int x1 = (x0 + MOTION_TILE_WIDTH < width) ? x0 + MOTION_TILE_WIDTH : width;
+        for (int x = x0; status[t] == SCAN_QUIET && x < x1; x++) {
+            if (abs(prev[x] - cur[x]) > threshold) {
+                status[t] = SCAN_CHANGED;
+            }
+        }
+    }
+}
+
+// Rounded average of one PYRAMID_FACTOR x PYRAMID_FACTOR cell, smaller on the right and bottom edges
+static inline unsigned char cell_average(const unsigned char* gray, int width, int height, int cx, int cy) {
+    int x0 = cx * PYRAMID_FACTOR, y0 = cy * PYRAMID_FACTOR;
+    int x1 = (x0 + PYRAMID_FACTOR < width) ? x0 + PYRAMID_FACTOR : width;
+    int y1 = (y0 + PYRAMID_FACTOR < height) ? y0 + PYRAMID_FACTOR : height;
+    int sum = 0;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            sum += gray[(size_t)y * width + x];
+        }
+    }
+    int count = (x1 - x0) * (y1 - y0);
+    return (unsigned char)((sum + count / 2) / count);
+}
+
+static void box8_scalar(const unsigned char* gray, int width, int height, unsigned char* coarse) {
+    int coarse_width = (width + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR;
+    int coarse_height = (height + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR;
+    for (int cy = 0; cy < coarse_height; cy++) {
+        for (int cx = 0; cx < coarse_width; cx++) {
+            coarse[cy * coarse_width + cx] = cell_average(gray, width, height, cx, cy);
+        }
+    }
+}
+
+static const KernelTable scalar_table = { luma_scalar, mask_gray_scalar, mask_rgb_scalar, scan_row_scalar, box8_scalar };
+
+#ifdef MOTION_KERNEL_X86
+
+// Split 16 interleaved 3-channel pixels into one register per channel (SSE2 has no byte shuffle)
+static inline void deinterleave_sse2(const unsigned char* p, __m128i* c0, __m128i* c1, __m128i* c2) {
+    __m128i t00 = _mm_loadu_si128((const __m128i*)p);
+    __m128i t01 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i t02 = _mm_loadu_si128((const __m128i*)(p + 32));
+
+    __m128i t10 = _mm_unpacklo_epi8(t00, _mm_unpackhi_epi64(t01, t01));
+    __m128i t11 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t00, t00), t02);
+    __m128i t12 = _mm_unpacklo_epi8(t01, _mm_unpackhi_epi64(t02, t02));
+
+    __m128i t20 = _mm_unpacklo_epi8(t10, _mm_unpackhi_epi64(t11, t11));
+    __m128i t21 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t10, t10), t12);
+    __m128i t22 = _mm_unpacklo_epi8(t11, _mm_unpackhi_epi64(t12, t12));
+
+    __m128i t30 = _mm_unpacklo_epi8(t20, _mm_unpackhi_epi64(t21, t21));
+    __m128i t31 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t20, t20), t22);
+    __m128i t32 = _mm_unpacklo_epi8(t21, _mm_unpackhi_epi64(t22, t22));
+
+    *c0 = _mm_unpacklo_epi8(t30, _mm_unpackhi_epi64(t31, t31));
+    *c1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t30, t30), t32);
+    *c2 = _mm_unpacklo_epi8(t31, _mm_unpackhi_epi64(t32, t32));
+}
+
+// Weighted sum of 8 widened pixels, result is luma in the low byte of each 16-bit lane
+static inline __m128i luma8_sse2(__m128i c0, __m128i c1, __m128i c2, __m128i w0, __m128i w1, __m128i w2) {
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(c0, w0), _mm_mullo_epi16(c1, w1));
+    sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_mullo_epi16(c2, w2), _mm_set1_epi16(128)));
+    return _mm_srli_epi16(sum, 8);
+}
+
+static inline __m128i luma16_sse2(const unsigned char* p, __m128i w0, __m128i w1, __m128i w2) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i c0, c1, c2;
+    deinterleave_sse2(p, &c0, &c1, &c2);
+    __m128i lo = luma8_sse2(_mm_unpacklo_epi8(c0, zero), _mm_unpacklo_epi8(c1, zero), _mm_unpacklo_epi8(c2, zero), w0, w1, w2);
+    __m128i hi = luma8_sse2(_mm_unpackhi_epi8(c0, zero), _mm_unpackhi_epi8(c1, zero), _mm_unpackhi_epi8(c2, zero), w0, w1, w2);
+    return _mm_packus_epi16(lo, hi);
+}
+
+// 0xFF where |a - b| > threshold, 0 elsewhere
+static inline __m128i threshold_sse2(__m128i a, __m128i b, __m128i threshold) {
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+    __m128i below = _mm_cmpeq_epi8(_mm_subs_epu8(diff, threshold), _mm_setzero_si128());
+    return _mm_andnot_si128(below, _mm_set1_epi8(-1));
+}
+
+static void luma_sse2(const unsigned char* pixels, unsigned char* gray, int count, int w0, int w2) {
+    const __m128i v0 = _mm_set1_epi16(w0), v1 = _mm_set1_epi16(LUMA_G), v2 = _mm_set1_epi16(w2);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128((__m128i*)(gray + i), luma16_sse2(pixels + 3 * i, v0, v1, v2));
+    }
+    luma_scalar(pixels + 3 * i, gray + i, count - i, w0, w2);           // Remaining pixels
+}
+
+static int mask_gray_sse2(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, unsigned char threshold) {
+    const __m128i thr = _mm_set1_epi8((char)threshold);
+    int motion = 0;
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(prev + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(cur + i));
+        __m128i m = threshold_sse2(a, b, thr);
+        _mm_storeu_si128((__m128i*)(mask + i), m);
+        motion += __builtin_popcount(_mm_movemask_epi8(m));
+    }
+    return motion + mask_gray_scalar(prev + i, cur + i, mask + i, count - i, threshold);
+}
+
+static int mask_rgb_sse2(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, int w0, int w2, unsigned char threshold) {
+    const __m128i v0 = _mm_set1_epi16(w0), v1 = _mm_set1_epi16(LUMA_G), v2 = _mm_set1_epi16(w2);
+    const __m128i thr = _mm_set1_epi8((char)threshold);
+    int motion = 0;
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = luma16_sse2(prev + 3 * i, v0, v1, v2);
+        __m128i b = luma16_sse2(cur + 3 * i, v0, v1, v2);
+        __m128i m = threshold_sse2(a, b, thr);
+        _mm_storeu_si128((__m128i*)(mask + i), m);
+        motion += __builtin_popcount(_mm_movemask_epi8(m));
+    }
+    return motion + mask_rgb_scalar(prev + 3 * i, cur + 3 * i, mask + i, count - i, w0, w2, threshold);
+}
+
+static void scan_row_sse2(const unsigned char* prev, const unsigned char* cur, int width, unsigned char threshold, unsigned char* status) {
+    const __m128i thr = _mm_set1_epi8((char)threshold);
+    for (int t = 0, x0 = 0; x0 < width; t++, x0 += MOTION_TILE_WIDTH) {
+        if (status[t] != SCAN_QUIET) {
+            continue;
+        }
+        int x1 = (x0 + MOTION_TILE_WIDTH < width) ? x0 + MOTION_TILE_WIDTH : width;
+        __m128i over = _mm_setzero_si128();                                // Non-zero bytes where a pixel passed the threshold
+        int x = x0;
+        for (; x + 16 <= x1; x += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(prev + x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(cur + x));
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+            over = _mm_or_si128(over, _mm_subs_epu8(diff, thr));
+        }
+        int changed = _mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128())) != 0xFFFF;
+        for (; !changed && x < x1; x++) {                                   // Narrow last tile
+            changed = abs(prev[x] - cur[x]) > threshold;
+        }
+        if (changed) {
+            status[t] = SCAN_CHANGED;
+        }
+    }
+}
+
+// Sum each row of a band with SAD against zero, 16 columns (two cells) per register, reading rows front to back
+static void box8_sse2(const unsigned char* gray, int width, int height, unsigned char* coarse) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi64x(32);
+    int coarse_width = (width + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR;
+    int coarse_height = (height + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR;
+    int full_width = width / BOX_STRIP_WIDTH * BOX_STRIP_WIDTH;
+    __m128i sums[BOX_STRIP_WIDTH / 16];
+    for (int cy = 0; cy < coarse_height; cy++) {
+        unsigned char* out = coarse + cy * coarse_width;
+        int cx = 0;
+        if ((cy + 1) * PYRAMID_FACTOR <= height) {                          // Bottom cells may be short, they take the scalar path
+            const unsigned char* band = gray + (size_t)cy * PYRAMID_FACTOR * width;
+            for (int x0 = 0; x0 < full_width; x0 += BOX_STRIP_WIDTH) {     // Strips keep the sums in L1 for any width
+                for (int j = 0; j < BOX_STRIP_WIDTH / 16; j++) {
+                    sums[j] = round;
+                }
+                for (int r = 0; r < PYRAMID_FACTOR; r++) {
+                    const unsigned char* row = band + (size_t)r * width + x0;
+                    for (int j = 0; j < BOX_STRIP_WIDTH / 16; j++) {
+                        sums[j] = _mm_add_epi64(sums[j], _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(row + j * 16)), zero));
+                    }
+                }
+                for (int j = 0; j < BOX_STRIP_WIDTH / 16; j++) {
+                    __m128i average = _mm_srli_epi64(sums[j], 6);
+                    out[x0 / PYRAMID_FACTOR + 2 * j] = (unsigned char)_mm_cvtsi128_si32(average);
+                    out[x0 / PYRAMID_FACTOR + 2 * j + 1] = (unsigned char)_mm_cvtsi128_si32(_mm_srli_si128(average, 8));
+                }
+            }
+            cx = full_width / PYRAMID_FACTOR;
+        }
+        for (; cx < coarse_width; cx++) {
+            out[cx] = cell_average(gray, width, height, cx, cy);
+        }
+    }
+}
+
+static const KernelTable sse2_table = { luma_sse2, mask_gray_sse2, mask_rgb_sse2, scan_row_sse2, box8_sse2 };
+
+// Split 16 interleaved 3-channel pixels with byte shuffles
+__attribute__((target("ssse3")))
+static inline void deinterleave_ssse3(const unsigned char* p, __m128i* c0, __m128i* c1, __m128i* c2) {
+    __m128i a = _mm_loadu_si128((const __m128i*)p);
+    __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(p + 32));
+    *c0 = _mm_or_si128(_mm_or_si128(
+              _mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+              _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+              _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    *c1 = _mm_or_si128(_mm_or_si128(
+              _mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+              _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+              _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    *c2 = _mm_or_si128(_mm_or_si128(
+              _mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+              _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+              _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// Luma of 16 pixels as 16-bit lanes
+__attribute__((target("avx2")))
+static inline __m256i luma16_avx2(const unsigned char* p, __m256i w0, __m256i w1, __m256i w2) {
+    __m128i c0, c1, c2;
+    deinterleave_ssse3(p, &c0, &c1, &c2);
+    __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(c0), w0),
+                                   _mm256_mullo_epi16(_mm256_cvtepu8_epi16(c1), w1));
+    sum = _mm256_add_epi16(sum, _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(c2), w2), _mm256_set1_epi16(128)));
+    return _mm256_srli_epi16(sum, 8);
+}
+
+// Narrow 16 lanes of 16 bits back to bytes, keeping their order (0/-1 masks stay 0x00/0xFF)
+__attribute__((target("avx2")))
+static inline __m128i pack16_avx2(__m256i v) {
+    return _mm_packs_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+// Narrow 16 lanes of unsigned 8-bit values to bytes
+__attribute__((target("avx2")))
+static inline __m128i pack16u_avx2(__m256i v) {
+    return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static void luma_avx2(const unsigned char* pixels, unsigned char* gray, int count, int w0, int w2) {
+    const __m256i v0 = _mm256_set1_epi16(w0), v1 = _mm256_set1_epi16(LUMA_G), v2 = _mm256_set1_epi16(w2);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128((__m128i*)(gray + i), pack16u_avx2(luma16_avx2(pixels + 3 * i, v0, v1, v2)));
+    }
+    luma_scalar(pixels + 3 * i, gray + i, count - i, w0, w2);
+}
+
+__attribute__((target("avx2")))
+static int mask_gray_avx2(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, unsigned char threshold) {
+    const __m256i thr = _mm256_set1_epi8((char)threshold);
+    const __m256i zero = _mm256_setzero_si256();
+    int motion = 0;
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(prev + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(cur + i));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+        __m256i below = _mm256_cmpeq_epi8(_mm256_subs_epu8(diff, thr), zero);
+        __m256i m = _mm256_andnot_si256(below, _mm256_set1_epi8(-1));
+        _mm256_storeu_si256((__m256i*)(mask + i), m);
+        motion += __builtin_popcount((unsigned int)_mm256_movemask_epi8(m));
+    }
+    return motion + mask_gray_sse2(prev + i, cur + i, mask + i, count - i, threshold);
+}
+
+__attribute__((target("avx2")))
+static int mask_rgb_avx2(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, int w0, int w2, unsigned char threshold) {
+    const __m256i v0 = _mm256_set1_epi16(w0), v1 = _mm256_set1_epi16(LUMA_G), v2 = _mm256_set1_epi16(w2);
+    const __m256i thr = _mm256_set1_epi16(threshold);
+    int motion = 0;
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = luma16_avx2(prev + 3 * i, v0, v1, v2);
+        __m256i b = luma16_avx2(cur + 3 * i, v0, v1, v2);
+        __m256i diff = _mm256_sub_epi16(_mm256_max_epu16(a, b), _mm256_min_epu16(a, b));
+        __m128i m = pack16_avx2(_mm256_cmpgt_epi16(diff, thr));                // Lanes are 0 or -1, packing keeps 0x00/0xFF
+        _mm_storeu_si128((__m128i*)(mask + i), m);
+        motion += __builtin_popcount(_mm_movemask_epi8(m));
+    }
+    return motion + mask_rgb_scalar(prev + 3 * i, cur + 3 * i, mask + i, count - i, w0, w2, threshold);
+}
+
+static const KernelTable avx2_table = { luma_avx2, mask_gray_avx2, mask_rgb_avx2, NULL, box8_sse2 };
+
+// Luma of 32 pixels as 16-bit lanes
+__attribute__((target("avx512bw,avx512vl")))
+static inline __m512i luma32_avx512(const unsigned char* p, __m512i w0, __m512i w1, __m512i w2) {
+    __m128i a0, a1, a2, b0, b1, b2;
+    deinterleave_ssse3(p, &a0, &a1, &a2);
+    deinterleave_ssse3(p + 48, &b0, &b1, &b2);
+    __m512i sum = _mm512_add_epi16(_mm512_mullo_epi16(_mm512_cvtepu8_epi16(_mm256_set_m128i(b0, a0)), w0),
+                                   _mm512_mullo_epi16(_mm512_cvtepu8_epi16(_mm256_set_m128i(b1, a1)), w1));
+    sum = _mm512_add_epi16(sum, _mm512_add_epi16(_mm512_mullo_epi16(_mm512_cvtepu8_epi16(_mm256_set_m128i(b2, a2)), w2),
+                                                 _mm512_set1_epi16(128)));
+    return _mm512_srli_epi16(sum, 8);
+}
+
+__attribute__((target("avx512bw,avx512vl")))
+static void luma_avx512(const unsigned char* pixels, unsigned char* gray, int count, int w0, int w2) {
+    const __m512i v0 = _mm512_set1_epi16(w0), v1 = _mm512_set1_epi16(LUMA_G), v2 = _mm512_set1_epi16(w2);
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        _mm256_storeu_si256((__m256i*)(gray + i), _mm512_cvtepi16_epi8(luma32_avx512(pixels + 3 * i, v0, v1, v2)));
+    }
+    luma_avx2(pixels + 3 * i, gray + i, count - i, w0, w2);
+}
+
+__attribute__((target("avx512bw,avx512vl")))
+static int mask_gray_avx512(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, unsigned char threshold) {
+    const __m512i thr = _mm512_set1_epi8((char)threshold);
+    int motion = 0;
+    for (int i = 0; i < count; i += 64) {
+        __mmask64 lanes = (count - i >= 64) ? ~0ULL : ((1ULL << (count - i)) - 1);  // Masked loads handle the tail
+        __m512i a = _mm512_maskz_loadu_epi8(lanes, prev + i);
+        __m512i b = _mm512_maskz_loadu_epi8(lanes, cur + i);
+        __m512i diff = _mm512_or_si512(_mm512_subs_epu8(a, b), _mm512_subs_epu8(b, a));
+        __mmask64 moved = _mm512_mask_cmpgt_epu8_mask(lanes, diff, thr);
+        _mm512_mask_storeu_epi8(mask + i, lanes, _mm512_movm_epi8(moved));
+        motion += __builtin_popcountll(moved);
+    }
+    return motion;
+}
+
+__attribute__((target("avx512bw,avx512vl")))
+static int mask_rgb_avx512(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, int w0, int w2, unsigned char threshold) {
+    const __m512i v0 = _mm512_set1_epi16(w0), v1 = _mm512_set1_epi16(LUMA_G), v2 = _mm512_set1_epi16(w2);
+    const __m512i thr = _mm512_set1_epi16(threshold);
+    int motion = 0;
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i a = luma32_avx512(prev + 3 * i, v0, v1, v2);
+        __m512i b = luma32_avx512(cur + 3 * i, v0, v1, v2);
+        __m512i diff = _mm512_sub_epi16(_mm512_max_epu16(a, b), _mm512_min_epu16(a, b));
+        __mmask32 moved = _mm512_cmpgt_epu16_mask(diff, thr);
+        _mm256_storeu_si256((__m256i*)(mask + i), _mm256_movm_epi8(moved));
+        motion += __builtin_popcount(moved);
+    }
+    return motion + mask_rgb_avx2(prev + 3 * i, cur + 3 * i, mask + i, count - i, w0, w2, threshold);
+}
+
+static const KernelTable avx512_table = { luma_avx512, mask_gray_avx512, mask_rgb_avx512, NULL, box8_sse2 };
+
+#endif
+
+static const KernelTable* active_table = &scalar_table;
+static MotionIsa active_isa = MOTION_ISA_SCALAR;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+// Function to check whether the CPU (and OS) can run a kernel set
+static int isa_supported(MotionIsa isa) {
+#ifdef MOTION_KERNEL_X86
+    __builtin_cpu_init();
+    switch (isa) {
+        case MOTION_ISA_SCALAR: return 1;
+        case MOTION_ISA_SSE2:   return __builtin_cpu_supports("sse2");
+        case MOTION_ISA_AVX2:   return __builtin_cpu_supports("avx2");
+        case MOTION_ISA_AVX512: return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+    }
+    return 0;
+#else
+    return isa == MOTION_ISA_SCALAR;
+#endif
+}
+
+static const KernelTable* isa_table(MotionIsa isa) {
+#ifdef MOTION_KERNEL_X86
+    switch (isa) {
+        case MOTION_ISA_SSE2:   return &sse2_table;
+        case MOTION_ISA_AVX2:   return &avx2_table;
+        case MOTION_ISA_AVX512: return &avx512_table;
+        default:                break;
+    }
+#endif
+    return &scalar_table;
+}
+
+// Function to pick the widest kernel set the CPU supports
+static void select_best_isa() {
+    for (int isa = MOTION_ISA_AVX512; isa > MOTION_ISA_SCALAR; isa--) {
+        if (isa_supported((MotionIsa)isa)) {
+            active_isa = (MotionIsa)isa;
+            active_table = isa_table(active_isa);
+            return;
+        }
+    }
+}
+
+static const KernelTable* kernels() {
+    pthread_once(&select_once, select_best_isa);
+    return active_table;
+}
+
+// Function to convert interleaved RGB or BGR pixels to 8-bit luma
+void luma_convert(const unsigned char* pixels, unsigned char* gray, int count, PixelOrder order) {
+    int w0 = (order == PIXEL_RGB) ? LUMA_R : LUMA_B;
+    int w2 = (order == PIXEL_RGB) ? LUMA_B : LUMA_R;
+    uint64_t start = metrics_now();
+    kernels()->luma(pixels, gray, count, w0, w2);
+    metrics_stage_end(METRIC_CONVERT, start);
+}
+
+// Function to write the motion mask of two grayscale frames, returns the number of motion pixels
+int motion_mask_gray(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, unsigned char threshold) {
+    uint64_t start = metrics_now();
+    int motion_pixels = kernels()->mask_gray(prev, cur, mask, count, threshold);
+    metrics_stage_end(METRIC_DETECT, start);
+    return motion_pixels;
+}
+
+// Function to write the motion mask of two grayscale frames tile by tile, returns the number of motion pixels
+// tiles holds a TileState per tile (NULL = all watched) and region marks watched pixels with non-zero bytes for partial tiles.
+// Ignored tiles are never read. Where the kernels have a scan, each band of tiles is first scanned row by row, dropping
+// a tile from the scan as soon as one of its pixels passes the threshold; only those tiles are masked and the quiet ones
+// are cleared. The AVX2 and AVX-512 masks are limited by memory reads, so a scan would only add a second pass there.
+// The result is identical to motion_mask_gray inside the region.
+static int mask_tiles(const KernelTable* k, const unsigned char* prev, const unsigned char* cur, unsigned char* mask,
+                      int width, int height, const unsigned char* tiles, const unsigned char* region, unsigned char threshold) {
+    if (!tiles && !k->scan_row) {                                       // Nothing to skip
+        return k->mask_gray(prev, cur, mask, width * height, threshold);
+    }
+    int tiles_x = (width + MOTION_TILE_WIDTH - 1) / MOTION_TILE_WIDTH;
+    unsigned char* status = (unsigned char*)malloc(tiles_x);
+    int motion = 0;
+    for (int y0 = 0; y0 < height; y0 += MOTION_TILE_HEIGHT) {
+        int y1 = (y0 + MOTION_TILE_HEIGHT < height) ? y0 + MOTION_TILE_HEIGHT : height;
+        const unsigned char* states = tiles ? tiles + (y0 / MOTION_TILE_HEIGHT) * tiles_x : NULL;
+        int quiet = 0;
+        for (int tx = 0; tx < tiles_x; tx++) {
+            if (states && states[tx] == TILE_IGNORED) {
+                status[tx] = SCAN_SKIPPED;
+            } else {
+                status[tx] = k->scan_row ? SCAN_QUIET : SCAN_CHANGED;   // Without a scan every watched tile is masked
+                quiet += status[tx] == SCAN_QUIET;
+            }
+        }
+        for (int y = y0; y < y1 && quiet > 0; y++) {                   // Stops once every tile is decided
+            size_t row = (size_t)y * width;
+            k->scan_row(prev + row, cur + row, width, threshold, status);
+            quiet = 0;
+            for (int tx = 0; tx < tiles_x; tx++) {
+                quiet += status[tx] == SCAN_QUIET;
+            }
+        }
+        for (int y = y0; y < y1; y++) {                                 // Neighbouring tiles of the same kind are one run per row
+            size_t row = (size_t)y * width;
+            for (int tx = 0; tx < tiles_x; ) {
+                int changed = status[tx] == SCAN_CHANGED;
+                int end = tx + 1;
+                while (end < tiles_x && (status[end] == SCAN_CHANGED) == changed) {
+                    end++;
+                }
+                int x0 = tx * MOTION_TILE_WIDTH;
+                int x1 = (end * MOTION_TILE_WIDTH < width) ? end * MOTION_TILE_WIDTH : width;
+                if (changed) {
+                    motion += k->mask_gray(prev + row + x0, cur + row + x0, mask + row + x0, x1 - x0, threshold);
+                } else {
+                    memset(mask + row + x0, 0, x1 - x0);
+                }
+                tx = end;
+            }
+        }
+        for (int tx = 0; states && region && tx < tiles_x; tx++) {     // Clip the changed tiles on the edge of the region
+            if (status[tx] != SCAN_CHANGED || states[tx] != TILE_PARTIAL) {
+                continue;
+            }
+            int x0 = tx * MOTION_TILE_WIDTH;
+            int x1 = (x0 + MOTION_TILE_WIDTH < width) ? x0 + MOTION_TILE_WIDTH : width;
+            for (int y = y0; y < y1; y++) {
+                unsigned char* m = mask + (size_t)y * width;
+                const unsigned char* r = region + (size_t)y * width;
+                int x = x0;
+                for (; x + 8 <= x1; x += 8) {                           // Eight 0/255 bytes at a time
+                    uint64_t moved, watched;
+                    memcpy(&moved, m + x, 8);
+                    memcpy(&watched, r + x, 8);
+                    motion -= __builtin_popcountll(moved & ~watched) / 8;
+                    moved &= watched;
+                    memcpy(m + x, &moved, 8);
+                }
+                for (; x < x1; x++) {
+                    motion -= (m[x] & ~r[x]) >> 7;
+                    m[x] &= r[x];
+                }
+            }
+        }
+    }
+    free(status);
+    return motion;
+}
+
+int motion_mask_tiled(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int width, int height,
+                      const unsigned char* tiles, const unsigned char* region, unsigned char threshold) {
+    uint64_t start = metrics_now();
+    int motion_pixels = mask_tiles(kernels(), prev, cur, mask, width, height, tiles, region, threshold);
+    metrics_stage_end(METRIC_DETECT, start);
+    return motion_pixels;
+}
+
+// Function to average a grayscale frame over PYRAMID_FACTOR x PYRAMID_FACTOR cells, the coarse level of the pyramid
+void luma_box8(const unsigned char* gray, int width, int height, unsigned char* coarse) {
+    uint64_t start = metrics_now();
+    kernels()->box8(gray, width, height, coarse);
+    metrics_stage_end(METRIC_CONVERT, start);
+}
+
+// Function to average up to PYRAMID_FACTOR rows into one row of the coarse level, untimed for use inside decoding
+void luma_box8_band(const unsigned char* band, int width, int rows, unsigned char* coarse_row) {
+    kernels()->box8(band, width, rows, coarse_row);
+}
+
+// Function to write the motion mask of two grayscale frames coarse to fine, returns the number of motion pixels
+// Cells whose averages differ by more than coarse_threshold flag the tiles under them and their neighbours; only those
+// tiles get the full-resolution pass. Motion too small or too faint to move a cell average is missed.
+int motion_mask_pyramid(const unsigned char* prev, const unsigned char* cur, const unsigned char* prev_coarse,
+                        const unsigned char* cur_coarse, unsigned char* mask, int width, int height, const unsigned char* tiles,
+                        const unsigned char* region, unsigned char threshold, unsigned char coarse_threshold) {
+    uint64_t start = metrics_now();
+    int coarse_width = (width + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR;
+    int coarse_height = (height + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR;
+    int tiles_x = (width + MOTION_TILE_WIDTH - 1) / MOTION_TILE_WIDTH;
+    int tiles_y = (height + MOTION_TILE_HEIGHT - 1) / MOTION_TILE_HEIGHT;
+    unsigned char* active = (unsigned char*)calloc((size_t)tiles_x * tiles_y, 1);  // TILE_IGNORED until a cell flags it
+    for (int cy = 0; cy < coarse_height; cy++) {
+        for (int cx = 0; cx < coarse_width; cx++) {
+            int i = cy * coarse_width + cx;
+            if (abs(prev_coarse[i] - cur_coarse[i]) <= coarse_threshold) {
+                continue;
+            }
+            int x0 = (cx > 0) ? (cx - 1) * PYRAMID_FACTOR : 0;           // The cell grown by one cell on every side
+            int y0 = (cy > 0) ? (cy - 1) * PYRAMID_FACTOR : 0;
+            int x1 = ((cx + 2) * PYRAMID_FACTOR < width) ? (cx + 2) * PYRAMID_FACTOR : width;
+            int y1 = ((cy + 2) * PYRAMID_FACTOR < height) ? (cy + 2) * PYRAMID_FACTOR : height;
+            for (int ty = y0 / MOTION_TILE_HEIGHT; ty <= (y1 - 1) / MOTION_TILE_HEIGHT; ty++) {
+                for (int tx = x0 / MOTION_TILE_WIDTH; tx <= (x1 - 1) / MOTION_TILE_WIDTH; tx++) {
+                    int t = ty * tiles_x + tx;
+                    active[t] = tiles ? tiles[t] : TILE_WATCHED;             // The region of interest still applies
+                }
+            }
+        }
+    }
+    int motion_pixels = mask_tiles(kernels(), prev, cur, mask, width, height, active, region, threshold);
+    free(active);
+    metrics_stage_end(METRIC_DETECT, start);
+    return motion_pixels;
+}
+
+// Function to write the motion mask of two RGB or BGR frames, returns the number of motion pixels
+int motion_mask_rgb(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, PixelOrder order, unsigned char threshold) {
+    int w0 = (order == PIXEL_RGB) ? LUMA_R : LUMA_B;
+    int w2 = (order == PIXEL_RGB) ? LUMA_B : LUMA_R;
+    uint64_t start = metrics_now();
+    int motion_pixels = kernels()->mask_rgb(prev, cur, mask, count, w0, w2, threshold);
+    metrics_stage_end(METRIC_DETECT, start);
+    return motion_pixels;
+}
+
+// Function to get the kernel set currently in use
+MotionIsa motion_kernel_isa() {
+    kernels();
+    return active_isa;
+}
+
+// Function to force a kernel set (e.g. the scalar reference), returns 0 if the CPU lacks it
+int motion_kernel_set_isa(MotionIsa isa) {
+    kernels();                                          // Run detection first so it cannot override this choice
+    if (!isa_supported(isa)) {
+        return 0;
+    }
+    active_isa = isa;
+    active_table = isa_table(isa);
+    return 1;
+}
+
+const char* motion_isa_name(MotionIsa isa) {
+    switch (isa) {
+        case MOTION_ISA_SCALAR: return "scalar";
+        case MOTION_ISA_SSE2:   return "sse2";
+        case MOTION_ISA_AVX2:   return "avx2";
+        case MOTION_ISA_AVX512: return "avx512";
+    }
+    return "unknown";
+}
@@ -0,0 +1,40 @@
+#ifndef MOTION_KERNEL_H
+#define MOTION_KERNEL_H
+
+typedef enum {
+    PIXEL_RGB,                  // Interleaved R, G, B (libjpeg output)
+    PIXEL_BGR                   // Interleaved B, G, R (OpenCV output)
+} PixelOrder;
+
+#define MOTION_TILE_WIDTH 64     // Tiles that are ignored or unchanged are skipped as a whole
+#define MOTION_TILE_HEIGHT 16
+#define PYRAMID_FACTOR 8         // The coarse level averages 8x8 pixel cells
+
+typedef enum {
+    TILE_IGNORED,               // Outside the region of interest, never compared
+    TILE_WATCHED,               // Entirely inside the region of interest
+    TILE_PARTIAL                // On the edge of the region, clipped pixel by pixel
+} TileState;
+
+typedef enum {
+    MOTION_ISA_SCALAR,          // Portable reference implementation
+    MOTION_ISA_SSE2,
+    MOTION_ISA_AVX2,
+    MOTION_ISA_AVX512
+} MotionIsa;
+
+void luma_convert(const unsigned char* pixels, unsigned char* gray, int count, PixelOrder order);
+int motion_mask_gray(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, unsigned char threshold);
+int motion_mask_tiled(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int width, int height,
+                      const unsigned char* tiles, const unsigned char* region, unsigned char threshold);
+void luma_box8(const unsigned char* gray, int width, int height, unsigned char* coarse);
+void luma_box8_band(const unsigned char* band, int width, int rows, unsigned char* coarse_row);
+int motion_mask_pyramid(const unsigned char* prev, const unsigned char* cur, const unsigned char* prev_coarse,
+                        const unsigned char* cur_coarse, unsigned char* mask, int width, int height, const unsigned char* tiles,
+                        const unsigned char* region, unsigned char threshold, unsigned char coarse_threshold);
+int motion_mask_rgb(const unsigned char* prev, const unsigned char* cur, unsigned char* mask, int count, PixelOrder order, unsigned char threshold);
+MotionIsa motion_kernel_isa();
+int motion_kernel_set_isa(MotionIsa isa);
+const char* motion_isa_name(MotionIsa isa);
+
+#endif
@@ -0,0 +1,393 @@
+/**************************************************************
+Filename: motion_manifest.c
+Description:
+  Resume manifest for incremental runs. Every saved result is
+  recorded with a hash of the two input frames it was computed
+  from, and the manifest as a whole with a hash of the detection
+  and output settings. A rerun over the same output directory
+  hashes its inputs, reusing the hashes of files whose size and
+  modification time did not change, and keeps every result whose
+  inputs and settings still match. Only new, changed and
+  unfinished frames are processed again.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "motion_manifest.h"
+#include "motion_config.h"
+#include "handle_motion.h"
+#include "image_utils.h"
+#include "frame_pack.h"
+#include "thread_pool.h"
+#include "roi_mask.h"
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+struct MotionManifest {
+    char path[512];
+    int fd;                     // -1 until the run starts
+    MotionManifestHeader header;
+    int frame_count;
+    uint64_t* frame_hashes;     // Content hash of every input frame, 0 = missing
+    int64_t* frame_sizes;
+    int64_t* frame_mtimes;
+    unsigned char* reused;      // 1 where the earlier result is still valid and is kept
+    int reused_count;
+};
+
+typedef struct {
+    MotionManifest* manifest;
+    const char* input_path;
+    const MotionManifestRecord* old;    // Records of the earlier run, NULL = none
+    int old_count;
+    const FramePack* pack;              // NULL = frame directory
+    int64_t pack_mtime;
+    int first;
+    int last;                           // Exclusive
+} HashTask;
+
+// Function to mix one 8-byte word into a hash lane
+static inline uint64_t hash_round(uint64_t lane, uint64_t word) {
+    lane += word * HASH_PRIME2;
+    lane = (lane << 31) | (lane >> 33);
+    return lane * HASH_PRIME1;
+}
+
+// Function to hash a block of bytes, xxHash64 style: four independent lanes keep several multiplies in flight
+// Never returns 0, which marks a missing frame
+static uint64_t hash_bytes(const void* data, size_t size, uint64_t seed) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t lanes[4] = { seed + HASH_PRIME1 + HASH_PRIME2, seed + HASH_PRIME2, seed, seed - HASH_PRIME1 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, bytes + i + 8 * lane, sizeof(word));
+            lanes[lane] = hash_round(lanes[lane], word);
+        }
+    }
+    uint64_t hash = size * HASH_PRIME3;
+    for (int lane = 0; lane < 4; ++lane) {
+        hash = (hash ^ hash_round(0, lanes[lane])) * HASH_PRIME1 + HASH_PRIME3;
+    }
+    for (; i < size; i += 8) {                                                  // Tail words, the last one zero-padded
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, size - i < 8 ? size - i : 8);
+        hash ^= hash_round(0, word);
+        hash = ((hash << 27) | (hash >> 37)) * HASH_PRIME1 + HASH_PRIME3;
+    }
+    hash ^= hash >> 33;                                                         // Spread every input bit over the result
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash ? hash : 1;
+}
+
+// Function to hash the contents of a file into a reusable buffer, returns 0 if it cannot be read
+static uint64_t hash_file(const char* path, uint64_t seed, unsigned char** buffer, size_t* capacity) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)info.st_size;
+    if (size > *capacity) {
+        free(*buffer);
+        *buffer = (unsigned char*)malloc(size);
+        *capacity = size;
+    }
+    size_t got = 0;
+    while (got < size) {
+        ssize_t count = read(fd, *buffer + got, size - got);
+        if (count <= 0) {
+            close(fd);
+            return 0;
+        }
+        got += (size_t)count;
+    }
+    close(fd);
+    return hash_bytes(*buffer, size, seed);
+}
+
+// Function to hash the inputs of one result, the previous and the current frame
+static uint64_t pair_hash(uint64_t prev, uint64_t cur) {
+    uint64_t pair[2] = { prev, cur };
+    return hash_bytes(pair, sizeof(pair), HASH_PRIME3);
+}
+
+// Function to hash every setting that changes a saved result, including the contents of the output's region of interest
+static uint64_t settings_hash(const char* output_path) {
+    int64_t settings[] = {
+        MOTION_MANIFEST_VERSION, motion_config.threshold, motion_config.decode_scale, motion_config.detect_mode,
+        pyramid_active(), pyramid_active() ? coarse_cell_threshold() : 0, motion_config.output_mode,
+        motion_config.mask_format, motion_config.jpeg_quality, motion_config.fast_dct, motion_config.min_area, motion_config.rle,
+        motion_config.write_index
+    };
+    uint64_t hash = hash_bytes(settings, sizeof(settings), 0);
+    char mask_path[512];
+    int ignore;
+    if (roi_mask_source(output_path, mask_path, sizeof(mask_path), &ignore)) {
+        unsigned char* buffer = NULL;
+        size_t capacity = 0;
+        hash = hash_file(mask_path, hash + ignore, &buffer, &capacity);                 // An unreadable mask fails the run later anyway
+        free(buffer);
+    }
+    return hash;
+}
+
+// Task to hash a run of input frames, a frame whose size and modification time are unchanged keeps its recorded hash
+static void hash_frames_task(void* arg) {
+    HashTask* task = (HashTask*)arg;
+    MotionManifest* manifest = task->manifest;
+    unsigned char* buffer = NULL;
+    size_t capacity = 0;
+    for (int i = task->first; i < task->last; ++i) {
+        const unsigned char* data = NULL;
+        char frame_path[256];
+        int64_t size;
+        int64_t mtime;
+        if (task->pack) {
+            uint32_t frame_size;
+            if (!(data = frame_pack_frame(task->pack, i, &frame_size, NULL))) {
+                continue;                                                               // Missing, the hash stays 0
+            }
+            size = frame_size;
+            mtime = task->pack_mtime;
+        } else {
+            struct stat info;
+            snprintf(frame_path, sizeof(frame_path), "%s/frame_%d.jpg", task->input_path, i);
+            if (stat(frame_path, &info) != 0) {
+                continue;
+            }
+            size = info.st_size;
+            mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+        }
+        manifest->frame_sizes[i] = size;
+        manifest->frame_mtimes[i] = mtime;
+        const MotionManifestRecord* old = (i < task->old_count) ? &task->old[i] : NULL;
+        if (old && (old->flags & MOTION_MANIFEST_RESULT) && old->frame_size == size && old->frame_mtime == mtime) {
+            manifest->frame_hashes[i] = old->frame_hash;
+        } else if (data) {
+            manifest->frame_hashes[i] = hash_bytes(data, (size_t)size, 0);
+        } else {
+            manifest->frame_hashes[i] = hash_file(frame_path, 0, &buffer, &capacity);
+        }
+    }
+    free(buffer);
+}
+
+// Function to hash every input frame on the shared thread pool
+static void hash_frames(MotionManifest* manifest, const char* input_path, const MotionManifestRecord* old, int old_count) {
+    const FramePack* pack = frame_pack_find(input_path);
+    struct stat info;
+    int64_t pack_mtime = (pack && stat(input_path, &info) == 0) ? (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec : 0;
+    int num_tasks = (manifest->frame_count + MANIFEST_FRAMES_PER_TASK - 1) / MANIFEST_FRAMES_PER_TASK;
+    HashTask* tasks = (HashTask*)malloc(num_tasks * sizeof(HashTask));
+    for (int i = 0; i < num_tasks; ++i) {
+        tasks[i].manifest = manifest;
+        tasks[i].input_path = input_path;
+        tasks[i].old = old;
+        tasks[i].old_count = old_count;
+        tasks[i].pack = pack;
+        tasks[i].pack_mtime = pack_mtime;
+        tasks[i].first = i * MANIFEST_FRAMES_PER_TASK;
+        tasks[i].last = (i == num_tasks - 1) ? manifest->frame_count : tasks[i].first + MANIFEST_FRAMES_PER_TASK;
+    }
+    ThreadPool* pool = shared_thread_pool();
+    TaskGroup group;
+    task_group_init(&group);
+    thread_pool_submit_range(pool, &group, hash_frames_task, tasks, sizeof(HashTask), num_tasks);
+    thread_pool_wait(pool, &group);
+    task_group_destroy(&group);
+    free(tasks);
+}
+
+// Function to check that the saved result of a frame is still on disk
+static int result_exists(const char* output_path, int index) {
+    if (motion_config.output_mode != OUTPUT_JPEG) {                                     // Events live in the stream, checked as a whole
+        return 1;
+    }
+    char mask_path[512];
+    struct stat info;
+    snprintf(mask_path, sizeof(mask_path), "%s/motion_frame_%d.%s", output_path, index, mask_file_extension(motion_config.mask_format));
+    return stat(mask_path, &info) == 0;
+}
+
+// Function to read the manifest of an earlier run into the output directory and find the results that are still valid
+// Nothing is written until motion_manifest_start, so a run that fails to open its outputs leaves the old manifest alone
+MotionManifest* motion_manifest_load(const char* input_path, const char* output_path, int total_frames) {
+    MotionManifest* manifest = (MotionManifest*)calloc(1, sizeof(MotionManifest));
+    snprintf(manifest->path, sizeof(manifest->path), "%s/%s", output_path, MOTION_MANIFEST_FILE);
+    manifest->fd = -1;
+    manifest->frame_count = total_frames;
+    memcpy(manifest->header.magic, MOTION_MANIFEST_MAGIC, sizeof(manifest->header.magic));
+    manifest->header.version = MOTION_MANIFEST_VERSION;
+    manifest->header.record_size = sizeof(MotionManifestRecord);
+    manifest->header.settings_hash = settings_hash(output_path);
+    manifest->header.frame_count = total_frames;
+    manifest->frame_hashes = (uint64_t*)calloc(total_frames, sizeof(uint64_t));
+    manifest->frame_sizes = (int64_t*)calloc(total_frames, sizeof(int64_t));
+    manifest->frame_mtimes = (int64_t*)calloc(total_frames, sizeof(int64_t));
+    manifest->reused = (unsigned char*)calloc(total_frames, 1);
+
+    MotionManifestHeader header;
+    memset(&header, 0, sizeof(header));
+    MotionManifestRecord* old = NULL;
+    int old_count = 0;
+    int fd = open(manifest->path, O_RDONLY);
+    if (fd >= 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, MOTION_MANIFEST_MAGIC, sizeof(header.magic)) == 0 && header.version == MOTION_MANIFEST_VERSION &&
+        header.record_size == sizeof(MotionManifestRecord) && header.settings_hash == manifest->header.settings_hash &&
+        header.frame_count <= (uint32_t)total_frames) {                                 // Frames were removed, start over
+        old = (MotionManifestRecord*)calloc(header.frame_count, sizeof(MotionManifestRecord));
+        ssize_t got = pread(fd, old, header.frame_count * sizeof(MotionManifestRecord), sizeof(header));
+        old_count = got > 0 ? (int)(got / sizeof(MotionManifestRecord)) : 0;            // Records past the last one written were never saved
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    hash_frames(manifest, input_path, old, old_count);
+
+    int stale = 0;                                                                      // Results recorded from inputs that have changed since
+    for (int i = 1; i < old_count; ++i) {
+        if (!(old[i].flags & MOTION_MANIFEST_RESULT)) {
+            continue;
+        }
+        uint64_t prev = manifest->frame_hashes[i - 1];
+        uint64_t cur = manifest->frame_hashes[i];
+        if (prev && cur && old[i].input_hash == pair_hash(prev, cur) && result_exists(output_path, i)) {
+            manifest->reused[i] = 1;
+            manifest->reused_count++;
+        } else {
+            stale++;
+        }
+    }
+    free(old);
+    int stream_valid = (motion_config.output_mode == OUTPUT_JPEG) ||
+                       (old_count > 0 && stale == 0 && (header.flags & MOTION_MANIFEST_COMPLETE));    // Events can only be added to a finished stream
+    if (!stream_valid || motion_config.video_path) {                                    // The video is encoded from masks in memory
+        memset(manifest->reused, 0, total_frames);
+        manifest->reused_count = 0;
+    }
+    return manifest;
+}
+
+// Function to start recording a run: the manifest is kept when results are reused, otherwise it is started over
+int motion_manifest_start(MotionManifest* manifest) {
+    manifest->fd = open(manifest->path, O_RDWR | O_CREAT | (manifest->reused_count > 0 ? 0 : O_TRUNC), 0644);
+    if (manifest->fd < 0) {
+        fprintf(stderr, "Error: Cannot open resume manifest %s\n", manifest->path);
+        return -1;
+    }
+    manifest->header.flags = 0;                                                         // Marked complete when the run finishes
+    if (pwrite(manifest->fd, &manifest->header, sizeof(manifest->header), 0) != sizeof(manifest->header)) {
+        fprintf(stderr, "Error: Failed to write resume manifest %s\n", manifest->path);
+        close(manifest->fd);
+        manifest->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to get the number of earlier results kept by this run
+int motion_manifest_reused_frames(const MotionManifest* manifest) {
+    return manifest ? manifest->reused_count : 0;
+}
+
+// Function to tell whether the earlier result of a frame is kept
+int motion_manifest_reused(const MotionManifest* manifest, int index) {
+    return manifest && index >= 0 && index < manifest->frame_count && manifest->reused[index];
+}
+
+// Function to remove the frames with kept results from a list of ranges, returns the number of ranges left in a list the caller frees
+int motion_manifest_pending(const MotionManifest* manifest, const FrameRange* ranges, int num_ranges, FrameRange** pending) {
+    int capacity = num_ranges + 1;
+    FrameRange* list = (FrameRange*)malloc(capacity * sizeof(FrameRange));
+    int count = 0;
+    for (int r = 0; r < num_ranges; ++r) {
+        for (int i = ranges[r].first; i <= ranges[r].last; ++i) {
+            if (i < 1 || motion_manifest_reused(manifest, i)) {                         // Frame 0 only matters as the reference of frame 1
+                continue;
+            }
+            if (count > 0 && list[count - 1].last == i - 1) {
+                list[count - 1].last = i;
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                list = (FrameRange*)realloc(list, capacity * sizeof(FrameRange));
+            }
+            list[count].first = i;
+            list[count].last = i;
+            count++;
+        }
+    }
+    if (count == 0) {
+        free(list);
+        list = NULL;
+    }
+    *pending = list;
+    return count;
+}
+
+// Function to record a saved result with the hashes of its inputs, safe to call from any thread
+void motion_manifest_record(MotionManifest* manifest, int index, int motion_pixels) {
+    if (!manifest || manifest->fd < 0 || index < 1 || index >= manifest->frame_count) {
+        return;
+    }
+    uint64_t prev = manifest->frame_hashes[index - 1];
+    uint64_t cur = manifest->frame_hashes[index];
+    if (!prev || !cur) {                                                                // An input appeared after hashing, redo it next time
+        return;
+    }
+    MotionManifestRecord record;
+    record.input_hash = pair_hash(prev, cur);
+    record.frame_hash = cur;
+    record.frame_size = manifest->frame_sizes[index];
+    record.frame_mtime = manifest->frame_mtimes[index];
+    record.motion_pixels = motion_pixels;
+    record.flags = MOTION_MANIFEST_RESULT;
+    off_t offset = sizeof(MotionManifestHeader) + (off_t)index * sizeof(MotionManifestRecord);
+    if (pwrite(manifest->fd, &record, sizeof(record), offset) != sizeof(record)) {     // Each record has its own slot, no locking needed
+        fprintf(stderr, "Error: Failed to write frame %d to resume manifest %s\n", index, manifest->path);
+    }
+}
+
+// Function to mark the run complete and close the manifest
+void motion_manifest_close(MotionManifest* manifest) {
+    if (!manifest) {
+        return;
+    }
+    if (manifest->fd >= 0) {
+        manifest->header.flags = MOTION_MANIFEST_COMPLETE;
+        if (pwrite(manifest->fd, &manifest->header, sizeof(manifest->header), 0) != sizeof(manifest->header)) {
+            fprintf(stderr, "Error: Failed to write resume manifest %s\n", manifest->path);
+        }
+        close(manifest->fd);
+    }
+    free(manifest->frame_hashes);
+    free(manifest->frame_sizes);
+    free(manifest->frame_mtimes);
+    free(manifest->reused);
+    free(manifest);
+}
+
+// Function to delete the manifest of an output directory whose results are about to be replaced
+void motion_manifest_remove(const char* output_path) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", output_path, MOTION_MANIFEST_FILE);
+    unlink(path);
+}
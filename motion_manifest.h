@@ -0,0 +1,44 @@
+#ifndef MOTION_MANIFEST_H
+#define MOTION_MANIFEST_H
+
+#include <stdint.h>
+#include "frame_sampling.h"
+
+#define MOTION_MANIFEST_FILE "motion_manifest.bin"  // Resume manifest file name inside the output directory
+#define MOTION_MANIFEST_MAGIC "MMAN"
+#define MOTION_MANIFEST_VERSION 1
+#define MOTION_MANIFEST_COMPLETE 1                  // Header flag: the run that wrote the manifest finished
+#define MOTION_MANIFEST_RESULT 1                    // Record flag: the frame's result was saved from the inputs in input_hash
+#define MANIFEST_FRAMES_PER_TASK 64                 // Input frames hashed by one pool task
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;       // sizeof(MotionManifestRecord), checked when the file is read
+    uint32_t flags;
+    uint64_t settings_hash;     // Detection and output settings the results were computed with
+    uint32_t frame_count;       // Input frames of the run that wrote the manifest
+    uint32_t reserved;
+} MotionManifestHeader;
+
+typedef struct {
+    uint64_t input_hash;        // Contents of the previous and the current frame the result was computed from
+    uint64_t frame_hash;        // Contents of the current frame
+    int64_t frame_size;         // Size and modification time (ns) when frame_hash was taken, so unchanged files are not read again
+    int64_t frame_mtime;
+    uint32_t motion_pixels;
+    uint32_t flags;
+} MotionManifestRecord;
+
+typedef struct MotionManifest MotionManifest;
+
+MotionManifest* motion_manifest_load(const char* input_path, const char* output_path, int total_frames);
+int motion_manifest_start(MotionManifest* manifest);
+int motion_manifest_reused_frames(const MotionManifest* manifest);
+int motion_manifest_reused(const MotionManifest* manifest, int index);
+int motion_manifest_pending(const MotionManifest* manifest, const FrameRange* ranges, int num_ranges, FrameRange** pending);
+void motion_manifest_record(MotionManifest* manifest, int index, int motion_pixels);
+void motion_manifest_close(MotionManifest* manifest);
+void motion_manifest_remove(const char* output_path);
+
+#endif
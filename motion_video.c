@@ -0,0 +1,206 @@
+/**************************************************************
+Filename: motion_video.c
+Description:
+  Feeds motion masks straight into an in-process video encoder
+  as detection completes, instead of saving JPEGs and running
+  ffmpeg over them afterwards. Masks finish out of order on the
+  worker threads, so each one is parked run-length encoded in a
+  reorder window until every earlier frame has been written.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "motion_video.h"
+#include "motion_config.h"
+#include "network_protocol.h"
+#include "frame_pool.h"
+#include "metrics.h"
+
+typedef struct {
+    int index;                  // Frame held by this slot, -1 if empty
+    int width;
+    int height;
+    int32_t encoding;           // MaskEncoding of data
+    int32_t count;
+    unsigned char* data;        // Mask as produced by encode_mask
+    uint32_t size;
+} PendingMask;
+
+struct MotionVideo {
+    pthread_mutex_t lock;
+    char path[512];
+    double frame_rate;
+    void* encoder;              // Opened with the first frame, whose size it takes by default
+    int failed;                 // The encoder could not be opened or written, drop the rest
+    int next_frame;             // Next frame the video needs
+    int draining;               // A thread is writing frames, others only park theirs
+    PendingMask* slots;         // Ring indexed by frame number, covers next_frame onwards
+    int capacity;               // Power of two
+    int pending;                // Frames parked in the ring
+    int written;
+};
+
+// Function to start a video for the current run; masks are expected from first_frame onwards
+MotionVideo* motion_video_open(const char* path, double frame_rate, int first_frame) {
+    MotionVideo* video = (MotionVideo*)malloc(sizeof(MotionVideo));
+    pthread_mutex_init(&video->lock, NULL);
+    snprintf(video->path, sizeof(video->path), "%s", path);
+    video->frame_rate = frame_rate;
+    video->encoder = NULL;
+    video->failed = 0;
+    video->next_frame = first_frame;
+    video->draining = 0;
+    video->capacity = 64;
+    video->slots = (PendingMask*)malloc(video->capacity * sizeof(PendingMask));
+    for (int i = 0; i < video->capacity; ++i) {
+        video->slots[i].index = -1;
+    }
+    video->pending = 0;
+    video->written = 0;
+    return video;
+}
+
+// Function to make room in the ring for a frame far ahead of next_frame
+static void grow_window(MotionVideo* video, int index) {
+    int capacity = video->capacity;
+    while (index - video->next_frame >= capacity) {
+        capacity *= 2;
+    }
+    PendingMask* slots = (PendingMask*)malloc(capacity * sizeof(PendingMask));
+    for (int i = 0; i < capacity; ++i) {
+        slots[i].index = -1;
+    }
+    for (int i = 0; i < video->capacity; ++i) {                            // Everything parked lies in [next_frame, next_frame + old capacity)
+        if (video->slots[i].index >= 0) {
+            slots[video->slots[i].index & (capacity - 1)] = video->slots[i];
+        }
+    }
+    free(video->slots);
+    video->slots = slots;
+    video->capacity = capacity;
+}
+
+// Function to encode one parked mask into the video, called by one thread at a time
+static void write_frame(MotionVideo* video, PendingMask* frame) {
+    if (video->failed) {
+        return;
+    }
+    if (!video->encoder) {                                                  // Size the video from the first mask unless one was requested
+        int width = motion_config.video_width > 0 ? motion_config.video_width : frame->width;
+        int height = motion_config.video_height > 0 ? motion_config.video_height : frame->height;
+        video->encoder = video_encoder_open(video->path, video->frame_rate, width, height);
+        if (!video->encoder) {
+            fprintf(stderr, "Error: Cannot create video %s\n", video->path);
+            video->failed = 1;
+            return;
+        }
+    }
+    uint64_t start = metrics_now();
+    int count = frame->width * frame->height;
+    unsigned char* mask = frame_buffer_acquire(count);
+    if (decode_mask(frame->data, frame->size, frame->encoding, frame->count, mask, count) == 0 &&
+        video_encoder_write(video->encoder, mask, frame->width, frame->height) == 0) {
+        video->written++;
+    } else {
+        fprintf(stderr, "Error: Failed to add frame %d to video %s\n", frame->index, video->path);
+    }
+    frame_buffer_release(mask);
+    metrics_stage_end(METRIC_ENCODE, start);
+}
+
+// Function to park a frame in the window and, unless another thread is already draining, write every frame that is now in order
+static void park_frame(MotionVideo* video, PendingMask* frame) {
+    int index = frame->index;
+    pthread_mutex_lock(&video->lock);
+    if (index < video->next_frame || video->slots[index & (video->capacity - 1)].index == index) {
+        fprintf(stderr, "Error: Frame %d reached the video out of sequence. Leaving it out.\n", index);
+        pthread_mutex_unlock(&video->lock);
+        free(frame->data);
+        return;
+    }
+    if (index - video->next_frame >= video->capacity) {
+        grow_window(video, index);
+    }
+    video->slots[index & (video->capacity - 1)] = *frame;
+    video->pending++;
+    if (video->draining) {                                                  // The draining thread will pick it up
+        pthread_mutex_unlock(&video->lock);
+        return;
+    }
+    video->draining = 1;
+    PendingMask* slot;
+    while ((slot = &video->slots[video->next_frame & (video->capacity - 1)])->index == video->next_frame) {
+        PendingMask next = *slot;
+        slot->index = -1;
+        video->next_frame++;
+        video->pending--;
+        pthread_mutex_unlock(&video->lock);                                 // Encode without blocking the detection threads
+        if (next.data) {
+            write_frame(video, &next);
+            free(next.data);
+        }
+        pthread_mutex_lock(&video->lock);
+    }
+    video->draining = 0;
+    pthread_mutex_unlock(&video->lock);
+}
+
+// Function to hand a finished mask to the video, safe to call from any thread
+// The frame is written as soon as every earlier frame has been, otherwise it waits in the window
+void motion_video_submit(MotionVideo* video, int index, const unsigned char* mask, int width, int height) {
+    if (!video) {
+        return;
+    }
+    PendingMask frame;
+    frame.index = index;
+    frame.width = width;
+    frame.height = height;
+    frame.data = encode_mask(mask, width * height, &frame.encoding, &frame.count, &frame.size);   // Masks are mostly runs, parking them is cheap
+    park_frame(video, &frame);
+}
+
+// Function to mark a frame that will never produce a mask, so later frames do not wait for it
+void motion_video_skip(MotionVideo* video, int index) {
+    if (!video) {
+        return;
+    }
+    PendingMask frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.index = index;
+    frame.data = NULL;                                                      // Placeholder, nothing is encoded
+    park_frame(video, &frame);
+}
+
+// Function to write any frames still waiting behind a gap, then finish the video
+void motion_video_close(MotionVideo* video) {
+    if (!video) {
+        return;
+    }
+    pthread_mutex_lock(&video->lock);
+    while (video->pending > 0) {                                            // Frames that never arrived are skipped
+        PendingMask* slot = &video->slots[video->next_frame & (video->capacity - 1)];
+        if (slot->index == video->next_frame) {
+            if (slot->data) {
+                write_frame(video, slot);
+            }
+            free(slot->data);
+            slot->index = -1;
+            video->pending--;
+        }
+        video->next_frame++;
+    }
+    if (video->encoder) {
+        video_encoder_close(video->encoder);
+        if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+            printf("Motion video saved: %s (%d frames)\n", video->path, video->written);
+        }
+    }
+    pthread_mutex_unlock(&video->lock);
+    pthread_mutex_destroy(&video->lock);
+    free(video->slots);
+    free(video);
+}
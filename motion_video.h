@@ -0,0 +1,19 @@
+#ifndef MOTION_VIDEO_H
+#define MOTION_VIDEO_H
+
+#define VIDEO_CODEC_COUNT 3
+#define VIDEO_CODECS { "avc1", "H264", "mp4v" }     // Tried in order: H.264 under both tags, then MPEG-4 Part 2 if no H.264 encoder is built in
+
+// In-process encoder, implemented with OpenCV in video_encoder.cpp
+void* video_encoder_open(const char* path, double frame_rate, int width, int height);
+int video_encoder_write(void* encoder, const unsigned char* gray, int width, int height);
+void video_encoder_close(void* encoder);
+
+typedef struct MotionVideo MotionVideo;
+
+MotionVideo* motion_video_open(const char* path, double frame_rate, int first_frame);
+void motion_video_submit(MotionVideo* video, int index, const unsigned char* mask, int width, int height);
+void motion_video_skip(MotionVideo* video, int index);
+void motion_video_close(MotionVideo* video);
+
+#endif
@@ -0,0 +1,156 @@
+/**************************************************************
+Filename: network_protocol.c
+Description:
+  Length-prefixed binary messages exchanged between the server
+  and remote workers. Frames travel as the original JPEG file
+  bytes and masks come back run-length encoded. The blocking
+  helpers are used by workers; the server frames messages with
+  encode_header/decode_header on non-blocking sockets.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "network_protocol.h"
+
+// Function to send a whole buffer, without raising SIGPIPE if the peer is gone
+int send_all(int socket, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    while (size > 0) {
+        ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+// Function to receive exactly size bytes
+int recv_all(int socket, void* data, size_t size) {
+    unsigned char* bytes = (unsigned char*)data;
+    while (size > 0) {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if (received <= 0) {                                    // Connection closed or failed
+            return -1;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return 0;
+}
+
+// Function to write a message header
+void encode_header(uint32_t type, uint32_t length, unsigned char* out) {
+    uint32_t header[2] = { htonl(type), htonl(length) };
+    memcpy(out, header, PROTOCOL_HEADER_SIZE);
+}
+
+// Function to read a message header, rejecting payloads over the protocol limit
+int decode_header(const unsigned char* data, uint32_t* type, uint32_t* length) {
+    uint32_t header[2];
+    memcpy(header, data, PROTOCOL_HEADER_SIZE);
+    *type = ntohl(header[0]);
+    *length = ntohl(header[1]);
+    if (*length > PROTOCOL_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: Message of %u bytes exceeds the protocol limit.\n", *length);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send one message with its payload
+int send_message(int socket, uint32_t type, const void* payload, uint32_t length) {
+    unsigned char header[PROTOCOL_HEADER_SIZE];
+    encode_header(type, length, header);
+    if (send_all(socket, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    return length > 0 ? send_all(socket, payload, length) : 0;
+}
+
+// Function to read the next message header
+int recv_message_header(int socket, uint32_t* type, uint32_t* length) {
+    unsigned char header[PROTOCOL_HEADER_SIZE];
+    if (recv_all(socket, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    return decode_header(header, type, length);
+}
+
+// Function to write 32-bit integers in network byte order
+void encode_ints(const int32_t* values, int count, unsigned char* out) {
+    for (int i = 0; i < count; ++i) {
+        uint32_t value = htonl((uint32_t)values[i]);
+        memcpy(out + 4 * i, &value, 4);
+    }
+}
+
+// Function to read 32-bit integers in network byte order
+void decode_ints(const unsigned char* data, int count, int32_t* values) {
+    for (int i = 0; i < count; ++i) {
+        uint32_t value;
+        memcpy(&value, data + 4 * i, 4);
+        values[i] = (int32_t)ntohl(value);
+    }
+}
+
+// Function to encode a 0/255 mask as run lengths, or raw bytes when the runs would not be smaller
+// Returns a malloc'd buffer of size bytes
+unsigned char* encode_mask(const unsigned char* mask, int count, int32_t* encoding, int32_t* encoded_count, uint32_t* size) {
+    unsigned char* out = (unsigned char*)malloc(count > 4 ? count : 4);
+    int runs = 0;
+    int position = 0;
+    int moving = 0;                                             // Runs alternate, starting with background
+    while (position < count) {
+        int start = position;
+        while (position < count && (mask[position] != 0) == moving) {
+            position++;
+        }
+        if ((runs + 1) * 4 > count) {                           // Noisy mask, raw is smaller
+            memcpy(out, mask, count);
+            *encoding = MASK_ENCODING_RAW;
+            *encoded_count = count;
+            *size = count;
+            return out;
+        }
+        int32_t length = position - start;
+        encode_ints(&length, 1, out + 4 * runs++);
+        moving = !moving;
+    }
+    *encoding = MASK_ENCODING_RLE;
+    *encoded_count = runs;
+    *size = runs * 4;
+    return out;
+}
+
+// Function to rebuild a mask from encode_mask output (0 on success, -1 if the data is inconsistent)
+int decode_mask(const unsigned char* data, uint32_t size, int32_t encoding, int32_t encoded_count, unsigned char* mask, int count) {
+    if (encoding == MASK_ENCODING_RAW) {
+        if (encoded_count != count || size != (uint32_t)count) {
+            return -1;
+        }
+        memcpy(mask, data, count);
+        return 0;
+    }
+    if (encoding != MASK_ENCODING_RLE || encoded_count < 0 || size != (uint32_t)encoded_count * 4) {
+        return -1;
+    }
+    int position = 0;
+    for (int i = 0; i < encoded_count; ++i) {
+        int32_t length;
+        decode_ints(data + 4 * i, 1, &length);
+        if (length < 0 || length > count - position) {
+            return -1;
+        }
+        memset(mask + position, (i & 1) ? 255 : 0, length);
+        position += length;
+    }
+    return position == count ? 0 : -1;
+}
@@ -0,0 +1,60 @@
+#ifndef NETWORK_PROTOCOL_H
+#define NETWORK_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTOCOL_MAX_PAYLOAD (256u << 20)  // Larger messages are treated as a broken stream
+#define PROTOCOL_HEADER_SIZE 8
+
+// Every message is an 8-byte header (type, payload length, both
+// big-endian) followed by the payload. Integer fields inside payloads
+// are 32-bit big-endian as well.
+typedef enum {
+    MSG_CHUNK = 1,              // Server -> worker: ChunkMessage, followed by one MSG_FRAME per frame
+    MSG_FRAME,                  // Server -> worker: frame index, then the JPEG file bytes or raw luma plane (none if missing)
+    MSG_MASK,                   // Worker -> server: MaskMessage, then the encoded mask
+    MSG_CHUNK_DONE,             // Worker -> server: every mask of the chunk has been sent
+    MSG_DONE                    // Server -> worker: no chunks left
+} MessageType;
+
+typedef enum {
+    MASK_ENCODING_RLE,          // Alternating background/motion run lengths, starting with background
+    MASK_ENCODING_RAW           // One byte per pixel, used when runs would be larger
+} MaskEncoding;
+
+typedef struct {
+    int32_t first_frame;        // First frame sent, start_frame - 1 when a reference frame is included
+    int32_t start_frame;
+    int32_t end_frame;          // Inclusive
+    int32_t threshold;          // Detection settings, so every worker matches the server
+    int32_t decode_scale;
+    int32_t detect_mode;
+    int32_t learning_shift;
+    int32_t pyramid;
+    int32_t coarse_threshold;
+    int32_t frame_width;        // Frames are raw luma planes of this size from a frame pack, 0 = JPEG files
+    int32_t frame_height;
+} ChunkMessage;
+
+typedef struct {
+    int32_t index;
+    int32_t width;
+    int32_t height;
+    int32_t motion_pixels;
+    int32_t encoding;           // MaskEncoding
+    int32_t count;              // Run lengths or bytes that follow
+} MaskMessage;
+
+int send_all(int socket, const void* data, size_t size);
+int recv_all(int socket, void* data, size_t size);
+void encode_header(uint32_t type, uint32_t length, unsigned char* out);
+int decode_header(const unsigned char* data, uint32_t* type, uint32_t* length);
+int send_message(int socket, uint32_t type, const void* payload, uint32_t length);
+int recv_message_header(int socket, uint32_t* type, uint32_t* length);
+void encode_ints(const int32_t* values, int count, unsigned char* out);
+void decode_ints(const unsigned char* data, int count, int32_t* values);
+unsigned char* encode_mask(const unsigned char* mask, int count, int32_t* encoding, int32_t* encoded_count, uint32_t* size);
+int decode_mask(const unsigned char* data, uint32_t size, int32_t encoding, int32_t encoded_count, unsigned char* mask, int count);
+
+#endif
@@ -1,9 +1,15 @@
 /**************************************************************
-Filename: network_utils.c 
+Filename: network_utils.c
 Description:
-  Implements client-server communication for motion detection 
-  using TCP sockets, with the server assigning tasks and the 
-  client processing them.
+  Implements client-server communication for motion detection
+  using TCP sockets. The server splits the frames into small
+  chunks on a shared queue and hands them out on demand to any
+  number of connected clients and to its own local worker, and
+  requeues the chunk of a client that disconnects or stalls. A
+  single epoll event loop on non-blocking sockets serves every
+  client, so one small coordinator can drive many workers. Clients get
+  the frame JPEGs over the connection and send masks back, so
+  they need no access to the server's files.
 Author: Cade Andrae
 Date: 12/11/24
 **************************************************************/
@@ -12,21 +18,550 @@ Date: 12/11/24
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include "network_utils.h"
+#include "network_protocol.h"
 #include "handle_motion.h"
+#include "motion_config.h"
+#include "motion_kernel.h"
+#include "image_utils.h"
+#include "frame_pool.h"
+#include "thread_pool.h"
+#include "frame_pack.h"
+#include "frame_sampling.h"
 #include "main.h"
 
-#define PORT 8080
-#define BUFFER_SIZE 1024
+typedef enum {
+    CHUNK_PENDING,              // Waiting in the queue
+    CHUNK_ASSIGNED,             // Being processed by the local worker or a client
+    CHUNK_DONE
+} ChunkState;
+
+typedef struct {
+    int start_frame;
+    int end_frame;              // Inclusive
+    ChunkState state;
+} FrameChunk;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Signalled when a chunk is requeued or finished
+    FrameChunk* chunks;
+    int num_chunks;
+    int first_pending;          // No pending chunk before this index
+    int remaining;              // Chunks not done yet
+    int wake_fd;                // eventfd that wakes the event loop when a chunk finishes
+    const char* input_path;
+    const char* output_path;
+    FramePack* pack;            // Input frame pack, NULL for a frame directory
+} ChunkScheduler;
+
+typedef struct {
+    MaskMessage header;
+    unsigned char* payload;     // Whole MSG_MASK payload, owns data
+    const unsigned char* data;  // Encoded mask
+    uint32_t size;
+} MaskResult;
+
+// State of one client connection, driven by the event loop
+typedef struct {
+    int socket;                 // -1 once dropped, freed at the end of the loop iteration
+    char name[64];              // Client address, for log messages
+    int chunk;                  // Chunk being worked on, -1 when idle
+    int closing;                // Told the run is over, closed once the output is flushed
+    int writing;                // EPOLLOUT is registered
+    double last_activity;       // Last time bytes moved, for timeouts
+
+    unsigned char out[PROTOCOL_HEADER_SIZE + sizeof(ChunkMessage)];   // Message header being sent
+    size_t out_length;
+    size_t out_sent;
+    int next_frame;             // Frames of the chunk still to queue
+    int last_frame;
+    int file;                   // Frame file (or frame pack) being sent with sendfile, -1 if none
+    off_t file_offset;
+    off_t file_end;             // Where the frame ends in the file
+
+    unsigned char header[PROTOCOL_HEADER_SIZE];  // Message being received
+    size_t header_received;
+    uint32_t type;
+    uint32_t length;
+    unsigned char* payload;
+    size_t payload_received;
+    MaskResult* results;        // Masks of the current chunk
+    int result_count;
+    int result_capacity;
+} Connection;
+
+typedef struct {
+    ChunkScheduler* scheduler;
+    int chunk;
+    char name[64];
+    MaskResult* results;
+    int count;
+} ChunkSave;
+
+typedef struct {
+    int epoll_fd;
+    ChunkScheduler* scheduler;
+    Connection** connections;
+    int num_connections;
+    int capacity;
+    ThreadPool* pool;
+    TaskGroup saves;            // Chunks being written
+} EventLoop;
+
+static char listener_event, wake_event;     // epoll tags for the non-connection descriptors
+
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function to take the next pending chunk without waiting (-1 if none is pending)
+static int take_pending_chunk(ChunkScheduler* scheduler) {
+    while (scheduler->first_pending < scheduler->num_chunks &&
+           scheduler->chunks[scheduler->first_pending].state != CHUNK_PENDING) {
+        scheduler->first_pending++;
+    }
+    if (scheduler->first_pending == scheduler->num_chunks) {
+        return -1;
+    }
+    int chunk = scheduler->first_pending++;
+    scheduler->chunks[chunk].state = CHUNK_ASSIGNED;
+    return chunk;
+}
+
+// Function to take the next pending chunk, waiting while all unfinished chunks are assigned
+// Returns the chunk index, or -1 once every chunk is done
+static int claim_chunk(ChunkScheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    int chunk = -1;
+    while (scheduler->remaining > 0 && (chunk = take_pending_chunk(scheduler)) < 0) {
+        pthread_cond_wait(&scheduler->changed, &scheduler->lock);   // A disconnect may put a chunk back
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return chunk;
+}
+
+// Function to claim a chunk for a client without blocking the event loop
+// Returns the chunk index, -1 if all chunks are assigned, or -2 once every chunk is done
+static int try_claim_chunk(ChunkScheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    int chunk = scheduler->remaining > 0 ? take_pending_chunk(scheduler) : -2;
+    pthread_mutex_unlock(&scheduler->lock);
+    return chunk;
+}
+
+// Function to mark a chunk finished
+static void complete_chunk(ChunkScheduler* scheduler, int chunk, const char* worker) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->chunks[chunk].state = CHUNK_DONE;
+    scheduler->remaining--;
+    printf("Server: Frames %d-%d completed by %s (%d of %d chunks left).\n", scheduler->chunks[chunk].start_frame,
+           scheduler->chunks[chunk].end_frame, worker, scheduler->remaining, scheduler->num_chunks);
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+    uint64_t one = 1;
+    if (write(scheduler->wake_fd, &one, sizeof(one)) < 0) {   // Wake the event loop, it may be waiting to finish
+        fprintf(stderr, "Error: Could not wake the server event loop.\n");
+    }
+}
+
+// Function to put a chunk back in the queue after its worker went away
+static void requeue_chunk(ChunkScheduler* scheduler, int chunk) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->chunks[chunk].state = CHUNK_PENDING;
+    if (chunk < scheduler->first_pending) {
+        scheduler->first_pending = chunk;
+    }
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+// Function to count unfinished chunks
+static int chunks_remaining(ChunkScheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    int remaining = scheduler->remaining;
+    pthread_mutex_unlock(&scheduler->lock);
+    return remaining;
+}
+
+static void free_results(MaskResult* results, int count) {
+    for (int i = 0; i < count; ++i) {
+        free(results[i].payload);
+    }
+    free(results);
+}
+
+// Task to decode the masks of a finished chunk, write them like locally detected ones, then mark the chunk done
+static void save_chunk_task(void* arg) {
+    ChunkSave* save = (ChunkSave*)arg;
+    const char* output_path = save->scheduler->output_path;
+    FrameChunk* range = &save->scheduler->chunks[save->chunk];
+    int first = first_mask_frame(range->start_frame);
+    unsigned char* saved = (unsigned char*)calloc(range->end_frame - first + 1, 1);   // Frames of the chunk that got a mask
+    for (int i = 0; i < save->count; ++i) {
+        MaskMessage* header = &save->results[i].header;                   // Index and size were checked when it arrived
+        if (saved[header->index - first]) {
+            fprintf(stderr, "Error: Worker sent frame %d twice. Keeping the first mask.\n", header->index);
+            continue;
+        }
+        int count_pixels = header->width * header->height;
+        unsigned char* mask = frame_buffer_acquire(count_pixels);
+        if (decode_mask(save->results[i].data, save->results[i].size, header->encoding, header->count, mask, count_pixels) == 0) {
+            const RoiGrid* roi = motion_roi(output_path, header->width, header->height);  // Workers do not know the region
+            int motion_pixels = roi_clip_mask(roi, mask, header->motion_pixels);
+            save_motion_frame(output_path, header->index, mask, header->width, header->height, motion_pixels);
+            saved[header->index - first] = 1;
+        } else {
+            fprintf(stderr, "Error: Worker sent an invalid mask for frame %d.\n", header->index);
+        }
+        frame_buffer_release(mask);
+    }
+    for (int index = first; index <= range->end_frame; ++index) {         // Frames the worker could not compare, so the video does not wait for them
+        if (!saved[index - first]) {
+            skip_motion_frame(output_path, index);
+        }
+    }
+    free(saved);
+    complete_chunk(save->scheduler, save->chunk, save->name);
+    free_results(save->results, save->count);
+    free(save);
+}
+
+// Function to register or clear interest in writability, only while output is waiting
+static void watch_output(EventLoop* loop, Connection* connection, int writing) {
+    if (connection->writing == writing) {
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+    event.data.ptr = connection;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, connection->socket, &event);
+    connection->writing = writing;
+}
+
+// Function to queue the MSG_FRAME header of the next frame file; the file itself follows with sendfile
+// Frames of a pack are sent from the pack file, each one from its offset in the frame table
+static void queue_next_frame(ChunkScheduler* scheduler, Connection* connection) {
+    int fd = -1;
+    off_t offset = 0, size = 0;
+    if (scheduler->pack) {
+        uint32_t frame_size;
+        uint64_t frame_offset;
+        if (frame_pack_frame(scheduler->pack, connection->next_frame, &frame_size, &frame_offset) &&
+            frame_size <= PROTOCOL_MAX_PAYLOAD - sizeof(int32_t)) {
+            fd = dup(frame_pack_fd(scheduler->pack));                       // Closed after sending like a frame file
+            offset = (off_t)frame_offset;
+            size = frame_size;
+        }
+    } else {
+        char frame_path[MAX_PATH];
+        snprintf(frame_path, sizeof(frame_path), "%s/frame_%d.jpg", scheduler->input_path, connection->next_frame);
+        fd = open(frame_path, O_RDONLY);
+        struct stat info;
+        if (fd >= 0 && (fstat(fd, &info) != 0 || info.st_size > (off_t)(PROTOCOL_MAX_PAYLOAD - sizeof(int32_t)))) {
+            close(fd);
+            fd = -1;
+        }
+        size = fd >= 0 ? info.st_size : 0;
+    }
+    connection->file = fd;                                                  // A missing frame is sent without bytes
+    connection->file_offset = offset;
+    connection->file_end = fd >= 0 ? offset + size : 0;
+
+    int32_t index = connection->next_frame++;
+    encode_header(MSG_FRAME, sizeof(index) + (fd >= 0 ? size : 0), connection->out);
+    encode_ints(&index, 1, connection->out + PROTOCOL_HEADER_SIZE);
+    connection->out_length = PROTOCOL_HEADER_SIZE + sizeof(index);
+    connection->out_sent = 0;
+}
+
+// Function to send as much pending output as the socket accepts without blocking
+// Returns -1 if the connection failed
+static int flush_output(EventLoop* loop, Connection* connection) {
+    while (1) {
+        ssize_t sent;
+        if (connection->out_sent < connection->out_length) {
+            sent = send(connection->socket, connection->out + connection->out_sent,
+                        connection->out_length - connection->out_sent, MSG_NOSIGNAL);
+            if (sent > 0) {
+                connection->out_sent += sent;
+            }
+        } else if (connection->file >= 0) {
+            if (connection->file_offset == connection->file_end) {
+                close(connection->file);
+                connection->file = -1;
+                continue;
+            }
+            sent = sendfile(connection->socket, connection->file, &connection->file_offset,
+                            connection->file_end - connection->file_offset);   // Zero-copy from the page cache
+            if (sent == 0) {                                                // The file shrank under us
+                return -1;
+            }
+        } else if (connection->chunk >= 0 && connection->next_frame <= connection->last_frame) {
+            queue_next_frame(loop->scheduler, connection);
+            continue;
+        } else {
+            watch_output(loop, connection, 0);                              // Everything sent
+            return 0;
+        }
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {                  // Socket buffer full, continue when writable
+                watch_output(loop, connection, 1);
+                return 0;
+            }
+            return -1;
+        }
+        connection->last_activity = now_seconds();
+    }
+}
+
+// Function to close a connection, putting its chunk back in the queue if it had one
+static void drop_connection(EventLoop* loop, Connection* connection, const char* reason) {
+    if (connection->chunk >= 0) {
+        fprintf(stderr, "Error: %s client %s. Reassigning frames %d-%d.\n", reason, connection->name,
+                loop->scheduler->chunks[connection->chunk].start_frame, loop->scheduler->chunks[connection->chunk].end_frame);
+        requeue_chunk(loop->scheduler, connection->chunk);
+        connection->chunk = -1;
+    }
+    if (connection->file >= 0) {
+        close(connection->file);
+    }
+    close(connection->socket);                                              // Also removes it from the epoll set
+    connection->socket = -1;
+}
+
+// Function to give an idle client its next chunk, or tell it the run is over
+static void assign_chunk(EventLoop* loop, Connection* connection) {
+    int chunk = try_claim_chunk(loop->scheduler);
+    if (chunk == -1) {                                                      // Everything is assigned, a requeue may free a chunk later
+        return;
+    }
+    if (chunk == -2) {
+        encode_header(MSG_DONE, 0, connection->out);                       // Let the client go
+        connection->out_length = PROTOCOL_HEADER_SIZE;
+        connection->out_sent = 0;
+        connection->closing = 1;
+        connection->last_activity = now_seconds();
+    } else {
+        FrameChunk* range = &loop->scheduler->chunks[chunk];
+        ChunkMessage message;
+        message.start_frame = range->start_frame;
+        message.first_frame = range->start_frame > 0 ? range->start_frame - 1 : range->start_frame;    // Include the reference frame
+        message.end_frame = range->end_frame;
+        message.threshold = motion_config.threshold;
+        message.decode_scale = motion_config.decode_scale;
+        message.detect_mode = motion_config.detect_mode;
+        message.learning_shift = motion_config.learning_shift;
+        message.pyramid = motion_config.pyramid;
+        message.coarse_threshold = motion_config.coarse_threshold;
+        int raw = loop->scheduler->pack && frame_pack_encoding(loop->scheduler->pack) == FRAME_PACK_RAW;
+        message.frame_width = raw ? frame_pack_width(loop->scheduler->pack) : 0;
+        message.frame_height = raw ? frame_pack_height(loop->scheduler->pack) : 0;
+        encode_header(MSG_CHUNK, sizeof(message), connection->out);
+        encode_ints((const int32_t*)&message, sizeof(message) / sizeof(int32_t), connection->out + PROTOCOL_HEADER_SIZE);
+        connection->out_length = PROTOCOL_HEADER_SIZE + sizeof(message);
+        connection->out_sent = 0;
+        connection->chunk = chunk;
+        connection->next_frame = message.first_frame;
+        connection->last_frame = message.end_frame;
+        connection->last_activity = now_seconds();                          // The timeout starts with the chunk
+    }
+    if (flush_output(loop, connection) != 0) {
+        drop_connection(loop, connection, "Lost");
+    }
+}
+
+// Function to act on one complete message from a client
+// Returns -1 if the client broke the protocol
+static int handle_message(EventLoop* loop, Connection* connection) {
+    ChunkScheduler* scheduler = loop->scheduler;
+    if (connection->chunk < 0 || connection->next_frame <= connection->last_frame) {    // Replies only make sense after a whole chunk was sent
+        return -1;
+    }
+    FrameChunk* range = &scheduler->chunks[connection->chunk];
+    if (connection->type == MSG_MASK) {
+        if (connection->length < sizeof(MaskMessage) || connection->result_count > range->end_frame - range->start_frame) {
+            return -1;
+        }
+        MaskMessage header;
+        decode_ints(connection->payload, sizeof(MaskMessage) / sizeof(int32_t), (int32_t*)&header);
+        if (header.index < first_mask_frame(range->start_frame) || header.index > range->end_frame ||      // Only frames of this chunk
+            header.width <= 0 || header.height <= 0 || (int64_t)header.width * header.height > NETWORK_MAX_MASK_PIXELS) {
+            fprintf(stderr, "Error: Client %s sent an invalid mask for frame %d.\n", connection->name, header.index);
+            return -1;
+        }
+        if (connection->result_count == connection->result_capacity) {
+            connection->result_capacity = connection->result_capacity ? connection->result_capacity * 2 : NETWORK_CHUNK_FRAMES;
+            connection->results = (MaskResult*)realloc(connection->results, connection->result_capacity * sizeof(MaskResult));
+        }
+        MaskResult* result = &connection->results[connection->result_count++];
+        result->header = header;
+        result->payload = connection->payload;                              // Kept until the chunk is written
+        result->data = connection->payload + sizeof(MaskMessage);
+        result->size = connection->length - sizeof(MaskMessage);
+        connection->payload = NULL;
+        return 0;
+    }
+    if (connection->type != MSG_CHUNK_DONE) {
+        return -1;
+    }
+    // Nothing is written until the whole chunk has arrived; a pool thread writes it while the loop carries on
+    ChunkSave* save = (ChunkSave*)malloc(sizeof(ChunkSave));
+    save->scheduler = scheduler;
+    save->chunk = connection->chunk;
+    snprintf(save->name, sizeof(save->name), "%s", connection->name);
+    save->results = connection->results;
+    save->count = connection->result_count;
+    thread_pool_submit(loop->pool, &loop->saves, save_chunk_task, save);
+    connection->chunk = -1;
+    connection->results = NULL;
+    connection->result_count = 0;
+    connection->result_capacity = 0;
+    assign_chunk(loop, connection);
+    return 0;
+}
+
+// Function to read whatever has arrived on a connection and handle each complete message
+// Returns -1 if the connection closed or failed
+static int read_input(EventLoop* loop, Connection* connection) {
+    while (connection->socket >= 0) {
+        ssize_t received;
+        if (connection->header_received < PROTOCOL_HEADER_SIZE) {
+            received = recv(connection->socket, connection->header + connection->header_received,
+                            PROTOCOL_HEADER_SIZE - connection->header_received, 0);
+            if (received > 0 && (connection->header_received += received) == PROTOCOL_HEADER_SIZE) {
+                if (decode_header(connection->header, &connection->type, &connection->length) != 0) {
+                    return -1;
+                }
+                connection->payload = (unsigned char*)malloc(connection->length ? connection->length : 1);
+                connection->payload_received = 0;
+            }
+        } else {
+            received = recv(connection->socket, connection->payload + connection->payload_received,
+                            connection->length - connection->payload_received, 0);
+            if (received > 0) {
+                connection->payload_received += received;
+            }
+        }
+        if (received == 0) {                                                // Peer closed
+            return -1;
+        }
+        if (received < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        connection->last_activity = now_seconds();
+        if (connection->header_received == PROTOCOL_HEADER_SIZE && connection->payload_received == connection->length) {
+            connection->header_received = 0;                                // Ready for the next message
+            int result = handle_message(loop, connection);
+            free(connection->payload);
+            connection->payload = NULL;
+            if (result != 0) {
+                fprintf(stderr, "Error: Unexpected message %u from client %s.\n", connection->type, connection->name);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to accept every waiting client and hand each one a chunk
+static void accept_clients(EventLoop* loop, int server_fd) {
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        int client_socket = accept(server_fd, (struct sockaddr*)&address, &addrlen);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Error: Accepting client connection failed.\n");
+            }
+            return;
+        }
+        fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+        Connection* connection = (Connection*)calloc(1, sizeof(Connection));
+        connection->socket = client_socket;
+        connection->chunk = -1;
+        connection->file = -1;
+        char host[INET_ADDRSTRLEN] = "unknown";
+        inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+        snprintf(connection->name, sizeof(connection->name), "%s:%d", host, ntohs(address.sin_port));
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) != 0) {
+            fprintf(stderr, "Error: Could not watch client %s\n", connection->name);
+            close(client_socket);
+            free(connection);
+            continue;
+        }
+        if (loop->num_connections == loop->capacity) {
+            loop->capacity = loop->capacity ? loop->capacity * 2 : 16;
+            loop->connections = (Connection**)realloc(loop->connections, loop->capacity * sizeof(Connection*));
+        }
+        loop->connections[loop->num_connections++] = connection;
+        printf("Server: Client %s connected.\n", connection->name);
+        assign_chunk(loop, connection);
+    }
+}
+
+// Function to give chunks to idle clients, time out stalled ones and free dropped ones
+static void tend_connections(EventLoop* loop, double now) {
+    int kept = 0;
+    for (int i = 0; i < loop->num_connections; ++i) {
+        Connection* connection = loop->connections[i];
+        if (connection->socket >= 0 && (connection->chunk >= 0 || connection->closing) &&
+            now - connection->last_activity > NETWORK_CLIENT_TIMEOUT) {
+            drop_connection(loop, connection, "Timed out");
+        }
+        if (connection->socket >= 0 && connection->closing && !connection->writing) {
+            close(connection->socket);                                      // MSG_DONE is out, the client is finished
+            connection->socket = -1;
+        }
+        if (connection->socket >= 0 && connection->chunk < 0 && !connection->closing) {
+            assign_chunk(loop, connection);                                 // A requeue or the end of the run may concern it
+        }
+        if (connection->socket < 0) {
+            free_results(connection->results, connection->result_count);
+            free(connection->payload);
+            free(connection);
+        } else {
+            loop->connections[kept++] = connection;
+        }
+    }
+    loop->num_connections = kept;
+}
+
+// Server thread that processes chunks locally from the same queue as the clients
+static void* local_worker_main(void* arg) {
+    ChunkScheduler* scheduler = (ChunkScheduler*)arg;
+    int chunk;
+    while ((chunk = claim_chunk(scheduler)) >= 0) {
+        process_chosen_frames(scheduler->input_path, scheduler->output_path,
+                              scheduler->chunks[chunk].end_frame + 1, scheduler->chunks[chunk].start_frame);
+        complete_chunk(scheduler, chunk, "server");
+    }
+    return NULL;
+}
 
 // Function to start the server
 void start_server(const char* input_path, const char* output_path, int start_frame, int end_frame) {
-    int server_fd, client_socket;
+    int server_fd;
     struct sockaddr_in address;
-    int addrlen = sizeof(address);
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {                       // Create a socket for the server
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {                        // Create a socket for the server
         fprintf(stderr, "Error: Socket creation failed.\n");
         exit(EXIT_FAILURE);                                                         // Failed to create socket
     }
@@ -40,7 +575,7 @@ void start_server(const char* input_path, const char* output_path, int start_fra
 
     address.sin_family = AF_INET;                                                   // Use IPv4
     address.sin_addr.s_addr = INADDR_ANY;                                           // Accept connections from any IP
-    address.sin_port = htons(PORT);                                                 // Set the port
+    address.sin_port = htons(motion_config.server_port);                            // Set the port
 
     if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {         // Bind the socket to the address
         fprintf(stderr, "Error: Socket bind failed.\n");
@@ -48,100 +583,371 @@ void start_server(const char* input_path, const char* output_path, int start_fra
         exit(EXIT_FAILURE);                                                         // Exit the program
     }
 
-    if (listen(server_fd, 1) < 0) {                                                 // Start listening for incoming connections
+    if (listen(server_fd, SOMAXCONN) < 0) {                                         // Start listening, any number of clients may join
         fprintf(stderr, "Error: Socket listen failed.\n");
         close(server_fd);                                                           // Close the socket
         exit(EXIT_FAILURE);                                                         // Exit the program
     }
-    printf("Server listening on port %d...\n", PORT);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);            // The event loop accepts until the queue is empty
+    printf("Server listening on port %d...\n", motion_config.server_port);
+    signal(SIGPIPE, SIG_IGN);                                                       // sendfile to a vanished client must fail, not kill the server
 
-    if ((client_socket = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen)) < 0) {        // Accept a client connection
-        fprintf(stderr, "Error: Accepting client connection failed.\n");
-        close(server_fd);                                                                                   // Close the socket
-        exit(EXIT_FAILURE);                                                                                 // Exit the program
+    ChunkScheduler scheduler;                                                       // Shared queue of frame chunks
+    pthread_mutex_init(&scheduler.lock, NULL);
+    pthread_cond_init(&scheduler.changed, NULL);
+    scheduler.input_path = input_path;
+    scheduler.output_path = output_path;
+    scheduler.pack = NULL;                                                          // Held for the whole run, the local worker shares the mapping
+    if (is_frame_pack(input_path) && !(scheduler.pack = frame_pack_acquire(input_path))) {
+        close(server_fd);
+        exit(EXIT_FAILURE);
     }
 
-    char buffer[BUFFER_SIZE] = {0};
-    snprintf(buffer, sizeof(buffer), "PROCESS %s %s %d %d", input_path, output_path, start_frame, end_frame);
-    send(client_socket, buffer, strlen(buffer), 0);                                 // Send processing command to the client
-    printf("Server: Sent processing request to client.\n");
+    EventLoop loop;                                                                 // One thread serves every client
+    memset(&loop, 0, sizeof(loop));
+    loop.scheduler = &scheduler;
+    loop.pool = shared_thread_pool();
+    task_group_init(&loop.saves);
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    scheduler.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &listener_event;
+    int listening = loop.epoll_fd >= 0 && scheduler.wake_fd >= 0 && epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, server_fd, &event) == 0;
+    event.data.ptr = &wake_event;
+    if (!listening || epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, scheduler.wake_fd, &event) != 0) {
+        fprintf(stderr, "Error: Could not set up the server event loop.\n");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
 
-    memset(buffer, 0, BUFFER_SIZE);                                                 // Clear the buffer to prepare for receiving a response
-    if (read(client_socket, buffer, BUFFER_SIZE) > 0) {                             // Check if data is received from the client
-        printf("Server: Received confirmation from client: %s\n", buffer);
-        if (strcmp(buffer, "COMPLETED") == 0) {                                     // Check if the client confirmed successful processing
-            printf("Server: Client successfully completed the task.\n");
-        } else {
-            printf("Server: Unexpected message from client: %s\n", buffer);         // Handle invalid responses from the client
+    double frame_rate = (scheduler.pack && frame_pack_frame_rate(scheduler.pack) > 0) ? frame_pack_frame_rate(scheduler.pack) : motion_config.frame_rate;
+    if (open_run_outputs(input_path, output_path, frame_rate, end_frame + 1, start_frame) != 0) {    // Held for the whole run, local chunks and client masks share them
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    FrameRange* ranges;                                                             // Only frames near motion and not kept by resume are handed out
+    int num_ranges = plan_frame_ranges(input_path, output_path, end_frame + 1, start_frame, 1, &ranges);
+    scheduler.num_chunks = 0;
+    for (int r = 0; r < num_ranges; ++r) {
+        scheduler.num_chunks += (ranges[r].last - ranges[r].first + NETWORK_CHUNK_FRAMES) / NETWORK_CHUNK_FRAMES;
+    }
+    scheduler.chunks = (FrameChunk*)malloc(scheduler.num_chunks * sizeof(FrameChunk));
+    int chunk = 0;
+    for (int r = 0; r < num_ranges; ++r) {
+        skip_quiet_frames(output_path, r > 0 ? ranges[r - 1].last + 1 : first_mask_frame(start_frame), ranges[r].first - 1);
+        for (int first = ranges[r].first; first <= ranges[r].last; first += NETWORK_CHUNK_FRAMES, ++chunk) {
+            scheduler.chunks[chunk].start_frame = first;
+            scheduler.chunks[chunk].end_frame = first + NETWORK_CHUNK_FRAMES - 1;
+            if (scheduler.chunks[chunk].end_frame > ranges[r].last) {
+                scheduler.chunks[chunk].end_frame = ranges[r].last;
+            }
+            scheduler.chunks[chunk].state = CHUNK_PENDING;
         }
-    } else {
-        fprintf(stderr, "Error: Failed to receive confirmation from client.\n");    // Print error when no response
     }
-    
-    close(client_socket);   // Close the client socket
+    skip_quiet_frames(output_path, num_ranges > 0 ? ranges[num_ranges - 1].last + 1 : first_mask_frame(start_frame), end_frame);
+    free(ranges);
+    scheduler.first_pending = 0;
+    scheduler.remaining = scheduler.num_chunks;
+
+    pthread_t local_worker;
+    if (pthread_create(&local_worker, NULL, local_worker_main, &scheduler) != 0) {  // The server works on the queue too
+        fprintf(stderr, "Error: Could not create the local worker thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event events[NETWORK_MAX_EVENTS];
+    double next_report = now_seconds() + NETWORK_PROGRESS_INTERVAL;
+    while (1) {
+        int remaining = chunks_remaining(&scheduler);
+        if (remaining == 0 && listening) {                                          // No late joiners once the work is done
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, server_fd, NULL);
+            listening = 0;
+        }
+        tend_connections(&loop, now_seconds());
+        if (remaining == 0 && loop.num_connections == 0) {
+            break;
+        }
+        int count = epoll_wait(loop.epoll_fd, events, NETWORK_MAX_EVENTS, NETWORK_TICK_MS);    // Wake up regularly for timeouts
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == &listener_event) {
+                accept_clients(&loop, server_fd);
+                continue;
+            }
+            if (events[i].data.ptr == &wake_event) {
+                uint64_t wakeups;                                                   // A chunk finished, only clear the eventfd
+                ssize_t cleared = read(scheduler.wake_fd, &wakeups, sizeof(wakeups));
+                (void)cleared;
+                continue;
+            }
+            Connection* connection = (Connection*)events[i].data.ptr;
+            if (connection->socket >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                read_input(&loop, connection) != 0) {
+                drop_connection(&loop, connection, "Lost");
+            }
+            if (connection->socket >= 0 && (events[i].events & EPOLLOUT) && flush_output(&loop, connection) != 0) {
+                drop_connection(&loop, connection, "Lost");
+            }
+        }
+        double now = now_seconds();
+        if (now >= next_report && remaining > 0) {                                  // Periodic progress report
+            printf("Server: %d of %d chunks done, %d clients connected.\n", scheduler.num_chunks - remaining,
+                   scheduler.num_chunks, loop.num_connections);
+            next_report = now + NETWORK_PROGRESS_INTERVAL;
+        }
+    }
+
+    pthread_join(local_worker, NULL);
+    thread_pool_wait(loop.pool, &loop.saves);                                       // Client chunks still being written
+    task_group_destroy(&loop.saves);
+    close_motion_outputs(output_path);
+
+    free(loop.connections);
+    close(loop.epoll_fd);
+    close(scheduler.wake_fd);
+    free(scheduler.chunks);
+    frame_pack_release(scheduler.pack);
+    pthread_cond_destroy(&scheduler.changed);
+    pthread_mutex_destroy(&scheduler.lock);
     close(server_fd);       // Close the server socket
 }
 
+typedef struct {
+    int index;
+    unsigned char* jpeg;        // Frame file bytes as received, NULL if the server had no such frame
+    uint32_t jpeg_size;
+    int raw_width;              // The bytes are a raw luma plane of this size, 0 = a JPEG file
+    int raw_height;
+    GrayFrame frame;            // Decoded frame, NULL pixels if missing or undecodable
+    int has_mask;
+    MaskMessage mask;           // Result for this frame, compared with the frame before it
+    unsigned char* encoded;
+    uint32_t encoded_size;
+} RemoteFrame;
+
+// Task to decode one received frame
+static void decode_remote_frame(void* arg) {
+    RemoteFrame* remote = (RemoteFrame*)arg;
+    remote->frame.pixels = NULL;
+    remote->frame.coarse = NULL;
+    if (remote->jpeg && remote->raw_width > 0) {
+        if (remote->raw_height > 0 && remote->jpeg_size == (uint64_t)remote->raw_width * remote->raw_height) {
+            luma_gray_frame(remote->jpeg, remote->raw_width, remote->raw_height, 0, &remote->frame);
+        }
+    } else if (remote->jpeg) {
+        remote->frame.pixels = decode_jpeg_gray_coarse(remote->jpeg, remote->jpeg_size, &remote->frame.width, &remote->frame.height,
+                                                       motion_config.decode_scale, pyramid_active() ? &remote->frame.coarse : NULL);
+    }
+}
+
+// Function to run-length encode a computed mask into a frame's result
+static void store_mask(RemoteFrame* remote, unsigned char* mask, int motion_pixels) {
+    remote->has_mask = 1;
+    remote->mask.index = remote->index;
+    remote->mask.width = remote->frame.width;
+    remote->mask.height = remote->frame.height;
+    remote->mask.motion_pixels = motion_pixels;
+    remote->encoded = encode_mask(mask, remote->frame.width * remote->frame.height,
+                                  &remote->mask.encoding, &remote->mask.count, &remote->encoded_size);
+}
+
+// Task to compare a received frame with the one before it
+static void detect_remote_pair(void* arg) {
+    RemoteFrame* remote = (RemoteFrame*)arg;
+    RemoteFrame* previous = remote - 1;                         // Frames are stored in order
+    if (!remote->frame.pixels) {
+        printf("Error: Cannot load frame %d. Skipping...\n", remote->index);
+        return;
+    }
+    if (!previous->frame.pixels) {
+        printf("Cannot load previous frame %d. Using current frame as reference.\n", remote->index - 1);
+        return;
+    }
+    if (previous->frame.width != remote->frame.width || previous->frame.height != remote->frame.height) {
+        printf("Error: Frame %d size differs from the previous frame. Skipping...\n", remote->index);
+        return;
+    }
+    int count = remote->frame.width * remote->frame.height;
+    unsigned char* mask = frame_buffer_acquire(count);
+    int motion_pixels = detect_motion(NULL, &previous->frame, &remote->frame, mask);  // The server applies its region
+    store_mask(remote, mask, motion_pixels);
+    frame_buffer_release(mask);
+}
+
+// Function to receive one chunk, detect motion in it and send the masks back
+static int process_remote_chunk(int socket, const unsigned char* payload) {
+    ChunkMessage chunk;
+    decode_ints(payload, sizeof(ChunkMessage) / sizeof(int32_t), (int32_t*)&chunk);
+    int count = chunk.end_frame - chunk.first_frame + 1;
+    if (count <= 0 || count > NETWORK_CHUNK_FRAMES + 1) {
+        fprintf(stderr, "Error: Invalid chunk %d-%d from server.\n", chunk.start_frame, chunk.end_frame);
+        return -1;
+    }
+    if (chunk.detect_mode != DETECT_PAIRWISE) {                         // A background model cannot start over at every chunk
+        fprintf(stderr, "Error: The server asked for background mode, which is only supported in local runs.\n");
+        return -1;
+    }
+    motion_config.threshold = (unsigned char)chunk.threshold;          // Use the server's settings so every worker agrees
+    motion_config.decode_scale = chunk.decode_scale;
+    motion_config.pyramid = chunk.pyramid;
+    motion_config.coarse_threshold = chunk.coarse_threshold;
+
+    RemoteFrame* frames = (RemoteFrame*)calloc(count, sizeof(RemoteFrame));
+    int status = 0;
+    for (int i = 0; i < count && status == 0; ++i) {                    // Receive every frame before working on any of them
+        uint32_t type, length;
+        unsigned char prefix[4];
+        if (recv_message_header(socket, &type, &length) != 0 || type != MSG_FRAME || length < sizeof(prefix) ||
+            recv_all(socket, prefix, sizeof(prefix)) != 0) {
+            status = -1;
+            break;
+        }
+        int32_t index;
+        decode_ints(prefix, 1, &index);
+        frames[i].index = index;
+        frames[i].jpeg_size = length - sizeof(prefix);
+        frames[i].raw_width = chunk.frame_width;
+        frames[i].raw_height = chunk.frame_height;
+        if (frames[i].jpeg_size > 0) {
+            frames[i].jpeg = (unsigned char*)malloc(frames[i].jpeg_size);
+            status = recv_all(socket, frames[i].jpeg, frames[i].jpeg_size);
+        }
+    }
+
+    if (status == 0) {
+        ThreadPool* pool = shared_thread_pool();
+        TaskGroup group;
+        task_group_init(&group);
+        thread_pool_submit_range(pool, &group, decode_remote_frame, frames, sizeof(RemoteFrame), count);
+        thread_pool_wait(pool, &group);                                 // Decode in parallel
+        if (count > 1) {                                         // Every frame after the first is compared with its predecessor
+            thread_pool_submit_range(pool, &group, detect_remote_pair, frames + 1, sizeof(RemoteFrame), count - 1);
+            thread_pool_wait(pool, &group);                             // Detect and encode in parallel
+        }
+        task_group_destroy(&group);
+    }
+
+    int masks = 0;
+    for (int i = 0; i < count; ++i) {
+        if (status == 0 && frames[i].has_mask) {                        // Send results in frame order
+            unsigned char header[sizeof(MaskMessage)];
+            encode_ints((const int32_t*)&frames[i].mask, sizeof(MaskMessage) / sizeof(int32_t), header);
+            uint32_t length = sizeof(header) + frames[i].encoded_size;
+            unsigned char* message = (unsigned char*)malloc(length);
+            memcpy(message, header, sizeof(header));
+            memcpy(message + sizeof(header), frames[i].encoded, frames[i].encoded_size);
+            status = send_message(socket, MSG_MASK, message, length);
+            free(message);
+            masks++;
+        }
+        free(frames[i].encoded);
+        free(frames[i].jpeg);
+        free_gray_frame(&frames[i].frame);
+    }
+    free(frames);
+    if (status == 0) {
+        status = send_message(socket, MSG_CHUNK_DONE, NULL, 0);
+        printf("Client: Processed frames %d to %d, sent %d masks.\n", chunk.start_frame, chunk.end_frame, masks);
+    }
+    return status;
+}
+
+// Function to serve chunks from the server until it reports that all frames are done
+static void serve_chunks(int socket) {
+    int chunks = 0;
+    while (1) {
+        uint32_t type, length;
+        unsigned char payload[sizeof(ChunkMessage)];
+        if (recv_message_header(socket, &type, &length) != 0) {
+            fprintf(stderr, "Error: Lost connection to the server.\n");
+            break;
+        }
+        if (type == MSG_DONE) {
+            printf("Client: Server reports all frames processed.\n");
+            break;
+        }
+        if (type != MSG_CHUNK || length != sizeof(payload) || recv_all(socket, payload, sizeof(payload)) != 0) {
+            fprintf(stderr, "Error: Unexpected message %u from server.\n", type);
+            break;
+        }
+        if (process_remote_chunk(socket, payload) != 0) {
+            fprintf(stderr, "Error: Lost connection to the server.\n");
+            break;
+        }
+        chunks++;
+    }
+    printf("Client: Processed %d chunks.\n", chunks);
+}
+
+// Function to connect to the configured server, returns the socket or -1
+static int connect_to_server() {
+    char port[16];
+    struct addrinfo hints, *addresses, *address;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;                                            // IPv4 or IPv6, names or literal addresses
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", motion_config.server_port);
+    int error = getaddrinfo(motion_config.server_host, port, &hints, &addresses);
+    if (error != 0) {
+        fprintf(stderr, "Error: Cannot resolve %s: %s\n", motion_config.server_host, gai_strerror(error));
+        return -1;
+    }
+    int client_socket = -1;
+    for (address = addresses; address; address = address->ai_next) {       // Try each address until one connects
+        client_socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (client_socket < 0) {
+            continue;
+        }
+        if (connect(client_socket, address->ai_addr, address->ai_addrlen) == 0) {
+            break;
+        }
+        close(client_socket);
+        client_socket = -1;
+    }
+    freeaddrinfo(addresses);
+    return client_socket;
+}
+
 // Function to start the client
 void start_client() {
-    int client_socket;
-    struct sockaddr_in server_address;
-
     while (1) {                                                                 // Loop to retry connection or return to main menu
         char user_input[16];
         printf("Client: Enter 'connect' to start or 'home' to cancel: ");
-        scanf("%s", user_input);
-
-        if (strcmp(user_input, "home") == 0) {                                  // Return to main menu if "home" is entered
+        if (scanf("%15s", user_input) != 1 || strcmp(user_input, "home") == 0) {  // Return to main menu if "home" is entered or input ended
             return;
         } else if (strcmp(user_input, "connect") != 0) {                        // Handle invalid input
             printf("Client: Invalid input. Please type 'connect' or 'home'.\n");
             continue;                                                           // Retry
         }
 
-        if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {            // Create a socket for the client
-            fprintf(stderr, "Error: Socket creation failed.\n");
-            continue;                                                           // Retry
-        }
-        server_address.sin_family = AF_INET;                                    // Use IPv4
-        server_address.sin_port = htons(PORT);                                  // Set the port
-        
-        if (inet_pton(AF_INET, "127.0.0.1", &server_address.sin_addr) <= 0) {   // Convert the server address to binary form
-            fprintf(stderr, "Error: Invalid address or address not supported.\n");
-            close(client_socket);                                               // Close socket
+        int client_socket = connect_to_server();
+        if (client_socket < 0) {                                                // Attempt to connect to the server
+            fprintf(stderr, "Error: Unable to connect to %s:%d. Retrying...\n", motion_config.server_host, motion_config.server_port);
             continue;                                                           // Retry
         }
-
-        if (connect(client_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {    // Attempt to connect to the server
-            fprintf(stderr, "Error: Unable to connect to the server. Retrying...\n");
-            close(client_socket);                                                                       // Close socket
-            continue;                                                                                   // Retry
-        }
-
         printf("Client: Connected to server.\n");
+        serve_chunks(client_socket);
+        close(client_socket);                                                   // Close the client socket
+        break;                                                                  // Exit after success
+    }
+}
 
-        char buffer[BUFFER_SIZE] = {0};
-        if (read(client_socket, buffer, BUFFER_SIZE) <= 0) {                                // Read the processing command from the server
-            fprintf(stderr, "Error: Failed to receive processing command from server.\n");
-            close(client_socket);                                                           // Close socket
-            continue;                                                                       // Retry
+// Function to run as a headless worker, retrying until the server is up
+int start_worker() {
+    int client_socket = -1;
+    for (int attempt = 0; attempt < WORKER_CONNECT_ATTEMPTS && client_socket < 0; ++attempt) {
+        if (attempt > 0) {
+            sleep(1);
         }
-        printf("Client: Received processing command: %s\n", buffer);
-
-        char input_path[MAX_PATH], output_path[MAX_PATH];
-        int start_frame, end_frame;
-        sscanf(buffer, "PROCESS %s %s %d %d", input_path, output_path, &start_frame, &end_frame);   // Parse the processing command
-        printf("Client: Processing frames from %d to %d in directories:\n", start_frame, end_frame);
-        printf(" - Input directory: %s\n", input_path);
-        printf(" - Output directory: %s\n", output_path);
-
-        process_frames_with_threads(input_path, output_path, end_frame + 1, start_frame);   // Process frames using the specified input and output paths
-
-        snprintf(buffer, sizeof(buffer), "COMPLETED");                  // Notify the server of completion
-        send(client_socket, buffer, strlen(buffer), 0);                 // Send confirmation
-        printf("Client: Sent completion confirmation to server.\n");
-
-        close(client_socket);                                           // Close the client socket
-        break;                                                          // Exit after success
+        client_socket = connect_to_server();
+    }
+    if (client_socket < 0) {
+        fprintf(stderr, "Error: Unable to connect to %s:%d.\n", motion_config.server_host, motion_config.server_port);
+        return -1;
     }
+    printf("Worker: Connected to %s:%d.\n", motion_config.server_host, motion_config.server_port);
+    serve_chunks(client_socket);
+    close(client_socket);
+    return 0;
 }
@@ -1,7 +1,16 @@
 #ifndef NETWORK_UTILS_H
 #define NETWORK_UTILS_H
 
+#define NETWORK_CHUNK_FRAMES 64     // Frames handed to a worker at a time
+#define WORKER_CONNECT_ATTEMPTS 30  // Headless workers retry once a second while the server starts
+#define NETWORK_CLIENT_TIMEOUT 60   // Seconds a client may hold a chunk without any traffic before it is dropped
+#define NETWORK_PROGRESS_INTERVAL 10    // Seconds between server progress reports
+#define NETWORK_TICK_MS 200         // Longest the event loop sleeps, so timeouts and the end of the run are noticed
+#define NETWORK_MAX_EVENTS 64       // Events handled per epoll_wait
+#define NETWORK_MAX_MASK_PIXELS (1 << 28)   // Largest mask accepted from a worker, well past 8K
+
 void start_server(const char* input_path, const char* output_path, int start_frame, int end_frame);
 void start_client();
+int start_worker();
 
 #endif
@@ -0,0 +1,235 @@
+/**************************************************************
+Filename: pipeline.c
+Description:
+  Staged motion detection pipeline. Decoder, detector and
+  encoder thread groups are connected by bounded lock-free
+  queues, so JPEG decoding, mask computation and mask encoding
+  or disk writes overlap instead of alternating. Full queues
+  stall the stage feeding them, which bounds memory use.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "pipeline.h"
+#include "handle_motion.h"
+#include "bounded_queue.h"
+#include "frame_pool.h"
+#include "motion_kernel.h"
+#include "motion_config.h"
+#include "image_utils.h"
+
+#define PIPELINE_CHUNK_FRAMES 32    // Frames each decoder claims at a time
+
+typedef struct {
+    GrayFrame frame;
+    int refs;                       // Frame pairs (and the decoder) still using this frame
+} SharedFrame;
+
+typedef struct {
+    int index;
+    SharedFrame* prev;
+    SharedFrame* cur;
+} FramePair;
+
+typedef struct {
+    int index;
+    unsigned char* mask;
+    int width;
+    int height;
+    int motion_pixels;
+} MaskResult;
+
+typedef struct {
+    const char* input_path;
+    const char* output_path;
+    int start_frame;
+    int total_frames;
+    int num_chunks;
+    int next_chunk;                 // Next chunk a decoder will claim
+    int active_decoders;            // Decoders still running, the last one ends the detect stage
+    int active_detectors;           // Detectors still running, the last one ends the encode stage
+    int num_detectors;
+    int num_encoders;
+    BoundedQueue* pairs;            // Decoder -> detector
+    BoundedQueue* masks;            // Detector -> encoder
+} Pipeline;
+
+static char end_of_stream;          // Address used as the end-of-stream marker
+#define END_OF_STREAM ((void*)&end_of_stream)
+
+// Function to load a frame into a reference-counted holder
+static SharedFrame* load_shared_frame(const char* input_path, int index) {
+    SharedFrame* shared = (SharedFrame*)malloc(sizeof(SharedFrame));
+    if (!load_gray_frame(input_path, index, &shared->frame)) {
+        free(shared);
+        return NULL;
+    }
+    shared->refs = 1;
+    return shared;
+}
+
+static void retain_shared_frame(SharedFrame* shared) {
+    __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Function to drop one reference, freeing the frame when it was the last
+static void release_shared_frame(SharedFrame* shared) {
+    if (shared && __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_gray_frame(&shared->frame);
+        free(shared);
+    }
+}
+
+// Decoder stage: claims chunks of frames, decodes them and emits consecutive frame pairs
+static void* decoder_main(void* arg) {
+    Pipeline* pipeline = (Pipeline*)arg;
+    int chunk;
+    while ((chunk = __atomic_fetch_add(&pipeline->next_chunk, 1, __ATOMIC_RELAXED)) < pipeline->num_chunks) {
+        int first = pipeline->start_frame + chunk * PIPELINE_CHUNK_FRAMES;
+        int last = first + PIPELINE_CHUNK_FRAMES - 1;
+        if (last > pipeline->total_frames - 1) {
+            last = pipeline->total_frames - 1;
+        }
+        SharedFrame* prev = first > 0 ? load_shared_frame(pipeline->input_path, first - 1) : NULL;    // Reference for the first frame of the chunk, frame 0 has none
+        for (int i = first; i <= last; ++i) {
+            SharedFrame* cur = load_shared_frame(pipeline->input_path, i);
+            if (!cur) {                                                                     // Skip if the frame cannot be loaded
+                printf("Error: Cannot load frame %d in %s. Skipping...\n", i, pipeline->input_path);
+                if (i > 0) {                                                                // So the video does not wait for its mask
+                    skip_motion_frame(pipeline->output_path, i);
+                }
+                release_shared_frame(prev);
+                prev = NULL;
+                continue;
+            }
+            if (!prev) {
+                if (i > 0) {
+                    printf("Cannot load previous frame %d. Using current frame as reference.\n", i - 1);
+                    skip_motion_frame(pipeline->output_path, i);
+                }
+            } else if (prev->frame.width != cur->frame.width || prev->frame.height != cur->frame.height) {
+                printf("Error: Frame %d size differs from the previous frame. Skipping...\n", i);
+                skip_motion_frame(pipeline->output_path, i);
+            } else {
+                FramePair* pair = (FramePair*)malloc(sizeof(FramePair));
+                pair->index = i;
+                pair->prev = prev;
+                pair->cur = cur;
+                retain_shared_frame(prev);
+                retain_shared_frame(cur);
+                bounded_queue_push(pipeline->pairs, pair);                                  // Waits while detectors are behind
+            }
+            release_shared_frame(prev);
+            prev = cur;                                                                     // Current frame becomes the reference for the next one
+        }
+        release_shared_frame(prev);
+    }
+    if (__atomic_sub_fetch(&pipeline->active_decoders, 1, __ATOMIC_ACQ_REL) == 0) {        // Last decoder out closes the detect stage
+        for (int i = 0; i < pipeline->num_detectors; ++i) {
+            bounded_queue_push(pipeline->pairs, END_OF_STREAM);
+        }
+    }
+    return NULL;
+}
+
+// Detector stage: turns frame pairs into motion masks
+static void* detector_main(void* arg) {
+    Pipeline* pipeline = (Pipeline*)arg;
+    void* item;
+    while ((item = bounded_queue_pop(pipeline->pairs)) != END_OF_STREAM) {
+        FramePair* pair = (FramePair*)item;
+        MaskResult* result = (MaskResult*)malloc(sizeof(MaskResult));
+        result->index = pair->index;
+        result->width = pair->cur->frame.width;
+        result->height = pair->cur->frame.height;
+        result->mask = frame_buffer_acquire((size_t)result->width * result->height);
+        result->motion_pixels = detect_motion(pipeline->output_path, &pair->prev->frame, &pair->cur->frame,
+                                              result->mask);                                // Difference and threshold in a single pass
+        release_shared_frame(pair->prev);
+        release_shared_frame(pair->cur);
+        free(pair);
+        bounded_queue_push(pipeline->masks, result);                                        // Waits while encoders are behind
+    }
+    if (__atomic_sub_fetch(&pipeline->active_detectors, 1, __ATOMIC_ACQ_REL) == 0) {       // Last detector out closes the encode stage
+        for (int i = 0; i < pipeline->num_encoders; ++i) {
+            bounded_queue_push(pipeline->masks, END_OF_STREAM);
+        }
+    }
+    return NULL;
+}
+
+// Encoder stage: compresses and writes masks
+static void* encoder_main(void* arg) {
+    Pipeline* pipeline = (Pipeline*)arg;
+    void* item;
+    while ((item = bounded_queue_pop(pipeline->masks)) != END_OF_STREAM) {
+        MaskResult* result = (MaskResult*)item;
+        save_motion_frame(pipeline->output_path, result->index, result->mask, result->width, result->height, result->motion_pixels);
+        frame_buffer_release(result->mask);
+        free(result);
+    }
+    return NULL;
+}
+
+// Function to start count threads running the same stage function
+static pthread_t* start_stage(int count, void* (*stage)(void*), Pipeline* pipeline, const char* name) {
+    pthread_t* threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+    for (int i = 0; i < count; ++i) {
+        if (pthread_create(&threads[i], NULL, stage, pipeline) != 0) {
+            fprintf(stderr, "Error: Could not create %s thread %d\n", name, i);
+            exit(EXIT_FAILURE);                                                             // Exit if thread creation fails
+        }
+    }
+    return threads;
+}
+
+static void join_stage(pthread_t* threads, int count) {
+    for (int i = 0; i < count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Function to process frames with separate decoder, detector and encoder thread groups
+void process_frames_pipelined(const char* input_path, const char* output_path, int total_frames, int start_frame) {
+    int frame_count = total_frames - start_frame;
+    if (frame_count <= 0) {
+        return;
+    }
+    int cores = get_cpu_cores();
+    int decoders = motion_config.decode_threads > 0 ? motion_config.decode_threads : (cores / 2 > 0 ? cores / 2 : 1);   // Decoding is the heaviest stage
+    int detectors = motion_config.detect_threads > 0 ? motion_config.detect_threads : (cores / 4 > 0 ? cores / 4 : 1);
+    int encoders = motion_config.encode_threads > 0 ? motion_config.encode_threads : (cores / 4 > 0 ? cores / 4 : 1);
+    int depth = motion_config.queue_depth > 0 ? motion_config.queue_depth : 2 * (decoders + detectors + encoders);
+
+    Pipeline pipeline;
+    pipeline.input_path = input_path;
+    pipeline.output_path = output_path;
+    pipeline.start_frame = start_frame;
+    pipeline.total_frames = total_frames;
+    pipeline.num_chunks = (frame_count + PIPELINE_CHUNK_FRAMES - 1) / PIPELINE_CHUNK_FRAMES;
+    pipeline.next_chunk = 0;
+    pipeline.active_decoders = decoders;
+    pipeline.active_detectors = detectors;
+    pipeline.num_detectors = detectors;
+    pipeline.num_encoders = encoders;
+    pipeline.pairs = bounded_queue_create(depth);
+    pipeline.masks = bounded_queue_create(depth);
+
+    if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+        printf("Pipeline: %d decoder, %d detector and %d encoder threads, queue depth %d.\n", decoders, detectors, encoders, depth);
+    }
+    pthread_t* encoder_threads = start_stage(encoders, encoder_main, &pipeline, "encoder");
+    pthread_t* detector_threads = start_stage(detectors, detector_main, &pipeline, "detector");
+    pthread_t* decoder_threads = start_stage(decoders, decoder_main, &pipeline, "decoder");
+
+    join_stage(decoder_threads, decoders);                      // Stages drain in order through the end-of-stream markers
+    join_stage(detector_threads, detectors);
+    join_stage(encoder_threads, encoders);
+
+    bounded_queue_destroy(pipeline.pairs);
+    bounded_queue_destroy(pipeline.masks);
+}
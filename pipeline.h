@@ -0,0 +1,6 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+void process_frames_pipelined(const char* input_path, const char* output_path, int total_frames, int start_frame);
+
+#endif
@@ -0,0 +1,274 @@
+/**************************************************************
+Filename: roi_mask.c
+Description:
+  Region-of-interest masks. A mask image marks the part of a
+  camera's view that is watched for motion (or, as an ignore
+  mask, the part that is not), so static areas such as sky,
+  walls and burned-in timestamps are never compared and cannot
+  report motion. The mask is resampled to each frame size once
+  and summarized per tile, so detection can skip ignored tiles
+  without looking at their pixels.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "roi_mask.h"
+#include "motion_kernel.h"
+#include "motion_config.h"
+#include "image_utils.h"
+#include "frame_pool.h"
+
+struct RoiMask {
+    int width;
+    int height;
+    unsigned char* pixels;      // Non-zero where motion is watched, at the mask file's resolution
+    RoiGrid* grids;             // One per frame size seen so far
+    pthread_mutex_t lock;
+};
+
+typedef struct RoiAssignment {
+    char output_path[512];      // Output directory whose runs use this mask
+    char mask_path[512];
+    int ignore;
+    struct RoiAssignment* next;
+} RoiAssignment;
+
+static RoiAssignment* assignments = NULL;                                       // Per-source masks, e.g. from a batch job file
+static pthread_mutex_t assignments_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to read a binary PGM (P5) image, returns NULL if the file is not one
+static unsigned char* load_pgm(FILE* file, int* width, int* height, int* max_value) {
+    char magic[3] = { 0 };
+    if (fread(magic, 1, 2, file) != 2 || strcmp(magic, "P5") != 0) {
+        return NULL;
+    }
+    int values[3];
+    for (int i = 0; i < 3; ++i) {                                               // Width, height and maximum value, with # comments between
+        int c;
+        while ((c = fgetc(file)) == '#' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            if (c == '#') {
+                while ((c = fgetc(file)) != '\n' && c != EOF) {
+                }
+            }
+        }
+        ungetc(c, file);
+        if (fscanf(file, "%d", &values[i]) != 1 || values[i] <= 0) {
+            return NULL;
+        }
+    }
+    fgetc(file);                                                                // Single whitespace before the pixels
+    if (values[0] > (1 << 16) || values[1] > (1 << 16) || values[2] > 255) {
+        return NULL;
+    }
+    size_t count = (size_t)values[0] * values[1];
+    unsigned char* pixels = (unsigned char*)malloc(count);
+    if (fread(pixels, 1, count, file) != count) {
+        free(pixels);
+        return NULL;
+    }
+    *width = values[0];
+    *height = values[1];
+    *max_value = values[2];
+    return pixels;
+}
+
+// Function to load a mask image (binary PGM or JPEG), light pixels are watched or, with ignore set, ignored
+RoiMask* roi_mask_load(const char* path, int ignore) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open ROI mask %s\n", path);
+        return NULL;
+    }
+    int width, height, max_value;
+    unsigned char* pixels = load_pgm(file, &width, &height, &max_value);
+    unsigned char signature[2] = { 0 };
+    if (!pixels) {                                                              // libjpeg exits on a file that is not a JPEG, so check first
+        rewind(file);
+        if (fread(signature, 1, 2, file) != 2) {
+            signature[0] = 0;
+        }
+    }
+    fclose(file);
+    if (!pixels) {                                                              // Not a PGM, try it as a JPEG
+        unsigned char* gray = signature[0] == 0xFF && signature[1] == 0xD8 ? load_jpeg_gray(path, &width, &height, 1) : NULL;
+        if (!gray) {
+            fprintf(stderr, "Error: ROI mask %s is not a binary PGM or JPEG image.\n", path);
+            return NULL;
+        }
+        pixels = (unsigned char*)malloc((size_t)width * height);
+        memcpy(pixels, gray, (size_t)width * height);
+        frame_buffer_release(gray);
+        max_value = 255;
+    }
+    size_t watched = 0;
+    for (size_t i = 0; i < (size_t)width * height; ++i) {
+        int light = 2 * pixels[i] > max_value;                                  // Compression noise around 0 and 255 is harmless
+        pixels[i] = (light != ignore) ? 255 : 0;
+        watched += pixels[i] != 0;
+    }
+    if (watched == 0) {
+        fprintf(stderr, "Error: ROI mask %s leaves nothing to watch.\n", path);
+        free(pixels);
+        return NULL;
+    }
+    RoiMask* roi = (RoiMask*)calloc(1, sizeof(RoiMask));
+    roi->width = width;
+    roi->height = height;
+    roi->pixels = pixels;
+    pthread_mutex_init(&roi->lock, NULL);
+    return roi;
+}
+
+void roi_mask_destroy(RoiMask* roi) {
+    if (!roi) {
+        return;
+    }
+    while (roi->grids) {
+        RoiGrid* grid = roi->grids;
+        roi->grids = grid->next;
+        free(grid->tiles);
+        free(grid->pixels);
+        free(grid);
+    }
+    pthread_mutex_destroy(&roi->lock);
+    free(roi->pixels);
+    free(roi);
+}
+
+// Function to resample the mask to a frame size and classify its tiles
+static RoiGrid* build_grid(const RoiMask* roi, int width, int height) {
+    RoiGrid* grid = (RoiGrid*)calloc(1, sizeof(RoiGrid));
+    grid->width = width;
+    grid->height = height;
+    grid->pixels = (unsigned char*)malloc((size_t)width * height);
+    for (int y = 0; y < height; ++y) {                                          // Nearest neighbour, so a mask drawn at any resolution fits
+        const unsigned char* source = roi->pixels + (size_t)((long long)y * roi->height / height) * roi->width;
+        unsigned char* row = grid->pixels + (size_t)y * width;
+        for (int x = 0; x < width; ++x) {
+            row[x] = source[(long long)x * roi->width / width];
+            grid->watched += row[x] != 0;
+        }
+    }
+    int tiles_x = (width + MOTION_TILE_WIDTH - 1) / MOTION_TILE_WIDTH;
+    int tiles_y = (height + MOTION_TILE_HEIGHT - 1) / MOTION_TILE_HEIGHT;
+    grid->tiles = (unsigned char*)malloc((size_t)tiles_x * tiles_y);
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            int x0 = tx * MOTION_TILE_WIDTH;
+            int x1 = (x0 + MOTION_TILE_WIDTH < width) ? x0 + MOTION_TILE_WIDTH : width;
+            int y0 = ty * MOTION_TILE_HEIGHT;
+            int y1 = (y0 + MOTION_TILE_HEIGHT < height) ? y0 + MOTION_TILE_HEIGHT : height;
+            int watched = 0;
+            for (int y = y0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x) {
+                    watched += grid->pixels[(size_t)y * width + x] != 0;
+                }
+            }
+            grid->tiles[ty * tiles_x + tx] = (watched == 0) ? TILE_IGNORED :
+                                             (watched == (x1 - x0) * (y1 - y0)) ? TILE_WATCHED : TILE_PARTIAL;
+        }
+    }
+    return grid;
+}
+
+// Function to get the mask at a frame size, built the first time that size is seen
+const RoiGrid* roi_mask_grid(RoiMask* roi, int width, int height) {
+    if (!roi) {
+        return NULL;
+    }
+    pthread_mutex_lock(&roi->lock);
+    RoiGrid* grid = roi->grids;
+    while (grid && (grid->width != width || grid->height != height)) {
+        grid = grid->next;
+    }
+    if (!grid) {                                                                // Grids are kept until the mask is destroyed, so callers need no reference
+        grid = build_grid(roi, width, height);
+        grid->next = roi->grids;
+        roi->grids = grid;
+    }
+    pthread_mutex_unlock(&roi->lock);
+    return grid;
+}
+
+// Function to write the motion mask of two grayscale frames inside the region, returns the number of motion pixels
+int roi_motion_mask(const RoiGrid* grid, const unsigned char* prev, const unsigned char* cur, unsigned char* mask,
+                    int width, int height, unsigned char threshold) {
+    return motion_mask_tiled(prev, cur, mask, width, height, grid ? grid->tiles : NULL, grid ? grid->pixels : NULL, threshold);
+}
+
+// Function to clear the motion outside the region from a finished mask, returns the motion pixels left
+int roi_clip_mask(const RoiGrid* grid, unsigned char* mask, int motion_pixels) {
+    if (!grid) {
+        return motion_pixels;
+    }
+    int remaining = 0;
+    for (size_t i = 0; i < (size_t)grid->width * grid->height; ++i) {
+        mask[i] &= grid->pixels[i];
+        remaining += mask[i] != 0;
+    }
+    return remaining;
+}
+
+// Function to give the runs writing to an output directory their own mask instead of the global one
+int roi_assign(const char* output_path, const char* mask_path, int ignore) {
+    if (strlen(output_path) >= sizeof(assignments->output_path) || strlen(mask_path) >= sizeof(assignments->mask_path)) {
+        fprintf(stderr, "Error: ROI mask path too long: %s\n", mask_path);
+        return -1;
+    }
+    RoiAssignment* assignment = (RoiAssignment*)malloc(sizeof(RoiAssignment));
+    snprintf(assignment->output_path, sizeof(assignment->output_path), "%s", output_path);
+    snprintf(assignment->mask_path, sizeof(assignment->mask_path), "%s", mask_path);
+    assignment->ignore = ignore;
+    pthread_mutex_lock(&assignments_lock);
+    assignment->next = assignments;
+    assignments = assignment;
+    pthread_mutex_unlock(&assignments_lock);
+    return 0;
+}
+
+void roi_unassign(const char* output_path) {
+    pthread_mutex_lock(&assignments_lock);
+    for (RoiAssignment** link = &assignments; *link; link = &(*link)->next) {
+        if (strcmp((*link)->output_path, output_path) == 0) {
+            RoiAssignment* assignment = *link;
+            *link = assignment->next;
+            free(assignment);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&assignments_lock);
+}
+
+// Function to find the mask file that applies to an output directory: its own if assigned, else the global one
+// Returns 0 when no mask is configured
+int roi_mask_source(const char* output_path, char* mask_path, size_t size, int* ignore) {
+    *ignore = motion_config.roi_ignore;
+    snprintf(mask_path, size, "%s", motion_config.roi_path ? motion_config.roi_path : "");
+    pthread_mutex_lock(&assignments_lock);
+    for (RoiAssignment* assignment = assignments; assignment; assignment = assignment->next) {
+        if (strcmp(assignment->output_path, output_path) == 0) {
+            snprintf(mask_path, size, "%s", assignment->mask_path);
+            *ignore = assignment->ignore;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&assignments_lock);
+    return mask_path[0] != '\0';
+}
+
+// Function to load the mask that applies to an output directory
+// Sets *roi to NULL when no mask is configured, returns -1 if the mask cannot be loaded
+int roi_mask_for_output(const char* output_path, RoiMask** roi) {
+    char mask_path[512];
+    int ignore;
+    *roi = NULL;
+    if (!roi_mask_source(output_path, mask_path, sizeof(mask_path), &ignore)) {
+        return 0;
+    }
+    *roi = roi_mask_load(mask_path, ignore);
+    return *roi ? 0 : -1;
+}
@@ -0,0 +1,29 @@
+#ifndef ROI_MASK_H
+#define ROI_MASK_H
+
+#include <stddef.h>
+
+// A region of interest resampled to one frame size
+typedef struct RoiGrid {
+    int width;
+    int height;
+    unsigned char* tiles;       // TileState of each MOTION_TILE_WIDTH x MOTION_TILE_HEIGHT tile, row by row
+    unsigned char* pixels;      // 255 where motion is watched, 0 where it is ignored
+    int watched;                // Number of watched pixels
+    struct RoiGrid* next;
+} RoiGrid;
+
+typedef struct RoiMask RoiMask;
+
+RoiMask* roi_mask_load(const char* path, int ignore);
+void roi_mask_destroy(RoiMask* roi);
+const RoiGrid* roi_mask_grid(RoiMask* roi, int width, int height);
+int roi_motion_mask(const RoiGrid* grid, const unsigned char* prev, const unsigned char* cur, unsigned char* mask,
+                    int width, int height, unsigned char threshold);
+int roi_clip_mask(const RoiGrid* grid, unsigned char* mask, int motion_pixels);
+int roi_assign(const char* output_path, const char* mask_path, int ignore);
+void roi_unassign(const char* output_path);
+int roi_mask_source(const char* output_path, char* mask_path, size_t size, int* ignore);
+int roi_mask_for_output(const char* output_path, RoiMask** roi);
+
+#endif
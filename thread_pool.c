@@ -0,0 +1,323 @@
+/**************************************************************
+Filename: thread_pool.c 
+Description:
+  Persistent work-stealing thread pool. Each worker owns a deque
+  of tasks; it runs its own tasks in order from one end while
+  idle workers steal from the other end. Threads are created
+  once and reused by every processing run, and callers waiting
+  on a task group help run queued tasks instead of blocking.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "thread_pool.h"
+#include "image_utils.h"
+#include "motion_config.h"
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+typedef struct {
+    TaskFunction function;
+    void* arg;
+    TaskGroup* group;
+} Task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Task* tasks;                // Ring buffer of tasks
+    int capacity;
+    int head;                   // Oldest task, where thieves steal from
+    int count;                  // The owner pushes and pops at head + count
+} WorkDeque;
+
+struct ThreadPool {
+    int num_threads;
+    pthread_t* threads;
+    WorkDeque* deques;          // One deque per worker
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_cond;   // Signalled when tasks are queued or on shutdown
+    int queued;                 // Tasks sitting in any deque
+    int shutdown;
+    unsigned int next_deque;    // Round-robin target for submissions from outside the pool
+};
+
+static __thread ThreadPool* current_pool = NULL;    // Pool the calling thread works for, if any
+static __thread int current_worker = -1;            // Index of the calling worker in that pool
+
+static ThreadPool* shared_pool = NULL;
+static pthread_mutex_t shared_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to push a task on the owner's end of a deque
+static void deque_push(WorkDeque* deque, Task task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {                                      // Grow the ring buffer, keeping task order
+        int capacity = deque->capacity * 2;
+        Task* tasks = (Task*)malloc(capacity * sizeof(Task));
+        for (int i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Function to pop the newest task from the owner's end (steal = 0) or the oldest from the far end (steal = 1)
+static int deque_pop(WorkDeque* deque, int steal, Task* task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        if (steal) {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        } else {
+            *task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+        }
+        deque->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Function to find a task: own deque first, then steal from the others
+static int take_task(ThreadPool* pool, int self, Task* task) {
+    if (self >= 0 && deque_pop(&pool->deques[self], 0, task)) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+        return 1;
+    }
+    int start = (self >= 0) ? self + 1 : (int)(__atomic_load_n(&pool->next_deque, __ATOMIC_RELAXED) % pool->num_threads);
+    for (int i = 0; i < pool->num_threads; i++) {                              // Visit every other deque once
+        int victim = (start + i) % pool->num_threads;
+        if (victim != self && deque_pop(&pool->deques[victim], 1, task)) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to run a task and report its completion to the task group
+static void run_task(Task* task) {
+    task->function(task->arg);
+    pthread_mutex_lock(&task->group->lock);
+    if (--task->group->pending == 0) {
+        pthread_cond_broadcast(&task->group->done_cond);                       // Wake anyone waiting on the group
+    }
+    pthread_mutex_unlock(&task->group->lock);
+}
+
+// Function to tell sleeping workers that new tasks are queued
+static void announce_tasks(ThreadPool* pool, int count) {
+    pthread_mutex_lock(&pool->idle_lock);
+    __atomic_add_fetch(&pool->queued, count, __ATOMIC_ACQ_REL);
+    if (count == 1) {
+        pthread_cond_signal(&pool->work_cond);
+    } else {
+        pthread_cond_broadcast(&pool->work_cond);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// Worker thread main loop
+static void* worker_main(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    int self = current_worker;
+    Task task;
+    while (1) {
+        if (take_task(pool, self, &task)) {
+            run_task(&task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->idle_lock);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) <= 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->work_cond, &pool->idle_lock);             // Sleep until there is work
+        }
+        int done = pool->shutdown && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) <= 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (done) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    ThreadPool* pool;
+    int index;
+} WorkerStart;
+
+// Thread entry that records which pool and deque the worker belongs to
+static void* worker_entry(void* arg) {
+    WorkerStart start = *(WorkerStart*)arg;
+    free(arg);
+    current_pool = start.pool;
+    current_worker = start.index;
+    return worker_main(start.pool);
+}
+
+// Function to create a pool with a fixed number of worker threads
+ThreadPool* thread_pool_create(int num_threads) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    ThreadPool* pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    pool->num_threads = num_threads;
+    pool->threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    pool->deques = (WorkDeque*)calloc(num_threads, sizeof(WorkDeque));
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].capacity = DEQUE_INITIAL_CAPACITY;
+        pool->deques[i].tasks = (Task*)malloc(DEQUE_INITIAL_CAPACITY * sizeof(Task));
+    }
+    for (int i = 0; i < num_threads; i++) {
+        WorkerStart* start = (WorkerStart*)malloc(sizeof(WorkerStart));
+        start->pool = pool;
+        start->index = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_entry, start) != 0) {   // Create the worker thread
+            fprintf(stderr, "Error: Could not create thread %d\n", i);
+            exit(EXIT_FAILURE);                                                     // Exit if thread creation fails
+        }
+    }
+    return pool;
+}
+
+// Function to stop the workers once all queued tasks have run and free the pool
+void thread_pool_destroy(ThreadPool* pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);                                   // Join threads to ensure completion
+    }
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->work_cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+int thread_pool_size(ThreadPool* pool) {
+    return pool->num_threads;
+}
+
+void task_group_init(TaskGroup* group) {
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->done_cond, NULL);
+    group->pending = 0;
+}
+
+void task_group_destroy(TaskGroup* group) {
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->done_cond);
+}
+
+// Function to queue one task, on the caller's own deque when it is a worker of this pool
+void thread_pool_submit(ThreadPool* pool, TaskGroup* group, TaskFunction function, void* arg) {
+    Task task = { function, arg, group };
+    pthread_mutex_lock(&group->lock);
+    group->pending++;
+    pthread_mutex_unlock(&group->lock);
+
+    int target = (current_pool == pool) ? current_worker
+                                        : (int)(__atomic_fetch_add(&pool->next_deque, 1, __ATOMIC_RELAXED) % pool->num_threads);
+    deque_push(&pool->deques[target], task);
+    announce_tasks(pool, 1);
+}
+
+// Function to queue count tasks whose arguments are stored back to back in args
+// Each worker gets a contiguous block and runs it in ascending order; thieves take from the end of a block
+void thread_pool_submit_range(ThreadPool* pool, TaskGroup* group, TaskFunction function, void* args, size_t arg_size, int count) {
+    if (count <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&group->lock);
+    group->pending += count;
+    pthread_mutex_unlock(&group->lock);
+
+    int workers = pool->num_threads;
+    for (int w = 0; w < workers; w++) {
+        int first = (int)((long)count * w / workers);                          // Block of tasks for worker w
+        int last = (int)((long)count * (w + 1) / workers) - 1;
+        for (int i = last; i >= first; i--) {                                  // Owner pops the newest, so push in reverse
+            Task task = { function, (char*)args + (size_t)i * arg_size, group };
+            deque_push(&pool->deques[w], task);
+        }
+    }
+    announce_tasks(pool, count);
+}
+
+// Function to wait for every task of a group, running queued tasks while waiting
+void thread_pool_wait(ThreadPool* pool, TaskGroup* group) {
+    int self = (current_pool == pool) ? current_worker : -1;
+    Task task;
+    while (1) {
+        pthread_mutex_lock(&group->lock);
+        int pending = group->pending;
+        pthread_mutex_unlock(&group->lock);
+        if (pending == 0) {
+            return;
+        }
+        if (take_task(pool, self, &task)) {                                     // Help instead of sleeping
+            run_task(&task);
+            continue;
+        }
+        struct timespec deadline;                                               // Nothing to steal, sleep briefly and re-check
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&group->lock);
+        if (group->pending > 0) {
+            pthread_cond_timedwait(&group->done_cond, &group->lock, &deadline);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+// Function to tear down the process-wide pool; the next use creates it again with the configured thread count
+void shared_thread_pool_reset() {
+    pthread_mutex_lock(&shared_pool_lock);
+    thread_pool_destroy(shared_pool);
+    shared_pool = NULL;
+    pthread_mutex_unlock(&shared_pool_lock);
+}
+
+// Function to get the process-wide pool, created on first use with the configured thread count
+ThreadPool* shared_thread_pool() {
+    pthread_mutex_lock(&shared_pool_lock);
+    if (!shared_pool) {
+        int num_threads = (motion_config.num_threads > 0) ? motion_config.num_threads : get_cpu_cores();
+        shared_pool = thread_pool_create(num_threads);
+        static int registered = 0;
+        if (!registered) {
+            atexit(shared_thread_pool_reset);                                        // Join the workers when the program exits
+            registered = 1;
+        }
+    }
+    ThreadPool* pool = shared_pool;
+    pthread_mutex_unlock(&shared_pool_lock);
+    return pool;
+}
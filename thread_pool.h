@@ -0,0 +1,28 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+typedef void (*TaskFunction)(void* arg);
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int pending;                // Tasks submitted to the group that have not finished yet
+} TaskGroup;
+
+typedef struct ThreadPool ThreadPool;
+
+ThreadPool* thread_pool_create(int num_threads);
+void thread_pool_destroy(ThreadPool* pool);
+int thread_pool_size(ThreadPool* pool);
+void thread_pool_submit(ThreadPool* pool, TaskGroup* group, TaskFunction function, void* arg);
+void thread_pool_submit_range(ThreadPool* pool, TaskGroup* group, TaskFunction function, void* args, size_t arg_size, int count);
+void thread_pool_wait(ThreadPool* pool, TaskGroup* group);
+void task_group_init(TaskGroup* group);
+void task_group_destroy(TaskGroup* group);
+ThreadPool* shared_thread_pool();
+void shared_thread_pool_reset();
+
+#endif
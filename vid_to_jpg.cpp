@@ -1,35 +1,249 @@
 /**************************************************************
 Filename: vid_to_jpg.cpp
 Description:
-  Extracts frames from a video file and saves them as 
-  JPG images. Uses OpenCV for video frame extraction and 
-  image saving.
+  Extracts frames from a video file and saves them as
+  JPG images, or as luma planes in a single frame pack when
+  the output path ends in .fpk. Uses OpenCV for video frame
+  extraction and image saving. Long videos are split into
+  segments that are decoded side by side, each by its own
+  capture seeked to the segment start, while the writes run
+  on the shared thread pool.
 Author: Cade Andrae
 Date: 12/11/24
 **************************************************************/
 
 #include <opencv2/opencv.hpp>
 #include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include "motion_config.h"
+#include "thread_pool.h"
+#include "metrics.h"
+#include "motion_kernel.h"
+#include "frame_pack.h"
+}
+
+#define MIN_SEGMENT_FRAMES 300          // Shortest segment worth a seek, a few keyframe intervals of decoding at most
+#define WRITES_PER_THREAD 2             // Frames waiting for the pool per worker before decoders write their own
+
+// Frames decoded but not written yet, shared by all segments of one extraction
+struct WriteQueue {
+    ThreadPool* pool;
+    TaskGroup group;
+    std::atomic<int> pending{0};
+    int limit;                          // Above this, a decoder writes the frame itself instead of queueing it
+    std::atomic<int> written_end{0};    // One past the highest frame number written
+    const char* output_path;
+    FramePackWriter* pack;              // Frames go into this pack instead of JPEG files, NULL = files
+};
+
+struct WriteTask {
+    cv::Mat frame;
+    int index;
+    WriteQueue* queue;
+};
+
+// Range of source frames decoded by one capture
+struct Segment {
+    int start;                          // First frame, reached by seeking
+    int end;                            // One past the last frame, -1 = until the video ends
+    int decoded = 0;                    // Frames read and handed to the writers
+    bool seeked = true;                 // The capture reported the requested position after seeking
+    cv::Mat next_first;                 // Frame end as this segment decodes it, to check the next segment's seek
+    cv::Mat first;                      // First frame of this segment
+};
+
+// Function to save one frame as a JPEG, or as a luma plane in the frame pack
+static void save_frame(WriteQueue* queue, const cv::Mat& frame, int index) {
+    if (queue->pack) {
+        cv::Mat luma(frame.rows, frame.cols, CV_8UC1);
+        cv::Mat bgr = frame.isContinuous() ? frame : frame.clone();
+        if (bgr.channels() == 3) {
+            luma_convert(bgr.data, luma.data, bgr.rows * bgr.cols, PIXEL_BGR);
+        } else {
+            bgr.copyTo(luma);
+        }
+        if (frame_pack_write(queue->pack, index, luma.data, luma.cols, luma.rows) == 0 && motion_config.verbosity >= VERBOSITY_FRAMES) {
+            printf("Packed frame %d\n", index);
+        }
+        return;
+    }
+    std::string path = std::string(queue->output_path) + "/frame_" + std::to_string(index) + ".jpg"; // Generate the file name
+    uint64_t start = metrics_now();
+    cv::imwrite(path, frame);
+    metrics_stage_end(METRIC_ENCODE, start);
+    if (motion_config.verbosity >= VERBOSITY_FRAMES) {
+        printf("Saved %s\n", path.c_str());             // One call per line, so lines from several threads do not mix
+    }
+}
+
+// Task to save a frame handed off by a decoder
+static void write_frame_task(void* arg) {
+    WriteTask* task = (WriteTask*)arg;
+    save_frame(task->queue, task->frame, task->index);
+    task->queue->pending.fetch_sub(1, std::memory_order_relaxed);
+    delete task;
+}
+
+// Function to queue a frame for writing, or write it here when the pool is already behind
+// The decoder's reference is released, so its next read cannot overwrite the queued pixels
+static void write_frame(WriteQueue* queue, cv::Mat& frame, int index) {
+    int end = queue->written_end.load(std::memory_order_relaxed);
+    while (end < index + 1 && !queue->written_end.compare_exchange_weak(end, index + 1, std::memory_order_relaxed)) {
+    }
+    if (queue->pending.load(std::memory_order_relaxed) >= queue->limit) {
+        save_frame(queue, frame, index);
+        return;
+    }
+    queue->pending.fetch_add(1, std::memory_order_relaxed);
+    WriteTask* task = new WriteTask{ frame, index, queue };
+    frame.release();
+    thread_pool_submit(queue->pool, &queue->group, write_frame_task, task);
+}
+
+// Segment thread: seeks its own capture to the segment start and decodes the segment in order
+static void decode_segment(const char* input_path, Segment* segment, WriteQueue* queue) {
+    cv::VideoCapture capture(input_path);
+    if (!capture.isOpened()) {
+        segment->seeked = false;
+        return;
+    }
+    if (segment->start > 0) {                           // The backend decodes forward from the keyframe before the start
+        capture.set(cv::CAP_PROP_POS_FRAMES, segment->start);
+        segment->seeked = (int)capture.get(cv::CAP_PROP_POS_FRAMES) == segment->start;
+        if (!segment->seeked) {
+            return;
+        }
+    }
+    cv::Mat frame;
+    while (segment->end < 0 || segment->start + segment->decoded <= segment->end) {
+        uint64_t start = metrics_now();
+        capture >> frame;                               // Read the next frame from the video
+        if (frame.empty())                              // Check for end of video
+            break;
+        metrics_stage_end(METRIC_DECODE, start);
+        metrics_count(METRIC_FRAMES_DECODED, 1);
+        if (segment->end >= 0 && segment->start + segment->decoded == segment->end) {
+            segment->next_first = frame;                // One frame past the segment, compared with the next segment's first
+            break;
+        }
+        if (segment->decoded == 0) {
+            segment->first = frame.clone();
+        }
+        write_frame(queue, frame, segment->start + segment->decoded);
+        segment->decoded++;
+    }
+}
+
+// Function to check that two decodes of the same source frame agree
+static bool same_frame(const cv::Mat& a, const cv::Mat& b) {
+    if (a.empty() || b.empty() || a.size() != b.size() || a.type() != b.type() || !a.isContinuous() || !b.isContinuous()) {
+        return false;
+    }
+    return std::memcmp(a.data, b.data, a.total() * a.elemSize()) == 0;
+}
+
+// Function to decode the video as segments, returns the number of frames saved or -1 if the segments do not line up
+static int extract_segments(const char* input_path, int frame_count, int num_segments, WriteQueue* queue) {
+    std::vector<Segment> segments(num_segments);
+    for (int i = 0; i < num_segments; ++i) {
+        segments[i].start = (int)((long long)frame_count * i / num_segments);
+        segments[i].end = (i == num_segments - 1) ? -1 : (int)((long long)frame_count * (i + 1) / num_segments);
+    }
+    std::vector<std::thread> decoders;
+    for (int i = 0; i < num_segments; ++i) {
+        decoders.emplace_back(decode_segment, input_path, &segments[i], queue);
+    }
+    for (std::thread& decoder : decoders) {
+        decoder.join();
+    }
+    int total = 0;
+    for (int i = 0; i < num_segments; ++i) {            // Frame counts are estimates and seeking may land off target
+        Segment& segment = segments[i];
+        bool complete = segment.end < 0 || segment.start + segment.decoded == segment.end;
+        bool aligned = i == 0 || same_frame(segments[i - 1].next_first, segment.first);
+        if (!segment.seeked || !complete || !aligned) {
+            return -1;
+        }
+        total += segment.decoded;
+    }
+    return total;
+}
 
 // Expose C++ function to be callable from C code
-extern "C" void vid_to_jpg(const char* input_path, const char* output_path) {
+// Returns the number of frames saved, or -1 if the video cannot be opened
+extern "C" int vid_to_jpg(const char* input_path, const char* output_path) {
     cv::VideoCapture capture(input_path);   // Open the video file
 
     if (!capture.isOpened()) {              // Check if the video file was successfully opened
         std::cerr << "Error: Cannot open video file " << input_path << std::endl;
-        return;                             // Exit if the video cannot be opened
+        return -1;                          // Exit if the video cannot be opened
     }
-    cv::Mat frame;                          // Holds each frame of the video
-    int frameCount = 0;                     // Frame counter
+    WriteQueue queue;
+    queue.pool = shared_thread_pool();
+    queue.limit = WRITES_PER_THREAD * thread_pool_size(queue.pool);
+    queue.output_path = output_path;
+    queue.pack = NULL;
+    double frame_rate = capture.get(cv::CAP_PROP_FPS);
+    if (is_frame_pack_path(output_path) && !(queue.pack = frame_pack_create(output_path, motion_config.pack_encoding, frame_rate))) {
+        return -1;
+    }
+    task_group_init(&queue.group);
 
-    while (true) {                          // Loop to process each frame of the video
-        capture >> frame;                   // Read the next frame from the video
-        if (frame.empty())                  // Check for end of video
-            break;
-        std::string frameFileName = std::string(output_path) + "/frame_" + std::to_string(frameCount) + ".jpg"; // Generate the file name
-        cv::imwrite(frameFileName, frame);  // Save the current frame
-        std::cout << "Saved " << frameFileName << std::endl;
-        frameCount++;                       // Increment the frame counter
+    int frameCount = -1;                    // Frame counter
+    int frames = (int)capture.get(cv::CAP_PROP_FRAME_COUNT);
+    int segments = motion_config.extract_segments > 0 ? motion_config.extract_segments : thread_pool_size(queue.pool);
+    if (segments > frames / MIN_SEGMENT_FRAMES) {       // Short videos, and streams of unknown length, are read in one pass
+        segments = frames / MIN_SEGMENT_FRAMES;
+    }
+    if (segments > 1) {
+        capture.release();                  // Every segment opens its own capture
+        frameCount = extract_segments(input_path, frames, segments, &queue);
+        thread_pool_wait(queue.pool, &queue.group);
+        if (frameCount < 0) {
+            if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+                std::cout << "Segments of " << input_path << " did not line up. Extracting in one pass..." << std::endl;
+            }
+            if (queue.pack) {                   // Start the pack over rather than leave the first attempt's frames in it
+                frame_pack_finish(queue.pack, 0);
+                if (!(queue.pack = frame_pack_create(output_path, motion_config.pack_encoding, frame_rate))) {
+                    task_group_destroy(&queue.group);
+                    return -1;
+                }
+            }
+            capture.open(input_path);
+        }
+    }
+    if (frameCount < 0) {                   // One capture from the start, frames written on the pool
+        frameCount = 0;
+        cv::Mat frame;                      // Holds each frame of the video
+        while (true) {                      // Loop to process each frame of the video
+            uint64_t start = metrics_now();
+            capture >> frame;               // Read the next frame from the video
+            if (frame.empty())              // Check for end of video
+                break;
+            metrics_stage_end(METRIC_DECODE, start);
+            metrics_count(METRIC_FRAMES_DECODED, 1);
+            write_frame(&queue, frame, frameCount);
+            frameCount++;                   // Increment the frame counter
+        }
+        thread_pool_wait(queue.pool, &queue.group);
+        for (int i = frameCount; !queue.pack && i < queue.written_end.load(); ++i) {  // Segments that read past the real end
+            std::string path = std::string(output_path) + "/frame_" + std::to_string(i) + ".jpg";
+            std::remove(path.c_str());
+        }
+    }
+    task_group_destroy(&queue.group);
+    if (queue.pack && frame_pack_finish(queue.pack, frameCount) != 0) {    // Frames past the end are left out of the table
+        return -1;
+    }
+    if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+        std::cout << "Total frames processed: " << frameCount << std::endl;
     }
-    std::cout << "Total frames processed: " << frameCount << std::endl;
+    return frameCount;
 }
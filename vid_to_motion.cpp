@@ -0,0 +1,357 @@
+/**************************************************************
+Filename: vid_to_motion.cpp
+Description:
+  Streams frames from a video file straight into the motion
+  detection stages. Decoded frames are converted to grayscale,
+  differenced and thresholded in memory, so no intermediate
+  frame JPEGs are written to disk and decoded again. Also runs
+  the real-time mode, which paces a file at its native rate or
+  follows a live device and keeps each frame's latency within a
+  budget by dropping or downscaling frames.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cctype>
+#include <cstring>
+#include <csignal>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+extern "C" {
+#include "image_utils.h"
+#include "handle_motion.h"
+#include "motion_kernel.h"
+#include "motion_config.h"
+#include "background_model.h"
+#include "metrics.h"
+}
+
+#define LATENCY_BUCKETS 1024            // Histogram buckets, each 2% wider than the last, from 1 us
+#define LATENCY_BUCKET_GROWTH 1.02
+#define REALTIME_STATUS_INTERVAL 10     // Seconds between progress lines in real-time mode
+#define REALTIME_MAX_SCALE 8            // Coarsest downscale the real-time mode falls back to
+#define REALTIME_CALM_FRAMES 30         // Frames well under budget before the resolution goes back up
+
+// Detection state carried from one frame to the next
+struct MotionDetector {
+    cv::Mat prev_gray;                  // Reference frame in pairwise mode
+    cv::Mat staging;                    // Full-resolution grayscale before downscaling
+    std::vector<unsigned char> motion;  // Thresholded motion mask, reused across frames
+    std::vector<unsigned char> coarse;  // Pyramid mode: coarse levels of the current and reference frames
+    std::vector<unsigned char> prev_coarse;
+    BackgroundModel* background = NULL; // Running background, only in background mode
+};
+
+// Function to convert a decoded BGR frame to grayscale at 1/scale resolution
+static void frame_to_gray(const cv::Mat& frame, cv::Mat& gray, cv::Mat& staging, int scale) {
+    uint64_t start = metrics_now();
+    cv::Mat& luma = (scale > 1) ? staging : gray;                       // Scaled runs convert into a staging buffer first
+    if (frame.channels() == 3 && frame.isContinuous()) {
+        luma.create(frame.rows, frame.cols, CV_8UC1);
+        luma_convert(frame.data, luma.data, frame.rows * frame.cols, PIXEL_BGR);   // Decoded frames are BGR, convert to grayscale
+    } else if (frame.channels() == 3) {
+        cv::cvtColor(frame, luma, cv::COLOR_BGR2GRAY);
+    } else {
+        frame.copyTo(luma);                                             // Already single channel
+    }
+    if (scale > 1) {                                                    // Low-resolution detection mode, same factor as JPEG input
+        double factor = 1.0 / scale;
+        cv::resize(staging, gray, cv::Size(), factor, factor, cv::INTER_AREA);
+    }
+    metrics_stage_end(METRIC_CONVERT, start);
+}
+
+// Function to detect motion in one grayscale frame and save the result
+// Returns 1 if a mask was saved, 0 if the frame only became the reference; gray is left holding a free buffer
+static int detect_frame(MotionDetector& detector, cv::Mat& gray, const char* output_path, int index) {
+    int saved = 0;
+    if (motion_config.detect_mode == DETECT_BACKGROUND) {               // Compare against the running background instead of the previous frame
+        BackgroundModel*& background = detector.background;
+        if (background && (background->width != gray.cols || background->height != gray.rows)) {
+            background_model_destroy(background);
+            background = NULL;
+        }
+        if (!background) {
+            background = background_model_create(gray.cols, gray.rows);
+        }
+        detector.motion.resize((size_t)gray.cols * gray.rows);
+        int motion_pixels = background_model_apply(background, gray.data, detector.motion.data(), motion_roi(output_path, gray.cols, gray.rows),
+                                                   motion_config.threshold, motion_config.learning_shift);
+        if (motion_pixels >= 0) {                                       // The first frame only seeds the model
+            save_motion_frame(output_path, index, detector.motion.data(), gray.cols, gray.rows, motion_pixels);
+            saved = 1;
+        }
+    } else {
+        int width = gray.cols;
+        int height = gray.rows;
+        if (motion_config.pyramid) {                                    // Each frame's coarse level is built once and kept as the next reference
+            detector.coarse.resize((size_t)((width + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR) * ((height + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR));
+            luma_box8(gray.data, width, height, detector.coarse.data());
+        }
+        if (!detector.prev_gray.empty() && detector.prev_gray.size() == gray.size()) {  // The first frame has no reference
+            GrayFrame prev = { detector.prev_gray.data, width, height, motion_config.pyramid ? detector.prev_coarse.data() : NULL };
+            GrayFrame cur = { gray.data, width, height, motion_config.pyramid ? detector.coarse.data() : NULL };
+            detector.motion.resize((size_t)width * height);
+            int motion_pixels = detect_motion(output_path, &prev, &cur, detector.motion.data());  // Difference and threshold in one pass, region only
+            save_motion_frame(output_path, index, detector.motion.data(), width, height, motion_pixels);    // JPEG mask or motion event
+            saved = 1;
+        }
+        detector.coarse.swap(detector.prev_coarse);
+    }
+    cv::swap(gray, detector.prev_gray);                                 // Current frame becomes the reference, its old buffer is reused
+    return saved;
+}
+
+// Expose C++ function to be callable from C code
+// Returns the number of frames processed, or -1 if the video or the outputs cannot be opened
+extern "C" int vid_to_motion(const char* input_path, const char* output_path) {
+    cv::VideoCapture capture(input_path);   // Open the video file
+
+    if (!capture.isOpened()) {              // Check if the video file was successfully opened
+        std::cerr << "Error: Cannot open video file " << input_path << std::endl;
+        return -1;                          // Exit if the video cannot be opened
+    }
+    double frameRate = capture.get(cv::CAP_PROP_FPS);
+    if (frameRate <= 0.0) {                 // Some containers do not report a rate
+        frameRate = motion_config.frame_rate;
+    }
+    if (open_motion_outputs(output_path, frameRate, 0, 1) != 0) {    // The first frame is only a reference
+        return -1;                          // Index or event stream could not be created
+    }
+    cv::Mat frame;                          // Holds each decoded frame of the video
+    cv::Mat gray;                           // Grayscale copy of the current frame
+    MotionDetector detector;
+    int frameCount = 0;                     // Frame counter
+
+    while (true) {                          // Loop to process each frame of the video
+        uint64_t start = metrics_now();
+        capture >> frame;                   // Read the next frame from the video
+        if (frame.empty())                  // Check for end of video
+            break;
+        metrics_stage_end(METRIC_DECODE, start);
+        metrics_count(METRIC_FRAMES_DECODED, 1);
+        frame_to_gray(frame, gray, detector.staging, motion_config.decode_scale);
+        if (!detect_frame(detector, gray, output_path, frameCount) && frameCount > 0) {
+            skip_motion_frame(output_path, frameCount);     // Size changed, the frame only became the reference
+        }
+        frameCount++;                       // Increment the frame counter
+    }
+    background_model_destroy(detector.background);
+    close_motion_outputs(output_path);
+    if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+        std::cout << "Total frames processed: " << frameCount << std::endl;
+    }
+    return frameCount;
+}
+
+// Per-frame latencies, kept as a log-scale histogram so a live feed can run for days in fixed memory
+struct LatencyHistogram {
+    uint64_t counts[LATENCY_BUCKETS] = {};
+    uint64_t total = 0;
+    double max_ms = 0.0;
+
+    void add(uint64_t nanoseconds) {
+        double us = nanoseconds / 1000.0;
+        int bucket = us <= 1.0 ? 0 : (int)(std::log(us) / std::log(LATENCY_BUCKET_GROWTH)) + 1;
+        counts[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+        total++;
+        max_ms = std::max(max_ms, nanoseconds / 1e6);
+    }
+
+    // Latency in milliseconds below which the given fraction of frames fall, to within the 2% bucket width
+    double percentile(double fraction) const {
+        uint64_t target = (uint64_t)std::ceil(fraction * total);
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= target && seen > 0) {
+                return std::min(std::pow(LATENCY_BUCKET_GROWTH, i) / 1000.0, max_ms);
+            }
+        }
+        return max_ms;
+    }
+};
+
+// Newest captured frame waiting for the detector; a frame that is not taken in time is replaced, never queued
+struct FrameSlot {
+    std::mutex lock;
+    std::condition_variable ready;
+    cv::Mat frame;
+    int index = -1;                     // Source frame number, -1 when empty
+    uint64_t arrival = 0;               // When the frame became available, latency is measured from here
+    bool finished = false;              // The source ended or the run was stopped
+};
+
+static volatile std::sig_atomic_t stop_requested = 0;
+
+// Ctrl+C ends a real-time run cleanly, so the outputs are flushed and the report is printed
+static void request_stop(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+// Capture thread: reads the source as fast as it delivers, pacing files at their native rate
+static void capture_frames(cv::VideoCapture* capture, FrameSlot* slot, bool paced, double frame_rate) {
+    uint64_t start = metrics_now();
+    uint64_t duration = (uint64_t)(motion_config.run_duration * 1e9);
+    cv::Mat frame;
+    for (int index = 0; !stop_requested; ++index) {
+        uint64_t begin = metrics_now();
+        if (!capture->read(frame) || frame.empty()) {
+            break;
+        }
+        metrics_stage_end(METRIC_DECODE, begin);
+        metrics_count(METRIC_FRAMES_DECODED, 1);
+        uint64_t arrival = metrics_now();
+        if (paced) {                                                    // A replayed frame is due at its presentation time, even if decoding ran late
+            uint64_t due = start + (uint64_t)(index * 1e9 / frame_rate);
+            if (arrival < due) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - arrival));
+            }
+            arrival = due;
+        }
+        if (duration > 0 && arrival - start >= duration) {
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> guard(slot->lock);
+            cv::swap(slot->frame, frame);                               // An untaken frame is dropped here, its buffer reused for the next read
+            slot->index = index;
+            slot->arrival = arrival;
+        }
+        slot->ready.notify_one();
+    }
+    std::lock_guard<std::mutex> guard(slot->lock);
+    slot->finished = true;
+    slot->ready.notify_one();
+}
+
+// Function to print the frame counts and latency percentiles of a real-time run
+static void print_realtime_report(const char* label, int captured, int dropped, int late, int scale, const LatencyHistogram& latency) {
+    printf("%s: %d frames, %llu processed, %d dropped behind, %d over budget, scale 1/%d. "
+           "Latency p50 %.1f ms, p99 %.1f ms, max %.1f ms.\n", label, captured, (unsigned long long)latency.total,
+           dropped, late, scale, latency.percentile(0.50), latency.percentile(0.99), latency.max_ms);
+    fflush(stdout);
+}
+
+// Expose C++ function to be callable from C code
+// Runs detection on a camera (device number or /dev/videoN) or a file replayed in real time, returns 0 on success
+extern "C" int run_realtime(const char* source, const char* output_path) {
+    bool device = true;                                                 // All digits means a camera index
+    for (const char* c = source; *c; ++c) {
+        device = device && std::isdigit((unsigned char)*c);
+    }
+    cv::VideoCapture capture;
+    if (device) {
+        capture.open(atoi(source));
+    } else {
+        capture.open(source);
+    }
+    if (!capture.isOpened()) {
+        std::cerr << "Error: Cannot open video source " << source << std::endl;
+        return -1;
+    }
+    bool live = device || strncmp(source, "/dev/", 5) == 0;             // Devices deliver frames in real time themselves
+    if (live) {
+        capture.set(cv::CAP_PROP_BUFFERSIZE, 1);                        // Keep the driver from queueing stale frames, where supported
+    }
+    double frameRate = capture.get(cv::CAP_PROP_FPS);
+    if (frameRate <= 0.0) {
+        frameRate = motion_config.frame_rate;
+    }
+    if (open_motion_outputs(output_path, frameRate, 0, 0) != 0) {       // Every frame is accounted for in the video, saved or skipped
+        return -1;
+    }
+
+    uint64_t budget = (uint64_t)(motion_config.latency_budget_ms * 1e6);
+    int base_scale = motion_config.decode_scale;
+    int scale = base_scale;
+    int calm_frames = 0;
+    double service = 0.0;                                               // Smoothed time to process one frame, in nanoseconds
+    int last_index = -1;
+    int dropped = 0;
+    int late = 0;
+    LatencyHistogram latency;
+    MotionDetector detector;
+    cv::Mat frame, gray;
+    FrameSlot slot;
+
+    stop_requested = 0;
+    void (*previous_handler)(int) = std::signal(SIGINT, request_stop);
+    if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+        printf("Real-time: %s at %.2f fps, %.0f ms latency budget. Press Ctrl+C to stop.\n", source, frameRate,
+               motion_config.latency_budget_ms);
+    }
+    std::thread capturer(capture_frames, &capture, &slot, !live, frameRate);
+    uint64_t next_status = metrics_now() + REALTIME_STATUS_INTERVAL * 1000000000ull;
+
+    while (true) {
+        int index;
+        uint64_t arrival;
+        {
+            std::unique_lock<std::mutex> guard(slot.lock);
+            slot.ready.wait(guard, [&slot] { return slot.index >= 0 || slot.finished; });
+            if (slot.index < 0) {
+                break;
+            }
+            cv::swap(frame, slot.frame);
+            index = slot.index;
+            arrival = slot.arrival;
+            slot.index = -1;
+        }
+        for (int skipped = last_index + 1; skipped < index; ++skipped) {    // Frames replaced before the detector got to them
+            skip_motion_frame(output_path, skipped);
+            dropped++;
+            metrics_count(METRIC_FRAMES_DROPPED, 1);
+        }
+        last_index = index;
+
+        uint64_t begin = metrics_now();
+        if (begin - arrival > budget) {                                 // Already too old to meet the budget, the next frame is fresher
+            skip_motion_frame(output_path, index);
+            late++;
+            metrics_count(METRIC_FRAMES_DROPPED, 1);
+            continue;
+        }
+        frame_to_gray(frame, gray, detector.staging, scale);
+        if (!detect_frame(detector, gray, output_path, index)) {
+            skip_motion_frame(output_path, index);                      // Reference frame, no mask
+        }
+        uint64_t done = metrics_now();
+        latency.add(done - arrival);
+
+        service = (service == 0.0) ? (double)(done - begin) : 0.9 * service + 0.1 * (done - begin);
+        if (service > budget * 0.5 && scale < REALTIME_MAX_SCALE) {     // Halve the resolution before frames start missing the budget
+            scale *= 2;
+            service /= 4;                                               // A quarter of the pixels
+            calm_frames = 0;
+        } else if (service < budget * 0.1 && scale > base_scale) {      // Well under budget for a while, go back up
+            if (++calm_frames >= REALTIME_CALM_FRAMES) {
+                scale /= 2;
+                service *= 4;
+                calm_frames = 0;
+            }
+        } else {
+            calm_frames = 0;
+        }
+
+        if (motion_config.verbosity >= VERBOSITY_NORMAL && done >= next_status) {
+            print_realtime_report("Real-time", index + 1, dropped, late, scale, latency);
+            next_status = done + REALTIME_STATUS_INTERVAL * 1000000000ull;
+        }
+    }
+    capturer.join();
+    std::signal(SIGINT, previous_handler);
+    background_model_destroy(detector.background);
+    close_motion_outputs(output_path);
+    if (motion_config.verbosity >= VERBOSITY_NORMAL) {
+        print_realtime_report("Real-time run", last_index + 1, dropped, late, scale, latency);
+    }
+    return 0;
+}
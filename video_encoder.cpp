@@ -0,0 +1,65 @@
+/**************************************************************
+Filename: video_encoder.cpp
+Description:
+  Writes grayscale frames to a video file with OpenCV's
+  VideoWriter. Frames are scaled to the video resolution in
+  memory, so motion masks go from detection to the video
+  without a JPEG round trip or an external ffmpeg process.
+Author: Cade Andrae
+Date: 10/16/26
+**************************************************************/
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+
+extern "C" {
+#include "motion_video.h"
+#include "motion_config.h"
+}
+
+struct VideoEncoder {
+    cv::VideoWriter writer;
+    cv::Size size;              // Resolution of the video
+    cv::Mat scaled;             // Reused staging buffers
+    cv::Mat color;
+};
+
+// Expose C++ functions to be callable from C code
+extern "C" void* video_encoder_open(const char* path, double frame_rate, int width, int height) {
+    VideoEncoder* encoder = new VideoEncoder();
+    encoder->size = cv::Size(width, height);
+    static const char* const codecs[VIDEO_CODEC_COUNT] = VIDEO_CODECS;
+    for (int i = 0; i < VIDEO_CODEC_COUNT; ++i) {                           // The first codec the OpenCV build can encode
+        const char* codec = codecs[i];
+        int fourcc = cv::VideoWriter::fourcc(codec[0], codec[1], codec[2], codec[3]);
+        if (encoder->writer.open(path, fourcc, frame_rate, encoder->size, true)) {
+            if (i == VIDEO_CODEC_COUNT - 1 && motion_config.verbosity >= VERBOSITY_NORMAL) {    // Only the last codec is not H.264
+                std::cout << "Note: This OpenCV build has no H.264 encoder. Writing " << path << " as MPEG-4 Part 2 (" << codec << ")."
+                          << std::endl;
+            }
+            return encoder;
+        }
+    }
+    std::cerr << "Error: Cannot open video writer for " << path << std::endl;
+    delete encoder;
+    return NULL;
+}
+
+extern "C" int video_encoder_write(void* handle, const unsigned char* gray, int width, int height) {
+    VideoEncoder* encoder = static_cast<VideoEncoder*>(handle);
+    cv::Mat frame(height, width, CV_8UC1, const_cast<unsigned char*>(gray));  // Wraps the mask, no copy
+    const cv::Mat* source = &frame;
+    if (frame.size() != encoder->size) {                                    // Scale in memory to the requested resolution
+        cv::resize(frame, encoder->scaled, encoder->size, 0, 0, cv::INTER_NEAREST);    // Masks are binary, keep them sharp
+        source = &encoder->scaled;
+    }
+    cv::cvtColor(*source, encoder->color, cv::COLOR_GRAY2BGR);              // Codecs expect three channels
+    encoder->writer.write(encoder->color);
+    return 0;
+}
+
+extern "C" void video_encoder_close(void* handle) {
+    VideoEncoder* encoder = static_cast<VideoEncoder*>(handle);
+    encoder->writer.release();              // Finishes the container
+    delete encoder;
+}